@@ -0,0 +1,221 @@
+/**
+ * @file  asyncui.cpp
+ * @brief Draw progress from a separate thread, so the UI never holds up I/O.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include "asyncui.hpp"
+
+AsyncCallback::AsyncCallback(CheckCallback *cb)
+	throw ()
+	: cb(cb),
+	  writing(false),
+	  threaded(false),
+	  stopping(false),
+	  rateUpdated(false),
+	  pos(0),
+	  fail(0),
+	  sawGood(0),
+	  updated(0),
+	  aborted(0)
+{
+	pthread_mutex_init(&this->lock, NULL);
+	// Time the redraws with the monotonic clock, so changing the system time
+	// does not stall the display
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&this->wake, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+AsyncCallback::~AsyncCallback()
+	throw ()
+{
+	this->stop();
+	pthread_cond_destroy(&this->wake);
+	pthread_mutex_destroy(&this->lock);
+}
+
+bool AsyncCallback::resumeWrite()
+	throw ()
+{
+	return this->cb->resumeWrite();
+}
+
+void AsyncCallback::writeStart(block_t startBlock, block_t numBlocks)
+	throw ()
+{
+	this->cb->writeStart(startBlock, numBlocks);
+	this->start(true);
+	return;
+}
+
+void AsyncCallback::writeProgress(block_t b)
+	throw ()
+{
+	this->publish(b, false);
+	return;
+}
+
+void AsyncCallback::writeFinish()
+	throw ()
+{
+	this->stop();
+	this->cb->writeFinish();
+	return;
+}
+
+void AsyncCallback::readStart(block_t startBlock, block_t numBlocks)
+	throw ()
+{
+	this->cb->readStart(startBlock, numBlocks);
+	this->start(false);
+	return;
+}
+
+bool AsyncCallback::readProgress(block_t b, bool fail)
+	throw ()
+{
+	this->publish(b, fail);
+	return !__sync_fetch_and_add(&this->aborted, 0);
+}
+
+void AsyncCallback::readFinish()
+	throw ()
+{
+	this->stop();
+	this->cb->readFinish();
+	return;
+}
+
+void AsyncCallback::checkComplete()
+	throw ()
+{
+	this->cb->checkComplete();
+	return;
+}
+
+void AsyncCallback::rateUpdate(const RateStatus& status)
+	throw ()
+{
+	if (!this->threaded) {
+		this->cb->rateUpdate(status);
+		return;
+	}
+	pthread_mutex_lock(&this->lock);
+	this->rate = status;
+	this->rateUpdated = true;
+	pthread_mutex_unlock(&this->lock);
+	return;
+}
+
+void AsyncCallback::start(bool write)
+	throw ()
+{
+	this->stop();
+	this->writing = write;
+	__sync_lock_test_and_set(&this->updated, 0);
+	__sync_lock_test_and_set(&this->sawGood, 0);
+	__sync_lock_test_and_set(&this->fail, 0);
+	__sync_lock_test_and_set(&this->aborted, 0);
+	this->stopping = false;
+	this->rateUpdated = false;
+	// Without a thread the progress calls go straight through, as before
+	this->threaded =
+		pthread_create(&this->thread, NULL, AsyncCallback::run, this) == 0;
+	return;
+}
+
+void AsyncCallback::stop()
+	throw ()
+{
+	if (!this->threaded) return;
+	pthread_mutex_lock(&this->lock);
+	this->stopping = true;
+	pthread_cond_signal(&this->wake);
+	pthread_mutex_unlock(&this->lock);
+	pthread_join(this->thread, NULL);
+	this->threaded = false;
+	this->sample();
+	return;
+}
+
+void AsyncCallback::publish(block_t b, bool fail)
+	throw ()
+{
+	__sync_lock_test_and_set(&this->pos, b);
+	__sync_lock_test_and_set(&this->fail, fail ? 1 : 0);
+	if (!fail) __sync_lock_test_and_set(&this->sawGood, 1);
+	__sync_synchronize();
+	__sync_lock_test_and_set(&this->updated, 1);
+	if (!this->threaded) this->sample();
+	return;
+}
+
+void AsyncCallback::sample()
+	throw ()
+{
+	if (!__sync_lock_test_and_set(&this->updated, 0)) return;
+	pthread_mutex_lock(&this->lock);
+	bool newRate = this->rateUpdated;
+	RateStatus rate = this->rate;
+	this->rateUpdated = false;
+	pthread_mutex_unlock(&this->lock);
+	if (newRate) this->cb->rateUpdate(rate);
+	block_t b = __sync_fetch_and_add(&this->pos, 0);
+	if (this->writing) {
+		this->cb->writeProgress(b);
+		return;
+	}
+	bool good = __sync_lock_test_and_set(&this->sawGood, 0);
+	bool fail = __sync_fetch_and_add(&this->fail, 0);
+	// A good block since the last sample ended any run of errors, even if
+	// another one has started since
+	if (good && fail && !this->cb->readProgress(b, false)) {
+		__sync_lock_test_and_set(&this->aborted, 1);
+	}
+	if (!this->cb->readProgress(b, fail)) {
+		__sync_lock_test_and_set(&this->aborted, 1);
+	}
+	return;
+}
+
+void *AsyncCallback::run(void *self)
+	throw ()
+{
+	AsyncCallback *ui = (AsyncCallback *)self;
+	pthread_mutex_lock(&ui->lock);
+	while (!ui->stopping) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += ASYNCUI_REFRESH_MS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ui->wake, &ui->lock, &deadline);
+		if (ui->stopping) break;
+		// Never call into the real UI with the lock held
+		pthread_mutex_unlock(&ui->lock);
+		ui->sample();
+		pthread_mutex_lock(&ui->lock);
+	}
+	pthread_mutex_unlock(&ui->lock);
+	return NULL;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file  asyncui.hpp
+ * @brief Draw progress from a separate thread, so the UI never holds up I/O.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASYNCUI_HPP_
+#define ASYNCUI_HPP_
+
+#include <pthread.h>
+#include "check.hpp"
+
+/// Milliseconds between redraws of the progress display.
+#define ASYNCUI_REFRESH_MS 200
+
+/// Pass progress on to a UI from its own thread.
+/**
+ * writeProgress() and readProgress() only store where the phase has got to
+ * in a few counters, which a UI thread started by writeStart() and
+ * readStart() samples every ASYNCUI_REFRESH_MS and passes on to the real
+ * UI.  A terminal that is slow to draw, or not being drawn at all, then only
+ * makes the display lag instead of stopping the test.
+ *
+ * The other calls are passed straight on from the calling thread, with the
+ * UI thread stopped, so the real UI is never called from two threads at
+ * once.  If the real UI asks to abort, the next readProgress() returns false.
+ * rateUpdate() is held back with the position, and the latest status is
+ * passed on just before it.
+ */
+class AsyncCallback: virtual public CheckCallback
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param cb
+		 *   UI to pass everything on to.
+		 */
+		AsyncCallback(CheckCallback *cb)
+			throw ();
+
+		virtual ~AsyncCallback()
+			throw ();
+
+		virtual bool resumeWrite()
+			throw ();
+
+		virtual void writeStart(block_t startBlock, block_t numBlocks)
+			throw ();
+
+		virtual void writeProgress(block_t b)
+			throw ();
+
+		virtual void writeFinish()
+			throw ();
+
+		virtual void readStart(block_t startBlock, block_t numBlocks)
+			throw ();
+
+		virtual bool readProgress(block_t b, bool fail)
+			throw ();
+
+		virtual void readFinish()
+			throw ();
+
+		virtual void checkComplete()
+			throw ();
+
+		virtual void rateUpdate(const RateStatus& status)
+			throw ();
+
+	protected:
+		CheckCallback *cb;     ///< UI to pass everything on to
+		bool writing;          ///< Is the current phase writing?
+		bool threaded;         ///< Is the UI thread running?
+		bool stopping;         ///< Should the UI thread exit?  Guarded by lock
+		RateStatus rate;       ///< Latest rate not yet passed on
+		bool rateUpdated;      ///< Is there a rate to pass on?
+		pthread_t thread;      ///< UI thread
+		pthread_mutex_t lock;  ///< Guards stopping, rate and rateUpdated
+		pthread_cond_t wake;   ///< Signalled to stop the UI thread early
+
+		// Shared with the UI thread, only accessed with __sync builtins
+		block_t pos;           ///< Last position passed to the progress call
+		int fail;              ///< Was the last block reported a failure?
+		int sawGood;           ///< Reported a good block since the last sample?
+		int updated;           ///< Anything new since the last sample?
+		int aborted;           ///< Has the real UI asked to stop?
+
+		/// Start the UI thread for a new phase.
+		void start(bool write)
+			throw ();
+
+		/// Stop the UI thread and pass on anything it has not drawn yet.
+		void stop()
+			throw ();
+
+		/// Note a position, then pass it on if there is no UI thread.
+		void publish(block_t b, bool fail)
+			throw ();
+
+		/// Pass the latest position on to the real UI, if it has changed.
+		void sample()
+			throw ();
+
+		/// Thread entry point.
+		static void *run(void *self)
+			throw ();
+};
+
+#endif // ASYNCUI_HPP_
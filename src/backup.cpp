@@ -0,0 +1,607 @@
+/**
+ * @file  backup.cpp
+ * @brief Test a device while keeping the data on it.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "backup.hpp"
+#include "check.hpp"
+#include "classify.hpp"
+#include "crc32c.hpp"
+
+#if (BACKUP_REGION_SIZE % BACKUP_CHUNK_SIZE) || (BACKUP_CHUNK_SIZE % DATA_BLOCK_SIZE)
+#error BACKUP_REGION_SIZE must be a multiple of BACKUP_CHUNK_SIZE, which must be a multiple of DATA_BLOCK_SIZE
+#endif
+
+/// Size of the header before each region's data in the backup file.
+#define BACKUP_HEADER_LEN 32
+
+/// Write a 64-bit little-endian value to a buffer
+static void store64le(uint8_t *dest, uint64_t val)
+{
+	for (unsigned int i = 0; i < 8; i++) dest[i] = (val >> (i * 8)) & 0xFF;
+	return;
+}
+
+/// Read a 64-bit little-endian value from a buffer
+static uint64_t load64le(const uint8_t *src)
+{
+	uint64_t val = 0;
+	for (unsigned int i = 0; i < 8; i++) val |= (uint64_t)src[i] << (i * 8);
+	return val;
+}
+
+/// Extent for a block that could not be read.
+static Extent readErrorExtent(block_t b)
+{
+	Extent ext;
+	ext.start = b * SECTORS_PER_BLOCK;
+	ext.len = SECTORS_PER_BLOCK;
+	ext.type = BAD_READ_ERROR;
+	ext.movedFrom = 0;
+	ext.flipsUp = ext.flipsDown = 0;
+	return ext;
+}
+
+/// Write all of a buffer to a file, or throw an error.
+static void writeAll(int fd, const uint8_t *buf, unsigned int len,
+	const std::string& path)
+{
+	while (len > 0) {
+		ssize_t n = ::write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			throw error("Unable to write to " + path + ": " + strerror(errno));
+		}
+		buf += n;
+		len -= n;
+	}
+	return;
+}
+
+/// Read all of a buffer from a file, or throw an error.
+static void readAll(int fd, uint8_t *buf, unsigned int len, block_t off,
+	const std::string& path)
+{
+	while (len > 0) {
+		ssize_t n = ::pread(fd, buf, len, off);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			throw error("Unable to read from " + path + ": " + strerror(errno));
+		}
+		if (n == 0) throw error(path + " is shorter than expected");
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return;
+}
+
+BackupCheck::BackupCheck(Device *dev, const std::string& backupPath)
+	throw (error)
+	: dev(dev),
+	  backupPath(backupPath),
+	  journalPath(backupPath + ".journal"),
+	  backupFD(-1),
+	  journalFD(-1),
+	  firstRegion(0),
+	  endRegion(0),
+	  pattern(PATTERN_BLOCKNUM, PATTERN_DEFAULT_KEY),
+	  wrapBlock(0),
+	  overwrite(false),
+	  testBuf(NULL),
+	  copyBuf(NULL)
+{
+	block_t len = this->dev->size();
+	this->numBlocks = len / DATA_BLOCK_SIZE;
+	if (this->numBlocks == 0) throw error("Device is too small to test");
+	block_t usable = this->numBlocks * DATA_BLOCK_SIZE;
+	this->numRegions = (usable + BACKUP_REGION_SIZE - 1) / BACKUP_REGION_SIZE;
+	this->unreadable.assign(this->numRegions, false);
+
+	void *buf;
+	if (posix_memalign(&buf, DEVICE_ALIGN, BACKUP_CHUNK_SIZE) != 0) {
+		throw error("Out of memory allocating I/O buffers");
+	}
+	this->testBuf = (uint8_t *)buf;
+	if (posix_memalign(&buf, DEVICE_ALIGN, BACKUP_CHUNK_SIZE) != 0) {
+		free(this->testBuf);
+		throw error("Out of memory allocating I/O buffers");
+	}
+	this->copyBuf = (uint8_t *)buf;
+}
+
+BackupCheck::~BackupCheck()
+	throw ()
+{
+	if (this->backupFD >= 0) ::close(this->backupFD);
+	if (this->journalFD >= 0) ::close(this->journalFD);
+	free(this->testBuf);
+	free(this->copyBuf);
+}
+
+void BackupCheck::setPattern(const Pattern& pattern)
+	throw ()
+{
+	this->pattern = pattern;
+	return;
+}
+
+void BackupCheck::setOverwrite(bool overwrite)
+	throw ()
+{
+	this->overwrite = overwrite;
+	return;
+}
+
+unsigned int BackupCheck::recover()
+	throw (error)
+{
+	this->backupFD = ::open(this->backupPath.c_str(),
+		O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (this->backupFD < 0) {
+		throw error("Unable to open " + this->backupPath + ": " + strerror(errno));
+	}
+	this->journalFD = ::open(this->journalPath.c_str(),
+		O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (this->journalFD < 0) {
+		throw error("Unable to open " + this->journalPath + ": " + strerror(errno));
+	}
+
+	std::ostringstream id;
+	id << BACKUP_JOURNAL_ID << ' ' << this->numBlocks << ' ' << BACKUP_REGION_SIZE;
+
+	std::ifstream in(this->journalPath.c_str());
+	std::string line;
+	if (!std::getline(in, line)) {
+		// New journal, so anything in the backup file is from a finished run or
+		// is not ours at all.  Either way it is not emptied without asking.
+		struct stat st;
+		if (fstat(this->backupFD, &st) < 0) {
+			throw error("Unable to check " + this->backupPath + ": "
+				+ strerror(errno));
+		}
+		if (st.st_size > 0) {
+			if (!this->overwrite) {
+				throw error(this->backupPath + " already holds data and there is no "
+					"journal to say it is from an interrupted run.  Remove it, or use "
+					"--overwrite-backup to replace it.");
+			}
+			std::cout << "Emptying " << this->backupPath << ", which held "
+				<< st.st_size / 1024 << " kB from an earlier run" << std::endl;
+		}
+		if (ftruncate(this->backupFD, 0) < 0) {
+			throw error("Unable to truncate " + this->backupPath + ": "
+				+ strerror(errno));
+		}
+		this->journal(id.str());
+		return 0;
+	}
+	if (line != id.str()) {
+		throw error(this->journalPath + " is for a different device");
+	}
+
+	// Replay the journal.  A line cut short by a crash is ignored, as the step
+	// it records did not finish.
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		std::string step;
+		unsigned int region;
+		if (!(fields >> step >> region) || (region >= this->numRegions)) continue;
+		if (step == "backup") {
+			BackupRecord rec;
+			if (fields >> rec.fileOffset >> rec.crc) this->pending[region] = rec;
+		} else if (step == "restored") {
+			this->pending.erase(region);
+		} else if (step == "tested") {
+			if (region + 1 > this->firstRegion) this->firstRegion = region + 1;
+		} else if (step == "bad") {
+			Extent e;
+			unsigned int type;
+			if ((fields >> e.start >> e.len >> type >> e.movedFrom >> e.flipsUp
+				>> e.flipsDown) && (type < BAD_TYPE_COUNT)
+			) {
+				e.type = (BadType)type;
+				this->badSectors.add(e);
+			}
+		} else if (step == "wrapped") {
+			block_t wrap;
+			if (fields >> wrap) this->wrapBlock = wrap;
+		}
+	}
+
+	unsigned int count = 0;
+	while (!this->pending.empty()) {
+		unsigned int region = this->pending.begin()->first;
+		std::cout << "Restoring region " << region << " from an interrupted run"
+			<< std::endl;
+		this->restore(region);
+		count++;
+	}
+	return count;
+}
+
+void BackupCheck::run()
+	throw (error)
+{
+	this->endRegion = this->firstRegion;
+	// An interrupted run may have tested every region, in which case there is
+	// only the cleanup left to do
+	if (this->firstRegion < this->numRegions) {
+		this->backup(this->firstRegion);
+	}
+	for (unsigned int r = this->firstRegion; r < this->numRegions; r++) {
+		std::cout << "\rTesting region " << r + 1 << " of " << this->numRegions
+			<< " [" << r * 100 / this->numRegions << "%] " << std::flush;
+
+		// Restore the previous region and back up the next one while this one
+		// is tested
+		bool skip = this->unreadable[r];
+		HelperTask task;
+		task.check = this;
+		task.restoreRegion = (r > this->firstRegion) ? (int)r - 1 : -1;
+		task.backupRegion = (r + 1 < this->numRegions) ? (int)r + 1 : -1;
+		task.failed = false;
+		pthread_t thread;
+		bool threaded = pthread_create(&thread, NULL, BackupCheck::helper, &task) == 0;
+
+		ExtentList found;
+		if (!skip) this->test(r, &found);
+
+		if (threaded) pthread_join(thread, NULL);
+		else BackupCheck::helper(&task);
+		if (task.failed) {
+			throw error(task.message + "\nThe original data is still in "
+				+ this->backupPath + ", run again to restore it.");
+		}
+		// Keep what was found, so a resumed run still reports it
+		this->journalBad(r, found);
+		for (std::vector<Extent>::const_iterator
+			i = found.extents.begin(); i != found.extents.end(); i++
+		) {
+			this->badSectors.add(*i);
+		}
+		bool wrapped = !skip && this->checkCanaries(r);
+		if (wrapped) {
+			std::ostringstream line;
+			line << "wrapped " << r << ' ' << this->wrapBlock;
+			this->journal(line.str());
+		}
+		std::ostringstream line;
+		line << "tested " << r;
+		this->journal(line.str());
+		this->endRegion = r + 1;
+
+		if (wrapped) break;
+	}
+	std::cout << "\rTesting complete, restoring last region...   " << std::flush;
+	while (!this->pending.empty()) this->restore(this->pending.begin()->first);
+	std::cout << "\n";
+
+	for (std::vector<Extent>::const_iterator
+		i = this->backupErrors.extents.begin(); i != this->backupErrors.extents.end(); i++
+	) {
+		this->badSectors.add(*i);
+	}
+	this->badSectors.sort();
+
+	// Everything is back where it was, so the journal is no longer needed
+	::close(this->journalFD);
+	this->journalFD = -1;
+	::unlink(this->journalPath.c_str());
+	return;
+}
+
+bool BackupCheck::foundBad() const
+	throw ()
+{
+	return !this->badSectors.empty() || this->wrapBlock;
+}
+
+void BackupCheck::report(std::ostream& out) const
+	throw ()
+{
+	block_t numSectors = this->numBlocks * SECTORS_PER_BLOCK;
+	if (this->firstRegion > 0) {
+		out << "The first " << this->regionStart(this->firstRegion) / 1048576
+			<< "MB were tested by an interrupted run.\nAny bad sectors it found are "
+			"included below.\n";
+	}
+	if (this->wrapBlock) {
+		out << "The device wrapped around after "
+			<< this->wrapBlock * DATA_BLOCK_SIZE / 1048576 << "MB ("
+			<< this->wrapBlock * SECTORS_PER_BLOCK << " sectors).  It is only this "
+			"large, not the " << numSectors * SECTOR_SIZE / 1048576
+			<< "MB it claims to be.\n";
+	} else if (this->endRegion < this->numRegions) {
+		out << "Only the first " << this->regionStart(this->endRegion) / 1048576
+			<< "MB were tested.\n";
+	}
+	if (!this->badSectors.empty()) {
+		out << this->badSectors.count() << " bad sectors in total:\n";
+		this->badSectors.report(out, SECTOR_SIZE);
+	} else if (!this->wrapBlock) {
+		out << "No bad blocks detected.\n";
+	}
+	out << "The original data has been restored, and the partition table left "
+		"unchanged.\nThe backup in " << this->backupPath << " is no longer needed."
+		<< std::endl;
+	return;
+}
+
+void *BackupCheck::helper(void *task)
+	throw ()
+{
+	HelperTask *t = (HelperTask *)task;
+	try {
+		if (t->restoreRegion >= 0) t->check->restore(t->restoreRegion);
+		if (t->backupRegion >= 0) t->check->backup(t->backupRegion);
+	} catch (const error& e) {
+		t->failed = true;
+		t->message = e.what();
+	}
+	return NULL;
+}
+
+void BackupCheck::backup(unsigned int region)
+	throw (error)
+{
+	block_t start = this->regionStart(region);
+	block_t len = this->regionLength(region);
+	BackupRecord rec;
+	off_t end = ::lseek(this->backupFD, 0, SEEK_END);
+	if (end < 0) {
+		throw error("Unable to seek in " + this->backupPath + ": " + strerror(errno));
+	}
+	rec.fileOffset = end;
+	rec.crc = 0;
+
+	uint8_t header[BACKUP_HEADER_LEN];
+	memcpy(header, BACKUP_MAGIC, 8);
+	store64le(&header[8], region);
+	store64le(&header[16], start);
+	store64le(&header[24], len);
+	writeAll(this->backupFD, header, BACKUP_HEADER_LEN, this->backupPath);
+
+	bool readable = true;
+	ExtentList errors;
+	for (block_t off = 0; off < len; off += BACKUP_CHUNK_SIZE) {
+		unsigned int n = BACKUP_CHUNK_SIZE;
+		if (len - off < n) n = len - off;
+		try {
+			this->dev->readAt(this->copyBuf, n, start + off);
+		} catch (const error& e) {
+			// Find out which blocks are unreadable
+			for (unsigned int i = 0; i < n; i += DATA_BLOCK_SIZE) {
+				try {
+					this->dev->readAt(&this->copyBuf[i], DATA_BLOCK_SIZE, start + off + i);
+				} catch (const error& e) {
+					memset(&this->copyBuf[i], 0, DATA_BLOCK_SIZE);
+					errors.add(readErrorExtent((start + off + i) / DATA_BLOCK_SIZE));
+					readable = false;
+				}
+			}
+		}
+		rec.crc = crc32cUpdate(rec.crc, this->copyBuf, n);
+		writeAll(this->backupFD, this->copyBuf, n, this->backupPath);
+	}
+	if (fdatasync(this->backupFD) < 0) {
+		throw error("Unable to flush " + this->backupPath + ": " + strerror(errno));
+	}
+
+	if (!readable) {
+		// Testing would overwrite whatever can still be read, so leave it be
+		this->unreadable[region] = true;
+		this->journalBad(region, errors);
+		for (std::vector<Extent>::const_iterator
+			i = errors.extents.begin(); i != errors.extents.end(); i++
+		) {
+			this->backupErrors.add(*i);
+		}
+		return;
+	}
+	this->pending[region] = rec;
+	std::ostringstream line;
+	line << "backup " << region << ' ' << rec.fileOffset << ' ' << rec.crc;
+	this->journal(line.str());
+	return;
+}
+
+void BackupCheck::restore(unsigned int region)
+	throw (error)
+{
+	std::map<unsigned int, BackupRecord>::iterator i = this->pending.find(region);
+	if (i == this->pending.end()) return;
+	const BackupRecord& rec = i->second;
+	block_t start = this->regionStart(region);
+	block_t len = this->regionLength(region);
+
+	uint8_t header[BACKUP_HEADER_LEN];
+	readAll(this->backupFD, header, BACKUP_HEADER_LEN, rec.fileOffset,
+		this->backupPath);
+	std::ostringstream where;
+	where << "Backup of region " << region << " at offset " << rec.fileOffset
+		<< " in " << this->backupPath;
+	if ((memcmp(header, BACKUP_MAGIC, 8) != 0)
+		|| (load64le(&header[8]) != region)
+		|| (load64le(&header[16]) != start)
+		|| (load64le(&header[24]) != len)
+	) {
+		throw error(where.str() + " has a bad header, not restoring it");
+	}
+
+	// Check the whole copy before writing any of it back
+	block_t dataOffset = rec.fileOffset + BACKUP_HEADER_LEN;
+	uint32_t crc = 0;
+	for (block_t off = 0; off < len; off += BACKUP_CHUNK_SIZE) {
+		unsigned int n = BACKUP_CHUNK_SIZE;
+		if (len - off < n) n = len - off;
+		readAll(this->backupFD, this->copyBuf, n, dataOffset + off, this->backupPath);
+		crc = crc32cUpdate(crc, this->copyBuf, n);
+	}
+	if (crc != rec.crc) {
+		throw error(where.str() + " is damaged, not restoring it");
+	}
+
+	for (block_t off = 0; off < len; off += BACKUP_CHUNK_SIZE) {
+		unsigned int n = BACKUP_CHUNK_SIZE;
+		if (len - off < n) n = len - off;
+		readAll(this->backupFD, this->copyBuf, n, dataOffset + off, this->backupPath);
+		try {
+			this->dev->writeAt(this->copyBuf, n, start + off);
+		} catch (const error& e) {
+			throw error(std::string("Unable to restore region: ") + e.what() + "\n"
+				+ where.str() + " still holds the original data");
+		}
+	}
+
+	std::ostringstream line;
+	line << "restored " << region;
+	this->journal(line.str());
+	this->pending.erase(i);
+	return;
+}
+
+void BackupCheck::test(unsigned int region, ExtentList *found)
+	throw ()
+{
+	block_t start = this->regionStart(region);
+	block_t len = this->regionLength(region);
+
+	for (block_t off = 0; off < len; off += BACKUP_CHUNK_SIZE) {
+		unsigned int n = BACKUP_CHUNK_SIZE;
+		if (len - off < n) n = len - off;
+		this->pattern.fill(this->testBuf, n, start + off);
+		try {
+			this->dev->writeAt(this->testBuf, n, start + off);
+		} catch (const error& e) {
+			// Whatever went wrong will show up when it is read back
+		}
+	}
+
+	Classifier classifier(this->pattern);
+	for (block_t off = 0; off < len; off += BACKUP_CHUNK_SIZE) {
+		unsigned int n = BACKUP_CHUNK_SIZE;
+		if (len - off < n) n = len - off;
+		bool chunkRead = true;
+		try {
+			this->dev->readAt(this->testBuf, n, start + off);
+		} catch (const error& e) {
+			chunkRead = false;
+		}
+		for (unsigned int i = 0; i < n; i += DATA_BLOCK_SIZE) {
+			block_t b = (start + off + i) / DATA_BLOCK_SIZE;
+			if (!chunkRead) {
+				// Read each block on its own to find the bad ones
+				try {
+					this->dev->readAt(&this->testBuf[i], DATA_BLOCK_SIZE,
+						b * DATA_BLOCK_SIZE);
+				} catch (const error& e) {
+					found->add(readErrorExtent(b));
+					continue;
+				}
+			}
+			uint64_t badMask = this->pattern.verify(&this->testBuf[i],
+				DATA_BLOCK_SIZE, b * DATA_BLOCK_SIZE);
+			for (unsigned int s = 0; badMask; s++, badMask >>= 1) {
+				if (!(badMask & 1)) continue;
+				Extent ext;
+				classifier.classify(&this->testBuf[i + s * SECTOR_SIZE],
+					b * SECTORS_PER_BLOCK + s, &ext);
+				found->add(ext);
+			}
+		}
+	}
+	return;
+}
+
+bool BackupCheck::checkCanaries(unsigned int region)
+	throw ()
+{
+	// Earlier regions have been restored, so the test data should not be there
+	for (unsigned int c = 0; c < region; c = c ? c * 2 : 1) {
+		if (this->unreadable[c]) continue;
+		block_t off = this->regionStart(c);
+		try {
+			this->dev->readAt(this->testBuf, DEVICE_ALIGN, off);
+		} catch (const error& e) {
+			continue;
+		}
+		block_t found;
+		uint64_t key;
+		if (Pattern::decode(this->testBuf, &found, &key)
+			&& (key == this->pattern.getKey()) && (found > off / SECTOR_SIZE)
+		) {
+			this->wrapBlock = (found - off / SECTOR_SIZE) / SECTORS_PER_BLOCK;
+			if (this->wrapBlock == 0) this->wrapBlock = 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+void BackupCheck::journal(const std::string& line)
+	throw (error)
+{
+	std::string entry = line + "\n";
+	writeAll(this->journalFD, (const uint8_t *)entry.data(), entry.length(),
+		this->journalPath);
+	if (fdatasync(this->journalFD) < 0) {
+		throw error("Unable to flush " + this->journalPath + ": " + strerror(errno));
+	}
+	return;
+}
+
+void BackupCheck::journalBad(unsigned int region, const ExtentList& found)
+	throw (error)
+{
+	for (std::vector<Extent>::const_iterator
+		i = found.extents.begin(); i != found.extents.end(); i++
+	) {
+		std::ostringstream line;
+		line << "bad " << region << ' ' << i->start << ' ' << i->len << ' '
+			<< (unsigned int)i->type << ' ' << i->movedFrom << ' ' << i->flipsUp
+			<< ' ' << i->flipsDown;
+		this->journal(line.str());
+	}
+	return;
+}
+
+block_t BackupCheck::regionStart(unsigned int region) const
+	throw ()
+{
+	return (block_t)region * BACKUP_REGION_SIZE;
+}
+
+block_t BackupCheck::regionLength(unsigned int region) const
+	throw ()
+{
+	block_t start = this->regionStart(region);
+	block_t end = start + BACKUP_REGION_SIZE;
+	if (end > this->numBlocks * DATA_BLOCK_SIZE) end = this->numBlocks * DATA_BLOCK_SIZE;
+	return end - start;
+}
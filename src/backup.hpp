@@ -0,0 +1,196 @@
+/**
+ * @file  backup.hpp
+ * @brief Test a device while keeping the data on it.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BACKUP_HPP_
+#define BACKUP_HPP_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+#include "device.hpp"
+#include "error.hpp"
+#include "pattern.hpp"
+#include "extent.hpp"
+
+/// Size of each region backed up, tested and restored in turn (64MB).
+#define BACKUP_REGION_SIZE (64 * 1048576)
+
+/// Size of each read and write when copying to and from the backup file.
+#define BACKUP_CHUNK_SIZE 1048576
+
+/// Marks the start of each region's copy in the backup file.
+#define BACKUP_MAGIC "SFBACKUP"
+
+/// First line of the journal, followed by the device and region sizes.
+#define BACKUP_JOURNAL_ID "scanflash-journal"
+
+/// Where a region's original data is kept in the backup file.
+struct BackupRecord
+{
+	block_t fileOffset; ///< Offset of the record header in the backup file
+	uint32_t crc;       ///< CRC32C of the region's data
+};
+
+/// Write and verify test data one region at a time, restoring what was there.
+/**
+ * Each region is copied to the end of a backup file before it is tested, and
+ * copied back afterwards.  A journal next to the backup file records each
+ * step once it is safely on disk, so if the run is interrupted the next run
+ * puts back any region that was not restored before carrying on.
+ *
+ * While one region is being tested a helper thread restores the region before
+ * it and backs up the region after it, so the copying overlaps with the test.
+ *
+ * After each region is tested, the start of earlier regions is checked for
+ * the test data.  If it is there the device has wrapped around, and the test
+ * stops once the region is restored.  Restoring is still safe in this case
+ * as long as the device's real size is at least two regions, since the
+ * backup of the aliased region was then taken after the region it lands on
+ * had been restored, so it holds the same original data.
+ *
+ * No partition table is written, as that would replace the one already on
+ * the device.
+ */
+class BackupCheck
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device to test.
+		 *
+		 * @param backupPath
+		 *   File to copy the original data to.  The journal is kept in the same
+		 *   place with ".journal" added to the name.  Both must be on another
+		 *   device with enough free space to hold a copy of this one.
+		 */
+		BackupCheck(Device *dev, const std::string& backupPath)
+			throw (error);
+
+		~BackupCheck()
+			throw ();
+
+		/// Change the data written to each block.
+		void setPattern(const Pattern& pattern)
+			throw ();
+
+		/// Allow recover() to empty a backup file left over from another run.
+		void setOverwrite(bool overwrite)
+			throw ();
+
+		/// Put back any regions an interrupted run did not restore.
+		/**
+		 * Must be called before run().  The backup file and journal are created
+		 * if they do not already exist.  A backup file that already holds data
+		 * but has no journal is only emptied if setOverwrite() allowed it, as
+		 * it may be the only copy of another device's data.
+		 *
+		 * @return Number of regions restored.
+		 */
+		unsigned int recover()
+			throw (error);
+
+		/// Test every region not already tested by an interrupted run.
+		void run()
+			throw (error);
+
+		/// Did run() find any bad sectors, or stop because the device wrapped?
+		bool foundBad() const
+			throw ();
+
+		/// Write a human readable summary of the results.
+		void report(std::ostream& out) const
+			throw ();
+
+	protected:
+		Device *dev;             ///< Device being tested
+		std::string backupPath;  ///< File holding copies of the original data
+		std::string journalPath; ///< Log of completed steps
+		int backupFD;            ///< Backup file, opened for appending
+		int journalFD;           ///< Journal, opened for appending
+		block_t numBlocks;       ///< Size of device, in blocks
+		unsigned int numRegions; ///< Number of regions, the last may be short
+		unsigned int firstRegion; ///< First region tested by this run
+		unsigned int endRegion;  ///< One past the last region tested
+		Pattern pattern;         ///< Data to write to each block
+		ExtentList badSectors;   ///< Bad areas found by test(), this run or the last
+		ExtentList backupErrors; ///< Unreadable blocks found by backup()
+		block_t wrapBlock;       ///< Real size in blocks if it wrapped, or 0
+		bool overwrite;          ///< Can an unjournalled backup file be emptied?
+		std::map<unsigned int, BackupRecord> pending; ///< Backed up, not restored
+		std::vector<bool> unreadable; ///< Regions whose data could not be backed up
+		uint8_t *testBuf;        ///< Aligned buffer for testing
+		uint8_t *copyBuf;        ///< Aligned buffer for the helper thread
+
+		/// Work for the helper thread during one step.
+		struct HelperTask {
+			BackupCheck *check;
+			int restoreRegion;   ///< Region to restore, or -1
+			int backupRegion;    ///< Region to back up, or -1
+			bool failed;         ///< Did something go wrong?
+			std::string message; ///< What went wrong
+		};
+
+		/// Thread entry point, running a HelperTask.
+		static void *helper(void *task)
+			throw ();
+
+		/// Copy a region to the end of the backup file.
+		void backup(unsigned int region)
+			throw (error);
+
+		/// Copy a region back from the backup file, once it checks out.
+		void restore(unsigned int region)
+			throw (error);
+
+		/// Write then verify a region.
+		/**
+		 * @param found
+		 *   Bad sectors in the region are added to this list.
+		 */
+		void test(unsigned int region, ExtentList *found)
+			throw ();
+
+		/// Look for test data at the start of earlier regions.
+		/**
+		 * @return true if found, in which case wrapBlock is set.
+		 */
+		bool checkCanaries(unsigned int region)
+			throw ();
+
+		/// Append a line to the journal and wait until it is on disk.
+		void journal(const std::string& line)
+			throw (error);
+
+		/// Journal the bad sectors found in a region, for recover() to load.
+		void journalBad(unsigned int region, const ExtentList& found)
+			throw (error);
+
+		/// Offset of the start of a region, in bytes.
+		block_t regionStart(unsigned int region) const
+			throw ();
+
+		/// Length of a region, in bytes.
+		block_t regionLength(unsigned int region) const
+			throw ();
+};
+
+#endif // BACKUP_HPP_
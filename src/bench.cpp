@@ -0,0 +1,205 @@
+/**
+ * @file  bench.cpp
+ * @brief Random 4 kB I/O benchmark, for SD application performance classes.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "bench.hpp"
+#include "queue.hpp"
+
+/// Size of each write when filling the test region.
+#define BENCH_FILL_SIZE 1048576
+
+/// Fill the test region sequentially, one large request at a time.
+class FillJob: virtual public IOJob
+{
+	public:
+		FillJob(block_t regionSize)
+			throw ()
+			: regionSize(regionSize),
+			  pos(0),
+			  failed(false)
+		{
+		}
+
+		virtual bool next(unsigned int slot, IORequest *req)
+			throw ()
+		{
+			if (this->failed || (this->pos >= this->regionSize)) return false;
+			req->write = true;
+			req->off = this->pos;
+			req->len = BENCH_FILL_SIZE;
+			if (this->regionSize - this->pos < req->len) {
+				req->len = this->regionSize - this->pos;
+			}
+			memset(req->buf, 0x5A, req->len);
+			this->pos += req->len;
+			return true;
+		}
+
+		virtual void done(unsigned int slot, const IORequest& req, bool ok,
+			double latency)
+			throw ()
+		{
+			if (!ok) this->failed = true;
+			return;
+		}
+
+		block_t regionSize;
+		block_t pos;
+		bool failed;
+};
+
+/// Issue random 4 kB requests on every slot until the time is up.
+class RandomJob: virtual public IOJob
+{
+	public:
+		RandomJob(unsigned int depth, block_t regionSize, bool write)
+			throw ()
+			: numUnits(regionSize / BENCH_IO_SIZE),
+			  write(write),
+			  completed(0),
+			  errors(0),
+			  state(depth)
+		{
+			for (unsigned int i = 0; i < depth; i++) {
+				// Different non-zero seed for each slot
+				this->state[i] = 0x9E3779B97F4A7C15ULL * (i + 1);
+			}
+			this->tmStart = monotonicTime();
+			this->tmEnd = this->tmStart + BENCH_DURATION;
+		}
+
+		virtual ~RandomJob()
+			throw ()
+		{
+		}
+
+		virtual bool next(unsigned int slot, IORequest *req)
+			throw ()
+		{
+			if (monotonicTime() >= this->tmEnd) return false;
+			// xorshift64
+			uint64_t x = this->state[slot];
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			this->state[slot] = x;
+
+			req->write = this->write;
+			req->off = (x % this->numUnits) * BENCH_IO_SIZE;
+			req->len = BENCH_IO_SIZE;
+			if (this->write) memset(req->buf, (uint8_t)x, BENCH_IO_SIZE);
+			return true;
+		}
+
+		virtual void done(unsigned int slot, const IORequest& req, bool ok,
+			double latency)
+			throw ()
+		{
+			if (ok) this->completed++;
+			else this->errors++;
+			return;
+		}
+
+		/// Operations per second achieved.
+		unsigned long iops() const
+			throw ()
+		{
+			double duration = monotonicTime() - this->tmStart;
+			if (duration <= 0) return 0;
+			return (unsigned long)(this->completed / duration);
+		}
+
+		block_t numUnits;
+		bool write;
+		unsigned long completed;
+		unsigned long errors;
+		std::vector<uint64_t> state; ///< PRNG state for each slot
+		double tmStart;
+		double tmEnd;
+};
+
+Benchmark::Benchmark(Device *dev, block_t regionSize)
+	throw (error)
+	: dev(dev),
+	  regionSize(regionSize)
+{
+	block_t len = this->dev->size();
+	if (this->regionSize > len) this->regionSize = len;
+	this->regionSize -= this->regionSize % BENCH_IO_SIZE;
+	if (this->regionSize < BENCH_IO_SIZE) {
+		throw error("Device is too small to benchmark");
+	}
+}
+
+void Benchmark::prepare()
+	throw (error)
+{
+	IOQueue queue(this->dev, 1, BENCH_FILL_SIZE);
+	FillJob job(this->regionSize);
+	queue.run(&job);
+	// No sync() needed, the device is opened for synchronous writes
+	if (job.failed) throw error("Unable to fill the benchmark region");
+	return;
+}
+
+BenchResult Benchmark::run(unsigned int depth)
+	throw (error)
+{
+	BenchResult res;
+	res.depth = depth;
+	res.errors = 0;
+	res.writeIOPS = this->runTest(depth, true, &res.errors);
+	res.readIOPS = this->runTest(depth, false, &res.errors);
+	return res;
+}
+
+unsigned long Benchmark::runTest(unsigned int depth, bool write,
+	unsigned long *errors)
+	throw (error)
+{
+	IOQueue queue(this->dev, depth, BENCH_IO_SIZE);
+	RandomJob job(depth, this->regionSize, write);
+	queue.run(&job);
+	*errors += job.errors;
+	return job.iops();
+}
+
+AppClass Benchmark::grade(const std::vector<BenchResult>& results)
+	throw ()
+{
+	unsigned long qd1Read = 0, qd1Write = 0, bestRead = 0, bestWrite = 0;
+	for (std::vector<BenchResult>::const_iterator
+		i = results.begin(); i != results.end(); i++
+	) {
+		if (i->depth == 1) {
+			qd1Read = i->readIOPS;
+			qd1Write = i->writeIOPS;
+		}
+		if (i->readIOPS > bestRead) bestRead = i->readIOPS;
+		if (i->writeIOPS > bestWrite) bestWrite = i->writeIOPS;
+	}
+	if ((qd1Read < BENCH_A1_READ_IOPS) || (qd1Write < BENCH_A1_WRITE_IOPS)) {
+		return APP_CLASS_NONE;
+	}
+	if ((bestRead < BENCH_A2_READ_IOPS) || (bestWrite < BENCH_A2_WRITE_IOPS)) {
+		return APP_CLASS_A1;
+	}
+	return APP_CLASS_A2;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file  bench.hpp
+ * @brief Random 4 kB I/O benchmark, for SD application performance classes.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_HPP_
+#define BENCH_HPP_
+
+#include <vector>
+#include "device.hpp"
+#include "error.hpp"
+
+/// Size of each random I/O operation.
+#define BENCH_IO_SIZE 4096
+
+/// Default size of the area random I/O is spread over, in bytes.
+#define BENCH_DEFAULT_REGION (1024ULL * 1048576)
+
+/// Number of seconds each read or write test runs for.
+#define BENCH_DURATION 5
+
+/// Minimum random IOPS for the SD A1 application performance class.
+#define BENCH_A1_READ_IOPS 1500
+#define BENCH_A1_WRITE_IOPS 500
+
+/// Minimum random IOPS for the SD A2 application performance class.
+#define BENCH_A2_READ_IOPS 4000
+#define BENCH_A2_WRITE_IOPS 2000
+
+/// SD application performance classes.
+enum AppClass {
+	APP_CLASS_NONE = 0, ///< Does not meet A1
+	APP_CLASS_A1   = 1, ///< Application Performance Class 1
+	APP_CLASS_A2   = 2, ///< Application Performance Class 2
+};
+
+/// Result of testing at a single queue depth.
+struct BenchResult
+{
+	unsigned int depth;      ///< Queue depth tested
+	unsigned long readIOPS;  ///< Random 4 kB reads per second
+	unsigned long writeIOPS; ///< Random 4 kB writes per second
+	unsigned long errors;    ///< Number of failed operations
+};
+
+/// Measure random 4 kB read and write IOPS over part of a device.
+/**
+ * The region is filled sequentially first, so the read test returns real
+ * data rather than whatever the controller produces for unwritten blocks.
+ * This benchmark is destructive.
+ */
+class Benchmark
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device to test.
+		 *
+		 * @param regionSize
+		 *   Number of bytes, from the start of the device, to spread random I/O
+		 *   over.  Reduced to the device size if larger.
+		 */
+		Benchmark(Device *dev, block_t regionSize)
+			throw (error);
+
+		/// Fill the test region so there is data to read back.
+		void prepare()
+			throw (error);
+
+		/// Run the write then read test at the given queue depth.
+		BenchResult run(unsigned int depth)
+			throw (error);
+
+		/// Work out which application class a set of results meets.
+		/**
+		 * A1 is judged on queue depth 1 alone, since A1 hosts do not queue
+		 * commands.  A2 is judged on the best result at any depth, as A2 relies
+		 * on command queueing.
+		 */
+		static AppClass grade(const std::vector<BenchResult>& results)
+			throw ();
+
+	protected:
+		Device *dev;         ///< Device being tested
+		block_t regionSize;  ///< Bytes covered by the random I/O
+
+		/// Run one direction of the test, returning IOPS.
+		unsigned long runTest(unsigned int depth, bool write,
+			unsigned long *errors)
+			throw (error);
+};
+
+#endif // BENCH_HPP_
@@ -0,0 +1,151 @@
+/**
+ * @file  budget.cpp
+ * @brief Work out how much of a device can be tested in a set time.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <iomanip>
+#include "budget.hpp"
+#include "check.hpp"
+#include "queue.hpp"
+
+/// Bytes in each run of blocks.
+#define RUN_SIZE (ORDER_RUN_BLOCKS * DATA_BLOCK_SIZE)
+
+TimeBudget::TimeBudget(Device *dev, double seconds)
+	throw ()
+	: dev(dev),
+	  seconds(seconds),
+	  tmStart(monotonicTime()),
+	  writeRate(0),
+	  readRate(0)
+{
+}
+
+void TimeBudget::calibrate(block_t firstBlock, block_t endBlock)
+	throw (error)
+{
+	void *p;
+	if (posix_memalign(&p, DEVICE_ALIGN, RUN_SIZE) != 0) {
+		throw error("Out of memory allocating I/O buffers");
+	}
+	uint8_t *buf = (uint8_t *)p;
+
+	// Spread over the range, as some devices are faster in places
+	Pattern pattern(PATTERN_RANDOM, PATTERN_DEFAULT_KEY);
+	block_t len = endBlock - firstBlock;
+	double writeTime = 0, readTime = 0;
+	block_t bytes = 0;
+	try {
+		for (unsigned int i = 0; i < BUDGET_CALIBRATE_RUNS; i++) {
+			block_t first = firstBlock + len * i / BUDGET_CALIBRATE_RUNS;
+			block_t count = ORDER_RUN_BLOCKS;
+			if (first + count > endBlock) count = endBlock - first;
+			unsigned int n = count * DATA_BLOCK_SIZE;
+			block_t off = first * DATA_BLOCK_SIZE;
+			pattern.fill(buf, n, off);
+			// Written a block at a time, the same way Check writes
+			double t = monotonicTime();
+			this->dev->seek(off);
+			for (unsigned int b = 0; b < n; b += DATA_BLOCK_SIZE) {
+				this->dev->write(&buf[b], DATA_BLOCK_SIZE);
+			}
+			// Count flushing the device's write cache, as the test itself does
+			try {
+				this->dev->sync();
+			} catch (const error&) {
+				// Only makes the estimate less accurate, Check reports the problem
+			}
+			writeTime += monotonicTime() - t;
+			// Aligned, so this comes from the device and not the cache
+
+			t = monotonicTime();
+			this->dev->readAt(buf, n, off);
+			readTime += monotonicTime() - t;
+			bytes += n;
+		}
+	} catch (const error& e) {
+		free(buf);
+		throw error(std::string("Unable to measure the device's speed: ")
+			+ e.what());
+	}
+	free(buf);
+	this->writeRate = (writeTime > 0) ? bytes / writeTime : bytes;
+	this->readRate = (readTime > 0) ? bytes / readTime : bytes;
+	return;
+}
+
+block_t TimeBudget::plan() const
+	throw ()
+{
+	double left = this->seconds - (monotonicTime() - this->tmStart);
+	if (left <= 0) return 0;
+	double perRun = RUN_SIZE / this->writeRate + RUN_SIZE / this->readRate;
+	return (block_t)(left * BUDGET_USABLE / perRun);
+}
+
+void TimeBudget::describe(std::ostream& out, const SampledOrder& sample,
+	block_t rangeBlocks) const
+	throw ()
+{
+	block_t tested = sample.size();
+	out << "Measured " << (unsigned long)(this->writeRate / 1024) << "kB/sec "
+		"writing and " << (unsigned long)(this->readRate / 1024) << "kB/sec "
+		"reading.\nTesting " << tested * DATA_BLOCK_SIZE / 1048576 << "MB of "
+		<< rangeBlocks * DATA_BLOCK_SIZE / 1048576 << "MB ("
+		<< tested * 100 / rangeBlocks << "%) in the time allowed.\n";
+	return;
+}
+
+void TimeBudget::report(std::ostream& out, const SampledOrder& sample,
+	block_t rangeBlocks, bool foundBad) const
+	throw ()
+{
+	block_t tested = sample.size();
+	out << "Coverage: " << tested * DATA_BLOCK_SIZE / 1048576 << "MB of "
+		<< rangeBlocks * DATA_BLOCK_SIZE / 1048576 << "MB ("
+		<< tested * 100 / rangeBlocks << "%) tested in "
+		<< (unsigned long)(monotonicTime() - this->tmStart) << " seconds.\n";
+	if (foundBad) {
+		out << "Bad sectors were found, so the device has failed.  Other bad "
+			"sectors may\nbe in the parts that were not tested.\n";
+	} else if (tested >= rangeBlocks) {
+		out << "Every block was tested.\n";
+	} else if (sample.randomRuns() == 0) {
+		out << "There was no time to test a random sample, so there is no "
+			"estimate of how\nmuch of the device is bad.\n";
+	} else if (300.0 / sample.randomRuns() >= 100) {
+		// Rule of three, below: too few samples to rule anything out
+		out << "Only " << sample.randomRuns() << " randomly picked areas were "
+			"tested, so there is no\nuseful estimate of how much of the device "
+			"is bad.\n";
+	} else {
+		// Rule of three: with no failures in n random picks, the failure rate is
+		// below 3/n with 95% confidence
+		double bound = 300.0 / sample.randomRuns();
+		std::ios::fmtflags flags = out.flags();
+		std::streamsize precision = out.precision();
+		out << "No bad sectors in " << sample.randomRuns() << " randomly picked "
+			<< RUN_SIZE / 1048576 << "MB areas, so with 95% confidence fewer than "
+			<< std::fixed << std::setprecision(2) << bound << "%\nof the device's "
+			<< RUN_SIZE / 1048576 << "MB areas hold bad sectors.\n";
+		out.flags(flags);
+		out.precision(precision);
+	}
+	return;
+}
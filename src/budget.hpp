@@ -0,0 +1,106 @@
+/**
+ * @file  budget.hpp
+ * @brief Work out how much of a device can be tested in a set time.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BUDGET_HPP_
+#define BUDGET_HPP_
+
+#include <ostream>
+#include "device.hpp"
+#include "error.hpp"
+#include "order.hpp"
+
+/// Number of runs written and read back to measure the device's speed.
+#define BUDGET_CALIBRATE_RUNS 4
+
+/// Fraction of the remaining time to plan for, leaving room for overheads.
+#define BUDGET_USABLE 0.9
+
+/// Fit as much testing as possible into a fixed amount of time.
+/**
+ * A few runs spread over the range are written and read back first to see
+ * how fast the device is.  The time left is then divided by the time each
+ * run takes to write and verify, giving the number of runs to put in a
+ * SampledOrder.
+ */
+class TimeBudget
+{
+	public:
+		/// Constructor.
+		/**
+		 * The clock starts now.
+		 *
+		 * @param dev
+		 *   Device to test.
+		 *
+		 * @param seconds
+		 *   Total time allowed, including the time taken by calibrate().
+		 */
+		TimeBudget(Device *dev, double seconds)
+			throw ();
+
+		/// Time writing and reading back a few runs.
+		/**
+		 * This writes over part of the range.
+		 *
+		 * @param firstBlock
+		 *   First block of the range to be tested.
+		 *
+		 * @param endBlock
+		 *   One past the last block of the range.
+		 */
+		void calibrate(block_t firstBlock, block_t endBlock)
+			throw (error);
+
+		/// Number of runs that can be written and verified in the time left.
+		block_t plan() const
+			throw ();
+
+		/// Write a summary of the speed measured and the sample planned.
+		void describe(std::ostream& out, const SampledOrder& sample,
+			block_t rangeBlocks) const
+			throw ();
+
+		/// Write how much of the range was covered, and what that says.
+		/**
+		 * @param out
+		 *   Stream to write to.
+		 *
+		 * @param sample
+		 *   Blocks that were tested.
+		 *
+		 * @param rangeBlocks
+		 *   Number of blocks in the range.
+		 *
+		 * @param foundBad
+		 *   Did the test find any bad sectors?
+		 */
+		void report(std::ostream& out, const SampledOrder& sample,
+			block_t rangeBlocks, bool foundBad) const
+			throw ();
+
+	protected:
+		Device *dev;          ///< Device being tested
+		double seconds;       ///< Total time allowed
+		double tmStart;       ///< When the clock started
+		double writeRate;     ///< Measured write speed, bytes/sec
+		double readRate;      ///< Measured read speed, bytes/sec
+};
+
+#endif // BUDGET_HPP_
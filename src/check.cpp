@@ -25,16 +25,31 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sstream>
+#include <algorithm>
 #include "check.hpp"
+#include "order.hpp"
+#include "classify.hpp"
+#include "queue.hpp"
 
-/// Write a code to the block
-void prepareBuf(uint8_t *buf, unsigned int len, block_t blockNum)
+#if DATA_BLOCK_SIZE > PATTERN_MAX_LEN
+#error DATA_BLOCK_SIZE is too large for Pattern::verify()
+#endif
+
+#if (CANARY_READ_SIZE > DATA_BLOCK_SIZE) || (DATA_BLOCK_SIZE % DEVICE_ALIGN)
+#error CANARY_READ_SIZE must fit in an aligned block
+#endif
+
+/// Is this block re-read during the write to spot the device wrapping around?
+/**
+ * @param b
+ *   Block number, counting from the start of the range being tested.
+ */
+static inline bool isCanary(block_t b)
 {
-	blockNum++; // avoid block 0 having all zeroes
-	for (unsigned int i = 0; i < len; i += sizeof(block_t)) {
-		memcpy(&buf[i], &blockNum, sizeof(block_t));
-	}
-	return;
+	// Block 0 and every power of two, so whatever the real size is there is
+	// always a canary no less than half way through it.
+	return (b & (b - 1)) == 0;
 }
 
 CheckCallback::~CheckCallback()
@@ -42,13 +57,233 @@ CheckCallback::~CheckCallback()
 {
 }
 
+void CheckCallback::rateUpdate(const RateStatus& status)
+	throw ()
+{
+	return;
+}
+
+CheckCallbackSink::CheckCallbackSink(CheckCallback *cb)
+	throw ()
+	: cb(cb)
+{
+}
+
+CheckCallbackSink::~CheckCallbackSink()
+	throw ()
+{
+}
+
+void CheckCallbackSink::start(block_t done, block_t blocks, block_t later)
+	throw ()
+{
+	this->rate.start(done, blocks, later);
+	return;
+}
+
+bool CheckCallbackSink::progress(bool write,
+	const std::vector<ProgressEvent>& events)
+	throw ()
+{
+	block_t done = 0;
+	bool lastBad = false;
+	for (std::vector<ProgressEvent>::const_iterator
+		i = events.begin(); i != events.end(); i++
+	) {
+		if (i->kind == PROGRESS_RATE) continue;
+		done = i->done;
+		lastBad = (i->kind == PROGRESS_BAD);
+		// Report the end of each run of errors, so the UI can tell how long
+		// the device has been failing for
+		if (!write && lastBad && !this->cb->readProgress(done - 1, true)) {
+			return false;
+		}
+	}
+	if (done == 0) return true;
+	this->rate.sample(done);
+	this->cb->rateUpdate(this->rate.status());
+	if (write) {
+		this->cb->writeProgress(done - 1);
+	} else if (!lastBad) {
+		return this->cb->readProgress(done - 1, false);
+	}
+	return true;
+}
+
+/// Walk each stripe of the range in its own queue slot.
+class StripeJob: virtual public IOJob
+{
+	public:
+		StripeJob(Check *check, bool write, std::vector<block_t> *canaries,
+			const Pattern *next)
+			throw ()
+			: check(check),
+			  write(write),
+			  canaries(canaries),
+			  nextPattern(next),
+			  rewriteBlock(check->stripes, 0),
+			  rewritePending(check->stripes, false),
+			  found(check->stripes),
+			  completed(0),
+			  issued(0),
+			  batchEnd(~(block_t)0),
+			  aborted(false),
+			  failed(false),
+			  failedBlock(0)
+		{
+			block_t len = check->endBlock - check->firstBlock;
+			for (unsigned int i = 0; i < check->stripes; i++) {
+				this->cursor.push_back(check->firstBlock + len * i / check->stripes);
+				this->end.push_back(check->firstBlock + len * (i + 1) / check->stripes);
+			}
+		}
+
+		virtual ~StripeJob()
+			throw ()
+		{
+		}
+
+		virtual bool next(unsigned int slot, IORequest *req)
+			throw ()
+		{
+			// Once aborted, not even the block just checked is replaced
+			if (this->aborted) return false;
+			if (this->rewritePending[slot]) {
+				// Replace the block that was just checked
+				this->rewritePending[slot] = false;
+				req->write = true;
+				req->off = this->rewriteBlock[slot] * DATA_BLOCK_SIZE;
+				req->len = DATA_BLOCK_SIZE;
+				this->nextPattern->fill(req->buf, DATA_BLOCK_SIZE, req->off);
+				return true;
+			}
+			if ((this->cursor[slot] >= this->end[slot])
+				|| (this->issued >= this->batchEnd)
+			) {
+				return false;
+			}
+			block_t b = this->cursor[slot]++;
+			this->issued++;
+			req->write = this->write;
+			req->off = b * DATA_BLOCK_SIZE;
+			req->len = DATA_BLOCK_SIZE;
+			if (this->write) {
+				this->check->pattern.fill(req->buf, DATA_BLOCK_SIZE, req->off);
+			}
+			return true;
+		}
+
+		virtual void process(unsigned int slot, const IORequest& req, bool ok)
+			throw ()
+		{
+			if (this->write || req.write || !ok) return;
+			// The slot owns both its buffer and its list, so no lock is needed
+			this->found[slot].extents.clear();
+			this->check->verifyBlock(req.buf, req.off / DATA_BLOCK_SIZE,
+				&this->found[slot]);
+			return;
+		}
+
+		virtual void done(unsigned int slot, const IORequest& req, bool ok,
+			double latency)
+			throw ()
+		{
+			block_t b = req.off / DATA_BLOCK_SIZE;
+			if (this->nextPattern && req.write) {
+				if (!ok) {
+					this->failed = true;
+					this->failedBlock = b;
+					this->aborted = true;
+				}
+				return;
+			}
+			if (this->write) {
+				if (!ok) {
+					this->failed = true;
+					this->failedBlock = b;
+					this->aborted = true;
+					return;
+				}
+				this->check->progress.good(b);
+				if (isCanary(b - this->check->firstBlock)) this->canaries->push_back(b);
+			} else {
+				if (ok) {
+					const std::vector<Extent>& bad = this->found[slot].extents;
+					for (std::vector<Extent>::const_iterator
+						i = bad.begin(); i != bad.end(); i++
+					) {
+						this->check->badSectors.add(*i);
+					}
+				} else {
+					Extent ext;
+					ext.start = b * SECTORS_PER_BLOCK;
+					ext.len = SECTORS_PER_BLOCK;
+					ext.type = BAD_READ_ERROR;
+					ext.movedFrom = 0;
+					ext.flipsUp = ext.flipsDown = 0;
+					this->check->badSectors.add(ext);
+				}
+				if (ok ? !this->check->progress.good(b)
+					: !this->check->progress.bad(b, req.err)
+				) {
+					this->aborted = true;
+				}
+				if (this->nextPattern && !this->aborted) {
+					this->rewriteBlock[slot] = b;
+					this->rewritePending[slot] = true;
+				}
+			}
+			this->completed++;
+			return;
+		}
+
+		/// Has every stripe been issued?
+		bool finished() const
+			throw ()
+		{
+			for (unsigned int i = 0; i < this->cursor.size(); i++) {
+				if (this->cursor[i] < this->end[i]) return false;
+			}
+			return true;
+		}
+
+		Check *check;
+		bool write;           ///< Writing rather than reading?
+		std::vector<block_t> *canaries; ///< Canary blocks written so far
+		const Pattern *nextPattern; ///< Data to replace each block with once read
+		std::vector<block_t> rewriteBlock; ///< Block each slot is to replace
+		std::vector<bool> rewritePending;  ///< Is rewriteBlock waiting to go?
+		std::vector<ExtentList> found; ///< Bad sectors in each slot's last read
+		std::vector<block_t> cursor; ///< Next block in each stripe
+		std::vector<block_t> end;    ///< One past the last block in each stripe
+		block_t completed;    ///< Number of blocks done so far
+		block_t issued;       ///< Number of blocks handed out so far
+		block_t batchEnd;     ///< Stop handing out blocks once issued gets here
+		bool aborted;         ///< Stop issuing requests?
+		bool failed;          ///< Did a write fail?
+		block_t failedBlock;  ///< Block that could not be written
+};
+
 Check::Check(Device *dev, CheckCallback *cb)
 	throw (error)
 	: dev(dev),
-	  cb(cb)
+	  cb(cb),
+	  cbSink(cb),
+	  progress(&this->cbSink),
+	  phasesLeft(2),
+	  pattern(PATTERN_BLOCKNUM, PATTERN_DEFAULT_KEY),
+	  randomOrder(false),
+	  orderSeed(0),
+	  order(NULL),
+	  progressiveStride(0),
+	  wrapBlock(0),
+	  existingData(false)
 {
 	block_t len = this->dev->size();
 	this->numBlocks = len / DATA_BLOCK_SIZE;
+	this->firstBlock = 0;
+	this->endBlock = this->numBlocks;
+	this->stripes = 1;
 }
 
 Check::~Check()
@@ -56,23 +291,126 @@ Check::~Check()
 {
 }
 
+void Check::setPattern(const Pattern& pattern)
+	throw ()
+{
+	this->pattern = pattern;
+	return;
+}
+
+void Check::setProgressSink(ProgressSink *sink)
+	throw ()
+{
+	this->progress.setSink(sink ? sink : &this->cbSink);
+	return;
+}
+
+void Check::setRandomOrder(uint64_t seed)
+	throw ()
+{
+	this->randomOrder = true;
+	this->orderSeed = seed;
+	return;
+}
+
+void Check::setProgressive(block_t stride)
+	throw ()
+{
+	this->progressiveStride = stride;
+	return;
+}
+
+void Check::setOrder(BlockOrder *order)
+	throw ()
+{
+	this->order = order;
+	return;
+}
+
+void Check::setRange(block_t firstBlock, block_t count)
+	throw (error)
+{
+	if ((count == 0) || (firstBlock >= this->numBlocks)
+		|| (count > this->numBlocks - firstBlock)
+	) {
+		throw error("Range to test is outside the device");
+	}
+	this->firstBlock = firstBlock;
+	this->endBlock = firstBlock + count;
+	return;
+}
+
+void Check::setStripes(unsigned int stripes)
+	throw ()
+{
+	this->stripes = stripes ? stripes : 1;
+	return;
+}
+
+void Check::setPhases(unsigned int phases)
+	throw ()
+{
+	this->phasesLeft = phases;
+	return;
+}
+
+uint64_t Check::useExistingData(uint64_t runID)
+	throw (error)
+{
+	uint8_t buf[DATA_BLOCK_SIZE];
+	this->dev->seek(0);
+	this->dev->read(buf, DATA_BLOCK_SIZE);
+	Pattern found = this->pattern;
+	block_t sectorNum;
+	uint64_t key;
+	if (Pattern::decode(&buf[SECTOR_SIZE], &sectorNum, &key) && (sectorNum == 1)
+		&& ((runID == 0) || (key == runID))
+		&& Pattern::identify(&buf[SECTOR_SIZE], &found)
+	) {
+		this->pattern = found;
+	} else if (runID != 0) {
+		this->pattern.setKey(runID);
+	} else {
+		throw error("No scanflash data found at the start of the device; give "
+			"the run ID with --run-id to verify it anyway");
+	}
+	this->existingData = true;
+	return this->pattern.getKey();
+}
+
 void Check::write()
 	throw (error)
 {
-	block_t startBlock = 0;
+	block_t startBlock = this->firstBlock;
+	this->badSectors.clear();
 
-	uint8_t buf[DATA_BLOCK_SIZE], origBuf[DATA_BLOCK_SIZE];
-	prepareBuf(origBuf, DATA_BLOCK_SIZE, 0);
+	uint8_t buf[DATA_BLOCK_SIZE];
 	this->dev->seek(0);
 	this->dev->read(buf, DATA_BLOCK_SIZE);
-	if (memcmp(origBuf, buf, DATA_BLOCK_SIZE) == 0) {
+	// A partial write can only be resumed if it was done in order, as the
+	// search below relies on every block before the resume point being written.
+	// Sector 0 may hold the partition table from a finished run, so sector 1
+	// is used to find the run ID of the earlier write.  A write that finished
+	// left its data in the last block too, and is never resumed, otherwise
+	// read() would accept the old run's data as coming from this one.
+	block_t found;
+	uint64_t prevRunID;
+	if (!this->randomOrder && !this->order && (this->stripes == 1)
+		&& (this->firstBlock == 0)
+		&& Pattern::decode(&buf[SECTOR_SIZE], &found, &prevRunID) && (found == 1)
+		&& !this->writeFinished(&buf[SECTOR_SIZE], prevRunID)
+	) {
 		// Ask the user if they want to resume
 		if (this->cb->resumeWrite()) {
-			// Yes, so figure out where the last write operation was done
-			block_t remainingBlocks = this->numBlocks / 2;
+			// Yes, so carry on with the earlier run's data
+			this->pattern.setKey(prevRunID);
+			std::cout << "Resuming run ID " << std::hex << prevRunID << std::dec
+				<< "\n";
+			// Figure out where the last write operation was done
+			block_t remainingBlocks = this->endBlock / 2;
 			startBlock = remainingBlocks;
 			//while ((nextBlock > 0) && (nextBlock < numBlocks - 2)) {
-			block_t numLoops = log2(numBlocks);
+			block_t numLoops = log2(this->endBlock);
 			block_t i = 0;
 			while (remainingBlocks > 1) {
 				std::cout << "\rScanning block " << startBlock
@@ -80,9 +418,10 @@ void Check::write()
 				i++;
 				this->dev->seek(startBlock * DATA_BLOCK_SIZE);
 				this->dev->read(buf, DATA_BLOCK_SIZE);
-				prepareBuf(origBuf, DATA_BLOCK_SIZE, startBlock);
 				remainingBlocks /= 2;
-				if (memcmp(origBuf, buf, DATA_BLOCK_SIZE) == 0) {
+				if (this->pattern.verify(buf, DATA_BLOCK_SIZE,
+					startBlock * DATA_BLOCK_SIZE) == 0
+				) {
 					// This block has already been written
 					startBlock += remainingBlocks;
 				} else {
@@ -96,20 +435,66 @@ void Check::write()
 
 	std::cout << "\n";
 
-	// Write out data to each block
-	this->dev->seek(startBlock * DATA_BLOCK_SIZE);
-	this->cb->writeStart(startBlock, numBlocks);
-	for (block_t b = startBlock; b < numBlocks; b++) {
-		if ((b % 256) == 0) {
-			this->cb->writeProgress(b);
+	// Blocks already written when resuming can be checked straight away
+	std::vector<block_t> canaries;
+	for (block_t c = 0; c < startBlock - this->firstBlock; c = c ? c * 2 : 1) {
+		canaries.push_back(this->firstBlock + c);
+	}
+	this->wrapBlock = 0;
+
+	block_t rangeBlocks = this->visitBlocks();
+	this->cb->writeStart(startBlock - this->firstBlock, rangeBlocks);
+	this->startPhase(true, startBlock - this->firstBlock, rangeBlocks);
+	if ((this->stripes > 1) && !this->order) {
+		this->runStripes(true, &canaries, NULL);
+	} else {
+		// Write out data to each block
+		SequentialOrder seqOrder(startBlock, this->endBlock);
+		PermutedOrder randOrder(this->firstBlock, this->endBlock, this->orderSeed);
+		BlockOrder *order = &seqOrder;
+		if (this->order) {
+			order = this->order;
+			order->rewind();
+		} else if (this->randomOrder) {
+			order = &randOrder;
+		}
+
+		block_t pos = startBlock - this->firstBlock; // blocks written so far
+		block_t first, count;
+		while (!this->wrapBlock && order->next(&first, &count)) {
+			this->dev->seek(first * DATA_BLOCK_SIZE);
+			for (block_t b = first; b < first + count; b++, pos++) {
+				this->pattern.fill(buf, DATA_BLOCK_SIZE, b * DATA_BLOCK_SIZE);
+				this->dev->write(buf, DATA_BLOCK_SIZE);
+				this->progress.good(b);
+				if (isCanary(b - this->firstBlock)) canaries.push_back(b);
+				if (((pos + 1) % CANARY_INTERVAL == 0) && this->checkCanaries(canaries)) {
+					break;
+				}
+			}
 		}
-		prepareBuf(buf, DATA_BLOCK_SIZE, b);
-		this->dev->write(buf, DATA_BLOCK_SIZE);
 	}
+	// Catch anything written since the last check
+	if (!this->wrapBlock) this->checkCanaries(canaries);
 
-	this->cb->writeProgress(numBlocks - 1); // signal 100%
+	this->progress.flush();
+	if (!this->wrapBlock) this->cb->writeProgress(rangeBlocks - 1); // signal 100%
 	this->cb->writeFinish();
 
+	if (this->wrapBlock) {
+		std::cout << "\nThe device wrapped around after "
+			<< this->wrapBlock * DATA_BLOCK_SIZE / 1048576 << "MB ("
+			<< this->wrapBlock * SECTORS_PER_BLOCK << " sectors): data written "
+			"beyond this point\nreplaced data at the start of the device.  It is "
+			"only this large, not the\n" << this->numBlocks * DATA_BLOCK_SIZE / 1048576
+			<< "MB it claims to be.  Skipping the rest of the test.\n" << std::endl;
+		if (this->wholeDevice()) {
+			this->dev->writePartitionTable(this->wrapBlock * DATA_BLOCK_SIZE,
+				this->numBlocks * DATA_BLOCK_SIZE - 1, this->numBlocks * DATA_BLOCK_SIZE);
+		}
+		return;
+	}
+
 	try {
 		this->dev->sync();
 	} catch (const error& e) {
@@ -138,75 +523,366 @@ void Check::write()
 	return;
 }
 
-void Check::read()
+void Check::rewrite(PatternType type)
 	throw (error)
 {
-	bool firstBad = false;
-	block_t firstBadBlock = 0, lastBadBlock = 0;
+	Pattern next(type, this->pattern.getKey() + 1);
+	block_t rangeBlocks = this->endBlock - this->firstBlock;
+	this->cb->readStart(0, rangeBlocks);
+	this->startPhase(false, 0, rangeBlocks);
+	this->runStripes(false, NULL, &next);
+	this->progress.flush();
+	this->cb->readProgress(rangeBlocks - 1, false); // signal 100%
+	this->cb->readFinish();
+	this->pattern = next;
+	return;
+}
 
-	block_t startBlock = 0;
-	uint8_t buf[DATA_BLOCK_SIZE], origBuf[DATA_BLOCK_SIZE];
+void Check::read()
+	throw (error)
+{
+	uint8_t buf[DATA_BLOCK_SIZE];
 
-	// Read data back again
-	this->dev->seek(0);
-	this->cb->readStart(startBlock, numBlocks);
+	block_t rangeBlocks = this->visitBlocks();
+	this->cb->readStart(0, rangeBlocks);
+	this->startPhase(false, 0, rangeBlocks);
 	bool fail = false; // was this block good or bad?
-	for (block_t b = startBlock; b < numBlocks; b++) {
-		prepareBuf(origBuf, DATA_BLOCK_SIZE, b);
-		try {
-			this->dev->read(buf, DATA_BLOCK_SIZE);
-			fail = false;
-			if (memcmp(origBuf, buf, DATA_BLOCK_SIZE) != 0) {
-				// Data doesn't match, investigate
-				if (!firstBad) {
-					firstBadBlock = b;
-					firstBad = true;
+	bool stopped = false; // gave up early on a fake or dead device?
+	block_t lostBlock = 0, checked = 0; // where it gave up
+	if ((this->stripes > 1) && !this->order) {
+		this->runStripes(false, NULL, NULL);
+	} else {
+		// Read data back again, in a different order to the one it was written in
+		SequentialOrder seqOrder(this->firstBlock, this->endBlock);
+		PermutedOrder randOrder(this->firstBlock, this->endBlock, ~this->orderSeed);
+		ProgressiveOrder progOrder(this->firstBlock, this->endBlock,
+			this->progressiveStride);
+		BlockOrder *order = &seqOrder;
+		if (this->order) {
+			order = this->order;
+			order->rewind();
+		} else if (this->progressiveStride) {
+			order = &progOrder;
+		} else if (this->randomOrder) {
+			order = &randOrder;
+		}
+
+		block_t pos = 0; // number of blocks read so far
+		block_t first, count;
+		while (!stopped && order->next(&first, &count)) {
+			this->dev->seek(first * DATA_BLOCK_SIZE);
+			for (block_t b = first; b < first + count; b++, pos++) {
+				// Unreadable cards can fail millions of blocks, so this loop uses
+				// error codes rather than paying for an exception each time
+				int err = this->dev->tryRead(buf, DATA_BLOCK_SIZE);
+				if (err == 0) {
+					fail = false;
+					if (this->verifyBlock(buf, b, &this->badSectors) && this->progressiveStride
+						&& !this->order && this->confirmLost(b)
+					) {
+						// Show it as bad, as it is the reason for stopping
+						this->progress.bad(b, 0);
+						lostBlock = b;
+						checked = pos + 1;
+						stopped = true;
+						break;
+					}
+				} else {
+					Extent ext;
+					ext.start = b * SECTORS_PER_BLOCK;
+					ext.len = SECTORS_PER_BLOCK;
+					ext.type = BAD_READ_ERROR;
+					ext.movedFrom = 0;
+					ext.flipsUp = ext.flipsDown = 0;
+					this->badSectors.add(ext);
+					fail = true;
+					// The seek position is undefined after a failed read
+					this->dev->seek((b + 1) * DATA_BLOCK_SIZE);
+				}
+				if (fail ? !this->progress.bad(b, err) : !this->progress.good(b)) {
+					throw error("Verification operation aborted");
 				}
-				lastBadBlock = b;
-				// Find number read back and mark that as largest suspect block, if it's
-				// larger than the current suspect block
-			}
-		} catch (const error& e) {
-			if (!firstBad) {
-				firstBadBlock = b;
-				firstBad = true;
 			}
-			lastBadBlock = b;
-			fail = true;
-		}
-		if (((b % 256) == 0) || fail) {
-			if (!this->cb->readProgress(b, fail)) throw error("Verification operation aborted");
 		}
 	}
-	if (!fail) this->cb->readProgress(numBlocks - 1, true); // signal 100%
+	this->progress.flush();
+	if (!fail && !stopped) this->cb->readProgress(rangeBlocks - 1, true); // signal 100%
 	this->cb->readFinish();
+	if (stopped) {
+		std::cout << "Block " << lostBlock << " holds another block's data or none "
+			"at all, and still\ndoes when read again.  Stopping after checking "
+			<< checked << " of " << rangeBlocks << " blocks.\n";
+	}
+	this->badSectors.sort();
 
 	// TODO: Last x MB will be wrong if it would be overwritten by earlier data
 	//       Of course it could mean there'd be a larger available block at the end of the card...
-	if (firstBad) {
-		std::cout << "First bad block was at " << firstBadBlock << " (* "
-			<< DATA_BLOCK_SIZE << " = byte offset " << firstBadBlock * DATA_BLOCK_SIZE << ")\n"
-			<< "  >> First " << firstBadBlock * DATA_BLOCK_SIZE / 1048576 << "MB are good\n"
-			<< "Last bad block was at " << lastBadBlock << " (next good byte offset "
-			<< (lastBadBlock + 1) * DATA_BLOCK_SIZE << ")\n"
-			<< "  >> Last "
-			<< (numBlocks - (lastBadBlock + 1)) * DATA_BLOCK_SIZE / 1048576
-			<< "MB are good\n"
-			<< std::endl;
-	} else {
+	block_t rangeStart = this->firstBlock * SECTORS_PER_BLOCK;
+	block_t rangeEnd = this->endBlock * SECTORS_PER_BLOCK;
+	const char *where = this->wholeDevice() ? "" : " of the range";
+	bool everyBlock = !stopped
+		&& (rangeBlocks == this->endBlock - this->firstBlock);
+	if (!this->badSectors.empty()) {
+		block_t firstBad = this->badSectors.first();
+		block_t endBad = this->badSectors.end();
+		std::cout << "First bad sector was at " << firstBad << " (* "
+			<< SECTOR_SIZE << " = byte offset " << firstBad * SECTOR_SIZE << ")\n";
+		if (everyBlock) {
+			std::cout << "  >> First " << (firstBad - rangeStart) * SECTOR_SIZE / 1048576
+				<< "MB" << where << " are good\n";
+		}
+		std::cout << "Last bad sector was at " << endBad - 1 << " (next good byte "
+			"offset " << endBad * SECTOR_SIZE << ")\n";
+		if (everyBlock) {
+			std::cout << "  >> Last " << (rangeEnd - endBad) * SECTOR_SIZE / 1048576
+				<< "MB" << where << " are good\n";
+		}
+		std::cout << this->badSectors.count() << " bad sectors in total:\n";
+		this->badSectors.report(std::cout, SECTOR_SIZE);
+		uint64_t flipsUp, flipsDown;
+		this->badSectors.flips(&flipsUp, &flipsDown);
+		std::cout << "Bits flipped in damaged sectors: " << flipsUp << " 0->1, "
+			<< flipsDown << " 1->0\n";
+		std::cout << std::endl;
+	} else if (!everyBlock) {
+		std::cout << "No bad blocks detected in the blocks tested." << std::endl;
+	} else if (this->wholeDevice()) {
 		std::cout << "No bad blocks detected.  This device is 100% functional!"
 			<< std::endl;
+	} else {
+		std::cout << "No bad blocks detected in the range tested." << std::endl;
 	}
 
 	// Write out a replacement partition table
-	if (firstBad) {
-		this->dev->writePartitionTable(
-			firstBadBlock * DATA_BLOCK_SIZE,
-			(lastBadBlock + 1) * DATA_BLOCK_SIZE - 1,
-			this->numBlocks * DATA_BLOCK_SIZE);
+	if (this->existingData) {
+		std::cout << "Verified existing data, partition table left unchanged."
+			<< std::endl;
+	} else if (!this->wholeDevice() && (this->firstBlock == 0)) {
+		// The range says nothing about the rest of the device to partition it
+		std::cout << "Only part of the device was tested, but that included sector "
+			"0, so the device\nno longer has a partition table.  Partition it "
+			"again before using it." << std::endl;
+	} else if (!this->wholeDevice()) {
+		std::cout << "Only part of the device was tested, partition table left "
+			"unchanged." << std::endl;
 	} else {
-		this->dev->writePartitionTable(0, 0, this->numBlocks * DATA_BLOCK_SIZE);
+		if (!everyBlock) {
+			// Block 0 is always tested, so the old partition table is gone anyway
+			std::cout << "Only part of the device was tested, so the new partition "
+				"table only avoids\nthe bad sectors that were found." << std::endl;
+		}
+		if (!this->badSectors.empty()) {
+			this->dev->writePartitionTable(
+				this->badSectors.first() * SECTOR_SIZE,
+				this->badSectors.end() * SECTOR_SIZE - 1,
+				this->numBlocks * DATA_BLOCK_SIZE);
+		} else {
+			this->dev->writePartitionTable(0, 0, this->numBlocks * DATA_BLOCK_SIZE);
+		}
+	}
+
+	return;
+}
+
+bool Check::foundBad() const
+	throw ()
+{
+	return !this->badSectors.empty();
+}
+
+bool Check::wrapped() const
+	throw ()
+{
+	return this->wrapBlock != 0;
+}
+
+const ExtentList& Check::getBadSectors() const
+	throw ()
+{
+	return this->badSectors;
+}
+
+block_t Check::visitBlocks() const
+	throw ()
+{
+	if (!this->order) return this->endBlock - this->firstBlock;
+	block_t total = 0;
+	block_t first, count;
+	this->order->rewind();
+	while (this->order->next(&first, &count)) total += count;
+	return total;
+}
+
+void Check::startPhase(bool write, block_t done, block_t blocks)
+	throw ()
+{
+	this->progress.start(write, done);
+	block_t later = (this->phasesLeft > 1) ? (this->phasesLeft - 1) * blocks : 0;
+	this->cbSink.start(done, blocks, later);
+	if (this->phasesLeft > 1) this->phasesLeft--;
+	return;
+}
+
+bool Check::writeFinished(const uint8_t *sector1, uint64_t runID)
+	throw ()
+{
+	uint8_t buf[DATA_BLOCK_SIZE];
+	block_t last = this->endBlock - 1;
+	Pattern prev = this->pattern;
+	if (!Pattern::identify(sector1, &prev)) prev.setKey(runID);
+	if (this->dev->tryReadAt(buf, DATA_BLOCK_SIZE, last * DATA_BLOCK_SIZE) != 0) {
+		return false;
 	}
+	return prev.verify(buf, DATA_BLOCK_SIZE, last * DATA_BLOCK_SIZE) == 0;
+}
 
+bool Check::wholeDevice() const
+	throw ()
+{
+	return (this->firstBlock == 0) && (this->endBlock == this->numBlocks);
+}
+
+void Check::runStripes(bool write, std::vector<block_t> *canaries,
+	const Pattern *next)
+	throw (error)
+{
+	IOQueue queue(this->dev, this->stripes, DATA_BLOCK_SIZE);
+	StripeJob job(this, write, canaries, next);
+	if (write) {
+		// Check the canaries between batches rather than from inside the job,
+		// where the reads would hold up every slot
+		while (!job.aborted && !job.finished()) {
+			job.batchEnd = job.issued + CANARY_INTERVAL;
+			queue.run(&job);
+			if (!job.aborted && !job.finished()
+				&& this->checkCanaries(*canaries)
+			) {
+				job.aborted = true;
+			}
+		}
+	} else {
+		queue.run(&job);
+	}
+	if (job.failed) {
+		std::ostringstream msg;
+		msg << "Unable to write block " << job.failedBlock;
+		throw error(msg.str());
+	}
+	if (!write && job.aborted) throw error("Verification operation aborted");
 	return;
 }
+
+bool Check::verifyBlock(const uint8_t *buf, block_t b, ExtentList *found) const
+	throw ()
+{
+	uint64_t badMask = this->pattern.verify(buf, DATA_BLOCK_SIZE,
+		b * DATA_BLOCK_SIZE);
+	if ((b == 0) && this->existingData && Device::isPartitionTable(buf)) {
+		// Written over the test data at the end of the earlier run
+		badMask &= ~1ULL;
+	}
+	if (badMask) {
+		// Data doesn't match, find out which sectors are wrong
+		return this->examineBlock(buf, b, badMask, found);
+	}
+	return false;
+}
+
+/// Is this the kind of fault only a fake or dead device has?
+static inline bool isLost(BadType type)
+{
+	return (type == BAD_MOVED) || (type == BAD_ZERO) || (type == BAD_ONES);
+}
+
+bool Check::examineBlock(const uint8_t *buf, block_t b, uint64_t badMask,
+	ExtentList *found) const
+	throw ()
+{
+	Classifier classifier(this->pattern);
+	bool lost = false;
+	for (unsigned int i = 0; i < SECTORS_PER_BLOCK; i++) {
+		if (!(badMask & (1ULL << i))) continue;
+		Extent ext;
+		classifier.classify(&buf[i * SECTOR_SIZE], b * SECTORS_PER_BLOCK + i, &ext);
+		found->add(ext);
+		if (isLost(ext.type)) lost = true;
+	}
+	return lost;
+}
+
+bool Check::confirmLost(block_t b)
+	throw ()
+{
+	uint8_t buf[DATA_BLOCK_SIZE] __attribute__((aligned(DEVICE_ALIGN)));
+	if (this->dev->tryReadAt(buf, DATA_BLOCK_SIZE, b * DATA_BLOCK_SIZE)) {
+		return false;
+	}
+	uint64_t badMask = this->pattern.verify(buf, DATA_BLOCK_SIZE,
+		b * DATA_BLOCK_SIZE);
+	// Classified the same way as the first read, but not reported again
+	ExtentList ignored;
+	return this->examineBlock(buf, b, badMask, &ignored);
+}
+
+bool Check::checkCanaries(const std::vector<block_t>& canaries)
+	throw ()
+{
+	uint8_t buf[CANARY_READ_SIZE] __attribute__((aligned(DEVICE_ALIGN)));
+	Classifier classifier(this->pattern);
+	for (std::vector<block_t>::const_iterator
+		i = canaries.begin(); i != canaries.end(); i++
+	) {
+		block_t off = *i * DATA_BLOCK_SIZE;
+		if (this->dev->tryReadAt(buf, CANARY_READ_SIZE, off)) {
+			// Leave read errors for read() to report
+			continue;
+		}
+		uint64_t badMask = this->pattern.verify(buf, CANARY_READ_SIZE, off);
+		for (unsigned int s = 0; badMask; s++, badMask >>= 1) {
+			if (!(badMask & 1)) continue;
+			Extent ext;
+			classifier.classify(&buf[s * SECTOR_SIZE], off / SECTOR_SIZE + s, &ext);
+			if ((ext.type == BAD_MOVED) && (ext.movedFrom > ext.start)) {
+				// Writing movedFrom landed on start, so the device loops back to
+				// the beginning after that many blocks, or some fraction of it.
+				block_t distance = (ext.movedFrom - ext.start) / SECTORS_PER_BLOCK;
+				if (distance == 0) distance = 1;
+				this->wrapBlock = this->smallestPeriod(*i, buf, distance);
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+block_t Check::smallestPeriod(block_t canary, const uint8_t *data,
+	block_t distance)
+	throw ()
+{
+	// Several laps can be written between checks, and when blocks are not
+	// written in order a later lap can be the first to land on a canary.  The
+	// real size divides the distance, and reading any multiple of it past the
+	// canary gives the canary's data.
+	std::vector<block_t> divisors;
+	for (block_t d = 1; d * d <= distance; d++) {
+		if (distance % d) continue;
+		divisors.push_back(d);
+		if (d * d != distance) divisors.push_back(distance / d);
+	}
+	std::sort(divisors.begin(), divisors.end());
+
+	uint8_t buf[CANARY_READ_SIZE] __attribute__((aligned(DEVICE_ALIGN)));
+	for (std::vector<block_t>::const_iterator
+		i = divisors.begin(); i != divisors.end(); i++
+	) {
+		if (*i >= distance) break;
+		if (canary + *i >= this->numBlocks) break;
+		if (this->dev->tryReadAt(buf, CANARY_READ_SIZE,
+			(canary + *i) * DATA_BLOCK_SIZE)
+		) {
+			continue;
+		}
+		if (memcmp(buf, data, CANARY_READ_SIZE) == 0) return *i;
+	}
+	return distance;
+}
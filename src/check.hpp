@@ -23,13 +23,31 @@
 
 #include "device.hpp"
 #include "error.hpp"
+#include "pattern.hpp"
+#include "extent.hpp"
+#include "order.hpp"
+#include "progress.hpp"
+#include "rate.hpp"
 
 /// Size of each read and write operation.  Should match the underlying device.
 #define DATA_BLOCK_SIZE 32768
 
+/// Number of individually stamped sectors in each block.
+#define SECTORS_PER_BLOCK (DATA_BLOCK_SIZE / SECTOR_SIZE)
+
 /// Abort when getting read errors continously for this many seconds
 #define MAX_READ_ERROR_TIME 15
 
+/// Re-read the canary blocks after writing this many blocks (64MB).
+#define CANARY_INTERVAL 2048
+
+/// Amount of each canary block to re-read.  One page of sector headers is
+/// enough to tell whose data the block now holds.
+#define CANARY_READ_SIZE DEVICE_ALIGN
+
+/// Gap between blocks in the first round of a progressive verify (32MB).
+#define PROGRESSIVE_STRIDE 1024
+
 class CheckCallback
 {
 	public:
@@ -50,7 +68,8 @@ class CheckCallback
 		 *   a previous write operation.
 		 *
 		 * @param numBlocks
-		 *   Number of blocks on storage device.
+		 *   Number of blocks in the range being tested, which is the whole
+		 *   storage device unless Check::setRange() was used.
 		 */
 		virtual void writeStart(block_t startBlock, block_t numBlocks)
 			throw () = 0;
@@ -58,8 +77,10 @@ class CheckCallback
 		/// Update the user on how the write operation is going.
 		/**
 		 * @param b
-		 *   Current block number.  Will always be <= startBlock passed to
-		 *   writeStart().
+		 *   Number of blocks written so far, counting from the start of the
+		 *   range being tested.  Will always be >= startBlock passed to
+		 *   writeStart().  This is the current block number when writing the
+		 *   whole device in order.
 		 */
 		virtual void writeProgress(block_t b)
 			throw () = 0;
@@ -75,7 +96,7 @@ class CheckCallback
 		 *   a previous read operation.
 		 *
 		 * @param numBlocks
-		 *   Number of blocks on storage device.
+		 *   Number of blocks in the range being tested.
 		 */
 		virtual void readStart(block_t startBlock, block_t numBlocks)
 			throw () = 0;
@@ -83,8 +104,10 @@ class CheckCallback
 		/// Update the user on how the read operation is going.
 		/**
 		 * @param b
-		 *   Current block number.  Will always be <= startBlock passed to
-		 *   readStart().
+		 *   Number of blocks read so far, counting from the start of the range
+		 *   being tested.  Will always be >= startBlock passed to readStart().
+		 *   This is the current block number when reading the whole device in
+		 *   order.
 		 *
 		 * @param fail
 		 *   True if this block couldn't be read due to an I/O error.  False if it
@@ -102,6 +125,57 @@ class CheckCallback
 		/// The check has finished, and here are the results.
 		virtual void checkComplete()
 			throw () = 0;
+
+		/// Update the user on the speed and time left.
+		/**
+		 * Called just before each writeProgress() or readProgress() that
+		 * reports how far the phase has got.  Does nothing unless overridden.
+		 *
+		 * @param status
+		 *   Latest estimate for the current phase.  Only valid until the call
+		 *   returns.
+		 */
+		virtual void rateUpdate(const RateStatus& status)
+			throw ();
+};
+
+/// Pass batches of progress on to a CheckCallback.
+/**
+ * Lets UIs written for the per-block CheckCallback calls be driven by a
+ * ProgressBatcher.  Each batch becomes one writeProgress() or readProgress()
+ * call for where the phase has got to, plus one readProgress() call with
+ * fail set at the end of each run of read errors, so the number of calls
+ * depends on the number of runs of bad blocks and not how many there are.
+ * The rate and time left are estimated from the same batches and passed on
+ * with CheckCallback::rateUpdate().
+ */
+class CheckCallbackSink: virtual public ProgressSink
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param cb
+		 *   UI to pass progress on to.
+		 */
+		CheckCallbackSink(CheckCallback *cb)
+			throw ();
+
+		virtual ~CheckCallbackSink()
+			throw ();
+
+		/// A new phase is starting.
+		/**
+		 * @see RateEstimator::start()
+		 */
+		void start(block_t done, block_t blocks, block_t later)
+			throw ();
+
+		virtual bool progress(bool write, const std::vector<ProgressEvent>& events)
+			throw ();
+
+	protected:
+		CheckCallback *cb;  ///< UI to pass progress on to
+		RateEstimator rate; ///< Speed and time left in the current phase
 };
 
 class Check
@@ -117,18 +191,319 @@ class Check
 		void use(Device *dev)
 			throw (error);
 
+		/// Change the data written to each block.
+		void setPattern(const Pattern& pattern)
+			throw ();
+
+		/// Send progress to a batched sink instead of the CheckCallback.
+		/**
+		 * The CheckCallback is still told when each phase starts and finishes,
+		 * and asked about resuming.
+		 *
+		 * @param sink
+		 *   Where to send progress, or NULL to go back to the CheckCallback.
+		 *   Must stay valid until the check is finished.
+		 */
+		void setProgressSink(ProgressSink *sink)
+			throw ();
+
+		/// Visit blocks in a pseudo-random order instead of sequentially.
+		/**
+		 * @param seed
+		 *   Seed for the order.  The write and read phases use different orders
+		 *   derived from this seed.
+		 */
+		void setRandomOrder(uint64_t seed)
+			throw ();
+
+		/// Verify a coarse grid of blocks first, then fill in the gaps.
+		/**
+		 * read() uses a ProgressiveOrder instead of going in order, and stops
+		 * as soon as a block turns out to hold another block's data or none at
+		 * all and still does when read again.  A device like that is fake or
+		 * dead, so there is no point reading the rest.  Not used with stripes
+		 * or setOrder().
+		 *
+		 * @param stride
+		 *   Gap between blocks in the first round, or 0 to read in the usual
+		 *   order.
+		 */
+		void setProgressive(block_t stride)
+			throw ();
+
+		/// Visit only the blocks given by an order, in both phases.
+		/**
+		 * Replaces the sequential or random order, and the stripes.  Any write
+		 * left unfinished by an earlier run is not resumed.  Unless the order
+		 * covers every block in the range the partition table is not written,
+		 * except when the device wraps around.
+		 *
+		 * @param order
+		 *   Blocks to visit, all within the range.  Must stay valid until the
+		 *   check is finished.  NULL to go back to visiting every block.
+		 */
+		void setOrder(BlockOrder *order)
+			throw ();
+
+		/// Only test part of the device.
+		/**
+		 * The partition table is only written when the whole device is tested.
+		 *
+		 * @param firstBlock
+		 *   First block to test.
+		 *
+		 * @param count
+		 *   Number of blocks to test.
+		 */
+		void setRange(block_t firstBlock, block_t count)
+			throw (error);
+
+		/// Split the range into stripes that are tested at the same time.
+		/**
+		 * Each stripe is a contiguous part of the range with its own position,
+		 * and one request is kept outstanding on each.  This keeps devices with
+		 * several flash channels busy.  Stripes cannot be combined with
+		 * setRandomOrder(), and a striped write cannot be resumed.
+		 *
+		 * @param stripes
+		 *   Number of stripes, 1 to go through the range in one pass.
+		 */
+		void setStripes(unsigned int stripes)
+			throw ();
+
+		/// Say how many phases the whole check will go through.
+		/**
+		 * Only used to estimate the total time left.  The default of 2 suits
+		 * write() followed by read().  Each call to write(), rewrite() or read()
+		 * counts as one phase.
+		 *
+		 * @param phases
+		 *   Number of calls to write(), rewrite() and read() still to come.
+		 */
+		void setPhases(unsigned int phases)
+			throw ();
+
+		/// Verify data written by an earlier run, instead of calling write().
+		/**
+		 * The run ID and pattern type are read back from sector 1, which the
+		 * partition table never covers.  A partition table in sector 0 is not
+		 * counted as bad, and read() leaves the partition table alone.
+		 *
+		 * @param runID
+		 *   Run ID the data was written with, or 0 to take it from the device.
+		 *   If sector 1 is damaged the pattern type given to setPattern() is
+		 *   used with this run ID.
+		 *
+		 * @return The run ID that will be verified.
+		 */
+		uint64_t useExistingData(uint64_t runID)
+			throw (error);
+
 		/// Write out verification data to the device.
 		void write()
 			throw (error);
 
+		/// Verify the data and replace it with another pattern, in one pass.
+		/**
+		 * Called between write() and read() to put the device through several
+		 * patterns.  Each block is read back and checked, then the new pattern
+		 * is written over it straight away, so checking one pattern and writing
+		 * the next take a single trip through the range.
+		 *
+		 * The new data uses the next key up from the current one, so a sector
+		 * the write does not reach still holds the old key and fails the next
+		 * check.  Bad sectors are added to the ones read() reports.  All I/O
+		 * bypasses the page cache, and each stripe has its own queue slot as in
+		 * write() and read(), but blocks are always visited in order.
+		 *
+		 * @param type
+		 *   Kind of data to write next.
+		 */
+		void rewrite(PatternType type)
+			throw (error);
+
 		/// Read back the verification data from the device.
+		/**
+		 * Bad sectors found by any earlier rewrite() are included in the
+		 * results.
+		 */
 		void read()
 			throw (error);
 
+		/// Did read() find any bad sectors?
+		bool foundBad() const
+			throw ();
+
+		/// Did write() stop early because the device wrapped around?
+		/**
+		 * If so the partition table has already been written, and there is no
+		 * point calling read().
+		 */
+		bool wrapped() const
+			throw ();
+
+		/// Get the bad sectors found by read().
+		const ExtentList& getBadSectors() const
+			throw ();
+
 	protected:
 		Device *dev;        ///< Device being examined
 		CheckCallback *cb;  ///< Who to notify about events
+		CheckCallbackSink cbSink; ///< Passes batched progress on to cb
+		ProgressBatcher progress; ///< Collects the outcome of each block
+		unsigned int phasesLeft; ///< Phases to go, including the current one
 		block_t numBlocks; ///< Size of device, in blocks
+		block_t firstBlock; ///< First block to test
+		block_t endBlock;   ///< One past the last block to test
+		unsigned int stripes; ///< Number of parts of the range to test at once
+		Pattern pattern;    ///< Data to write to each block
+		ExtentList badSectors; ///< Bad areas found by rewrite() and read()
+		bool randomOrder;   ///< Visit blocks in a pseudo-random order?
+		uint64_t orderSeed; ///< Seed for the pseudo-random order
+		BlockOrder *order;  ///< Blocks to visit, or NULL for every block
+		block_t progressiveStride; ///< First stride for read(), or 0
+		block_t wrapBlock;  ///< Real size in blocks if write() saw it wrap, or 0
+		bool existingData;  ///< Verifying an earlier run's data?
+
+		friend class StripeJob;
+
+		/// Number of blocks visited by each phase.
+		block_t visitBlocks() const
+			throw ();
+
+		/// Tell the progress batcher and rate estimate a phase is starting.
+		/**
+		 * @param write
+		 *   true for a write phase, false for a read phase.
+		 *
+		 * @param done
+		 *   Blocks already finished, when resuming.
+		 *
+		 * @param blocks
+		 *   Number of blocks in the phase.
+		 */
+		void startPhase(bool write, block_t done, block_t blocks)
+			throw ();
+
+		/// Did an earlier run write all the way to the end of the range?
+		/**
+		 * @param sector1
+		 *   Sector 1 of the device, holding the earlier run's header.
+		 *
+		 * @param runID
+		 *   Run ID found in sector 1.
+		 *
+		 * @return true if the last block holds that run's data, so there is
+		 *   nothing to resume.
+		 */
+		bool writeFinished(const uint8_t *sector1, uint64_t runID)
+			throw ();
+
+		/// Is the range being tested the whole device?
+		bool wholeDevice() const
+			throw ();
+
+		/// Run the write or read phase with each stripe in its own queue slot.
+		/**
+		 * @param write
+		 *   true for the write phase, false for the read phase.
+		 *
+		 * @param canaries
+		 *   Canary blocks written so far, added to as the write goes.  Only used
+		 *   when writing.
+		 *
+		 * @param next
+		 *   When reading, data to write over each block once it has been
+		 *   checked, or NULL to only read.
+		 */
+		void runStripes(bool write, std::vector<block_t> *canaries,
+			const Pattern *next)
+			throw (error);
+
+		/// Check a block read back from the device, noting any bad sectors.
+		/**
+		 * @param buf
+		 *   Data read back from the block.
+		 *
+		 * @param b
+		 *   Block number.
+		 *
+		 * @param found
+		 *   List to add any bad sectors to.  Nothing else is changed, so this
+		 *   can run on several blocks at once as long as each has its own list.
+		 *
+		 * @return true if the block holds another block's data or none at all,
+		 *   as examineBlock() returns.
+		 */
+		bool verifyBlock(const uint8_t *buf, block_t b, ExtentList *found) const
+			throw ();
+
+		/// Work out what went wrong with the bad sectors in a block.
+		/**
+		 * @param buf
+		 *   Data read back from the block.
+		 *
+		 * @param b
+		 *   Block number.
+		 *
+		 * @param badMask
+		 *   Bad sectors in the block, as returned by Pattern::verify().
+		 *
+		 * @param found
+		 *   List to add the bad sectors to.
+		 *
+		 * @return true if any sector was aliased or unwritten, which a real
+		 *   device does not do however worn it is.
+		 */
+		bool examineBlock(const uint8_t *buf, block_t b, uint64_t badMask,
+			ExtentList *found) const
+			throw ();
+
+		/// Read a block again to make sure it really was aliased or unwritten.
+		/**
+		 * The block is read bypassing any cache, and nothing is added to the
+		 * list of bad sectors.
+		 *
+		 * @return true if the block still holds another block's data or none.
+		 */
+		bool confirmLost(block_t b)
+			throw ();
+
+		/// Re-read blocks written earlier to see if later writes landed on them.
+		/**
+		 * Devices with a faked capacity usually wrap around, so writing past
+		 * the real end overwrites the start.  Checking a few early blocks while
+		 * writing catches this as soon as it happens, instead of after writing
+		 * and reading the whole device.  The reads bypass the cache, as it
+		 * would still hold the original data.
+		 *
+		 * @param canaries
+		 *   Blocks to check.  All must have been written already.
+		 *
+		 * @return true if the device has wrapped, in which case wrapBlock is
+		 *   set to the real size of the device.
+		 */
+		bool checkCanaries(const std::vector<block_t>& canaries)
+			throw ();
+
+		/// Find the real size of a device that has wrapped around.
+		/**
+		 * @param canary
+		 *   Canary block that was overwritten.
+		 *
+		 * @param data
+		 *   CANARY_READ_SIZE bytes read from the canary.
+		 *
+		 * @param distance
+		 *   Number of blocks between the canary and the block whose data it
+		 *   now holds.
+		 *
+		 * @return The smallest distance, dividing the given one, at which the
+		 *   device repeats.
+		 */
+		block_t smallestPeriod(block_t canary, const uint8_t *data,
+			block_t distance)
+			throw ();
 };
 
 #endif // CHECK_HPP_
@@ -0,0 +1,79 @@
+/**
+ * @file  classify.cpp
+ * @brief Work out what is wrong with a bad sector.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "classify.hpp"
+#include "kernel.hpp"
+
+Classifier::Classifier(const Pattern& pattern)
+	throw ()
+	: pattern(pattern)
+{
+}
+
+void Classifier::classify(const uint8_t *sector, block_t sectorNum,
+	Extent *ext) const
+	throw ()
+{
+	ext->start = sectorNum;
+	ext->len = 1;
+	ext->movedFrom = 0;
+	ext->flipsUp = ext->flipsDown = 0;
+
+	// Unwritten or erased
+	if ((sector[0] == 0x00) && allBytes(sector, SECTOR_SIZE, 0x00)) {
+		ext->type = BAD_ZERO;
+		return;
+	}
+	if ((sector[0] == 0xFF) && allBytes(sector, SECTOR_SIZE, 0xFF)) {
+		ext->type = BAD_ONES;
+		return;
+	}
+
+	block_t found;
+	uint64_t key;
+	Pattern::readHeader(sector, &found, &key);
+	bool rightHeader = (found == sectorNum) && (key == this->pattern.getKey());
+	if (!rightHeader && Pattern::decode(sector, &found, &key)) {
+		// Intact, but written for somewhere or some time else
+		if (key == this->pattern.getKey()) {
+			ext->type = BAD_MOVED;
+			ext->movedFrom = found;
+		} else {
+			ext->type = BAD_STALE;
+		}
+		return;
+	}
+
+	// Damaged data, so compare it against what should be there
+	uint8_t expected[SECTOR_SIZE];
+	this->pattern.fillSector(expected, sectorNum);
+	BitCounts bits;
+	bitDiff(expected, sector, SECTOR_SIZE, &bits);
+	ext->flipsUp = bits.flipsUp;
+	ext->flipsDown = bits.flipsDown;
+	if (rightHeader
+		|| (bits.flipsUp + bits.flipsDown < SECTOR_SIZE * 8 / CLASSIFY_GARBAGE_DIV)
+	) {
+		ext->type = BAD_CORRUPT;
+	} else {
+		ext->type = BAD_GARBAGE;
+	}
+	return;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file  classify.hpp
+ * @brief Work out what is wrong with a bad sector.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLASSIFY_HPP_
+#define CLASSIFY_HPP_
+
+#include "pattern.hpp"
+#include "extent.hpp"
+
+/// Sectors with more than 1/CLASSIFY_GARBAGE_DIV of their bits wrong are garbage.
+#define CLASSIFY_GARBAGE_DIV 4
+
+/// Label bad sectors by the kind of data they hold.
+/**
+ * The cheapest tests run first and each stops as soon as the answer is known,
+ * so a card that is half unwritten or aliased costs little more to examine
+ * than a good one:
+ *
+ *  - Erased (0x00 or 0xFF) needs one vector compare to rule out.
+ *  - A header naming this sector means only the payload is damaged.
+ *  - A valid checksum means intact data from another sector (moved) or from
+ *    another run (stale), identified from the header.
+ *
+ * Only what is left is compared bit by bit against the expected data, to
+ * split bit errors in the right data from random garbage.
+ */
+class Classifier
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param pattern
+		 *   Pattern the data was written with.
+		 */
+		Classifier(const Pattern& pattern)
+			throw ();
+
+		/// Work out what is wrong with a bad sector.
+		/**
+		 * @param sector
+		 *   SECTOR_SIZE bytes read back from the device.
+		 *
+		 * @param sectorNum
+		 *   Absolute sector number the data was read from.
+		 *
+		 * @param ext
+		 *   On return, a single-sector extent describing the problem.  Bit flip
+		 *   counts are only filled in for BAD_CORRUPT and BAD_GARBAGE.
+		 */
+		void classify(const uint8_t *sector, block_t sectorNum, Extent *ext) const
+			throw ();
+
+	protected:
+		const Pattern& pattern;  ///< Pattern the data was written with
+};
+
+#endif // CLASSIFY_HPP_
@@ -0,0 +1,153 @@
+/**
+ * @file  crc32c.cpp
+ * @brief CRC32C (Castagnoli) checksum, hardware accelerated where possible.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "crc32c.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+/// CRC32C polynomial, bit-reversed.
+#define CRC32C_POLY 0x82F63B78
+
+/// Tables for the slice-by-8 software version.
+static uint32_t crcTable[8][256];
+
+/// Fill in crcTable.
+static void crcInitTable()
+{
+	for (unsigned int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (unsigned int j = 0; j < 8; j++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		}
+		crcTable[0][i] = crc;
+	}
+	for (unsigned int i = 0; i < 256; i++) {
+		uint32_t crc = crcTable[0][i];
+		for (unsigned int t = 1; t < 8; t++) {
+			crc = crcTable[0][crc & 0xFF] ^ (crc >> 8);
+			crcTable[t][i] = crc;
+		}
+	}
+	return;
+}
+
+/// Software CRC32C, eight bytes at a time.
+static uint32_t crcSoftware(uint32_t crc, const uint8_t *buf, unsigned int len)
+{
+	while (len >= 8) {
+		uint32_t lo = buf[0] | (buf[1] << 8) | (buf[2] << 16)
+			| ((uint32_t)buf[3] << 24);
+		uint32_t hi = buf[4] | (buf[5] << 8) | (buf[6] << 16)
+			| ((uint32_t)buf[7] << 24);
+		lo ^= crc;
+		crc = crcTable[7][lo & 0xFF] ^ crcTable[6][(lo >> 8) & 0xFF]
+			^ crcTable[5][(lo >> 16) & 0xFF] ^ crcTable[4][lo >> 24]
+			^ crcTable[3][hi & 0xFF] ^ crcTable[2][(hi >> 8) & 0xFF]
+			^ crcTable[1][(hi >> 16) & 0xFF] ^ crcTable[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--) crc = crcTable[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef CRC32C_X86
+/// SSE4.2 CRC32C, only called if the CPU supports it.
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const uint8_t *buf, unsigned int len)
+{
+#ifdef __x86_64__
+	uint64_t crc64 = crc;
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		crc64 = _mm_crc32_u64(crc64, v);
+		buf += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+#endif
+	while (len >= 4) {
+		uint32_t v;
+		memcpy(&v, buf, 4);
+		crc = _mm_crc32_u32(crc, v);
+		buf += 4;
+		len -= 4;
+	}
+	while (len--) crc = _mm_crc32_u8(crc, *buf++);
+	return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+/// ARMv8 CRC32C.
+static uint32_t crcHardware(uint32_t crc, const uint8_t *buf, unsigned int len)
+{
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		crc = __crc32cd(crc, v);
+		buf += 8;
+		len -= 8;
+	}
+	while (len--) crc = __crc32cb(crc, *buf++);
+	return crc;
+}
+#endif
+
+/// Implementation picked on first use.
+typedef uint32_t (*CRCFunction)(uint32_t crc, const uint8_t *buf,
+	unsigned int len);
+
+/// Work out which implementation to use.
+static CRCFunction crcSelect()
+{
+#if defined(CRC32C_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		return crcHardware;
+	}
+#elif defined(CRC32C_ARM)
+	return crcHardware;
+#endif
+	crcInitTable();
+	return crcSoftware;
+}
+
+static CRCFunction crcImpl = crcSelect();
+
+uint32_t crc32c(const uint8_t *buf, unsigned int len)
+	throw ()
+{
+	return ~crcImpl(0xFFFFFFFF, buf, len);
+}
+
+uint32_t crc32cUpdate(uint32_t crc, const uint8_t *buf, unsigned int len)
+	throw ()
+{
+	return ~crcImpl(~crc, buf, len);
+}
@@ -0,0 +1,61 @@
+/**
+ * @file  crc32c.hpp
+ * @brief CRC32C (Castagnoli) checksum, hardware accelerated where possible.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CRC32C_HPP_
+#define CRC32C_HPP_
+
+#include <stdint.h>
+
+/// Calculate the CRC32C of a buffer.
+/**
+ * Uses the SSE4.2 crc32 instruction on x86 CPUs that have it, the ARMv8 CRC
+ * instructions when compiled for them, and a slice-by-8 table lookup
+ * otherwise.  All give the same result.
+ *
+ * @param buf
+ *   Data to checksum.
+ *
+ * @param len
+ *   Number of bytes in buf.
+ *
+ * @return CRC32C of the data, with the standard initial and final inversion.
+ */
+uint32_t crc32c(const uint8_t *buf, unsigned int len)
+	throw ();
+
+/// Continue a CRC32C over more data.
+/**
+ * @param crc
+ *   CRC32C of the data so far, as returned by crc32c() or crc32cUpdate().
+ *   Zero for no data so far.
+ *
+ * @param buf
+ *   Data following on from the data so far.
+ *
+ * @param len
+ *   Number of bytes in buf.
+ *
+ * @return CRC32C of all the data, as if crc32c() had been called on it in
+ *   one piece.
+ */
+uint32_t crc32cUpdate(uint32_t crc, const uint8_t *buf, unsigned int len)
+	throw ();
+
+#endif // CRC32C_HPP_
@@ -20,6 +20,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include "device.hpp"
 
 /// Length of the master boot record (in bytes)
@@ -103,6 +104,53 @@ Device::~Device()
 {
 }
 
+// The errno value is lost by the time the exception gets here, so all that
+// can be said is that the I/O failed.
+
+int Device::tryWrite(uint8_t *buf, unsigned int len)
+	throw ()
+{
+	try {
+		this->write(buf, len);
+	} catch (const error& e) {
+		return EIO;
+	}
+	return 0;
+}
+
+int Device::tryRead(uint8_t *buf, unsigned int len)
+	throw ()
+{
+	try {
+		this->read(buf, len);
+	} catch (const error& e) {
+		return EIO;
+	}
+	return 0;
+}
+
+int Device::tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+	throw ()
+{
+	try {
+		this->writeAt(buf, len, off);
+	} catch (const error& e) {
+		return EIO;
+	}
+	return 0;
+}
+
+int Device::tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+	throw ()
+{
+	try {
+		this->readAt(buf, len, off);
+	} catch (const error& e) {
+		return EIO;
+	}
+	return 0;
+}
+
 void Device::writePartitionTable(block_t firstBad, block_t lastBad, block_t size)
 	throw (error)
 {
@@ -145,3 +193,9 @@ void Device::writePartitionTable(block_t firstBad, block_t lastBad, block_t size
 	this->write(mbr, MBR_LEN);
 	return;
 }
+
+bool Device::isPartitionTable(const uint8_t *sector)
+	throw ()
+{
+	return (sector[0x1FE] == 0x55) && (sector[0x1FF] == 0xAA);
+}
@@ -27,6 +27,9 @@
 /// Data type used to store block numbers.
 typedef unsigned long long block_t;
 
+/// Buffers, offsets and lengths aligned to this many bytes bypass any cache.
+#define DEVICE_ALIGN 4096
+
 class Device
 {
 	public:
@@ -67,6 +70,58 @@ class Device
 		virtual void read(uint8_t *buf, unsigned int len)
 			throw (error) = 0;
 
+		/// Write some data at the given offset, leaving the seek position alone.
+		/**
+		 * Unlike write(), this may be called from several threads at once.  If
+		 * buf, len and off are all multiples of DEVICE_ALIGN then any operating
+		 * system cache is bypassed, where the platform supports it.
+		 */
+		virtual void writeAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (error) = 0;
+
+		/// Read some data at the given offset, leaving the seek position alone.
+		/**
+		 * @see writeAt() for threading and alignment.
+		 */
+		virtual void readAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (error) = 0;
+
+		/// Write some data at the current seek position, without throwing.
+		/**
+		 * For loops that expect many failures, where building and unwinding an
+		 * exception for each one costs more than the I/O.  Devices that can
+		 * report errors directly should override this and the other try
+		 * functions; the defaults call the throwing versions.
+		 *
+		 * @return 0 on success, otherwise an errno value saying what went wrong.
+		 */
+		virtual int tryWrite(uint8_t *buf, unsigned int len)
+			throw ();
+
+		/// Read some data at the current seek position, without throwing.
+		/**
+		 * @see tryWrite() for the return value.  As with read(), the seek
+		 * position is undefined after a failure.
+		 */
+		virtual int tryRead(uint8_t *buf, unsigned int len)
+			throw ();
+
+		/// Write some data at the given offset, without throwing.
+		/**
+		 * @see writeAt() for threading and alignment, tryWrite() for the return
+		 *   value.
+		 */
+		virtual int tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
+		/// Read some data at the given offset, without throwing.
+		/**
+		 * @see writeAt() for threading and alignment, tryWrite() for the return
+		 *   value.
+		 */
+		virtual int tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
 		/// Ensure all cached data is written to the device.
 		virtual void sync()
 			throw (error) = 0;
@@ -86,6 +141,17 @@ class Device
 		 */
 		void writePartitionTable(block_t firstBad, block_t lastBad, block_t size)
 			throw (error);
+
+		/// Does a sector look like a partition table?
+		/**
+		 * @param sector
+		 *   First 512 bytes of the device.
+		 *
+		 * @return true if the sector ends in the boot signature written by
+		 *   writePartitionTable().
+		 */
+		static bool isPartitionTable(const uint8_t *sector)
+			throw ();
 };
 
 #endif // DEVICE_HPP_
@@ -0,0 +1,458 @@
+/**
+ * @file  endurance.cpp
+ * @brief Test a device over and over, tracking how it wears.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <math.h>
+#include "endurance.hpp"
+#include "queue.hpp"
+
+TimedDevice::TimedDevice(Device *dev)
+	throw (error)
+	: dev(dev)
+{
+	if (pthread_mutex_init(&this->lock, NULL) != 0) {
+		throw error("Unable to create mutex");
+	}
+}
+
+TimedDevice::~TimedDevice()
+	throw ()
+{
+	pthread_mutex_destroy(&this->lock);
+}
+
+void TimedDevice::open(const char *path)
+	throw (error)
+{
+	this->dev->open(path);
+	return;
+}
+
+void TimedDevice::close()
+	throw (error)
+{
+	this->dev->close();
+	return;
+}
+
+void TimedDevice::reopen()
+	throw (error)
+{
+	this->dev->reopen();
+	return;
+}
+
+block_t TimedDevice::size()
+	throw (error)
+{
+	return this->dev->size();
+}
+
+void TimedDevice::seek(block_t off)
+	throw (error)
+{
+	this->dev->seek(off);
+	return;
+}
+
+void TimedDevice::write(uint8_t *buf, unsigned int len)
+	throw (error)
+{
+	double start = monotonicTime();
+	this->dev->write(buf, len);
+	this->record(&this->writes, start);
+	return;
+}
+
+void TimedDevice::read(uint8_t *buf, unsigned int len)
+	throw (error)
+{
+	double start = monotonicTime();
+	this->dev->read(buf, len);
+	this->record(&this->reads, start);
+	return;
+}
+
+void TimedDevice::writeAt(uint8_t *buf, unsigned int len, block_t off)
+	throw (error)
+{
+	double start = monotonicTime();
+	this->dev->writeAt(buf, len, off);
+	this->record(&this->writes, start);
+	return;
+}
+
+void TimedDevice::readAt(uint8_t *buf, unsigned int len, block_t off)
+	throw (error)
+{
+	double start = monotonicTime();
+	this->dev->readAt(buf, len, off);
+	this->record(&this->reads, start);
+	return;
+}
+
+int TimedDevice::tryWrite(uint8_t *buf, unsigned int len)
+	throw ()
+{
+	double start = monotonicTime();
+	int err = this->dev->tryWrite(buf, len);
+	if (!err) this->record(&this->writes, start);
+	return err;
+}
+
+int TimedDevice::tryRead(uint8_t *buf, unsigned int len)
+	throw ()
+{
+	double start = monotonicTime();
+	int err = this->dev->tryRead(buf, len);
+	if (!err) this->record(&this->reads, start);
+	return err;
+}
+
+int TimedDevice::tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+	throw ()
+{
+	double start = monotonicTime();
+	int err = this->dev->tryWriteAt(buf, len, off);
+	if (!err) this->record(&this->writes, start);
+	return err;
+}
+
+int TimedDevice::tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+	throw ()
+{
+	double start = monotonicTime();
+	int err = this->dev->tryReadAt(buf, len, off);
+	if (!err) this->record(&this->reads, start);
+	return err;
+}
+
+void TimedDevice::sync()
+	throw (error)
+{
+	this->dev->sync();
+	return;
+}
+
+void TimedDevice::record(LatencyHistogram *hist, double start)
+	throw ()
+{
+	double latency = monotonicTime() - start;
+	pthread_mutex_lock(&this->lock);
+	hist->add(latency);
+	pthread_mutex_unlock(&this->lock);
+	return;
+}
+
+/// Pass progress on to the UI, but never resume the last cycle's write.
+class EnduranceCallback: virtual public CheckCallback
+{
+	public:
+		EnduranceCallback(CheckCallback *cb)
+			throw ()
+			: cb(cb)
+		{
+		}
+
+		virtual ~EnduranceCallback()
+			throw ()
+		{
+		}
+
+		virtual bool resumeWrite()
+			throw ()
+		{
+			// Every cycle starts a new run, even after one that was cut short
+			return false;
+		}
+
+		virtual void writeStart(block_t startBlock, block_t numBlocks)
+			throw ()
+		{
+			this->cb->writeStart(startBlock, numBlocks);
+			return;
+		}
+
+		virtual void writeProgress(block_t b)
+			throw ()
+		{
+			this->cb->writeProgress(b);
+			return;
+		}
+
+		virtual void writeFinish()
+			throw ()
+		{
+			this->cb->writeFinish();
+			return;
+		}
+
+		virtual void readStart(block_t startBlock, block_t numBlocks)
+			throw ()
+		{
+			this->cb->readStart(startBlock, numBlocks);
+			return;
+		}
+
+		virtual bool readProgress(block_t b, bool fail)
+			throw ()
+		{
+			return this->cb->readProgress(b, fail);
+		}
+
+		virtual void readFinish()
+			throw ()
+		{
+			this->cb->readFinish();
+			return;
+		}
+
+		virtual void checkComplete()
+			throw ()
+		{
+			this->cb->checkComplete();
+			return;
+		}
+
+		virtual void rateUpdate(const RateStatus& status)
+			throw ()
+		{
+			this->cb->rateUpdate(status);
+			return;
+		}
+
+	protected:
+		CheckCallback *cb; ///< UI to pass everything on to
+};
+
+Endurance::Endurance(Device *dev, CheckCallback *cb)
+	throw ()
+	: dev(dev),
+	  cb(cb),
+	  type(PATTERN_BLOCKNUM),
+	  firstBlock(0),
+	  count(0),
+	  stripes(1),
+	  randomOrder(false),
+	  orderSeed(0),
+	  maxSlowdown(ENDURANCE_DEFAULT_SLOWDOWN),
+	  maxNewBad(-1),
+	  wrapped(false),
+	  partial(false)
+{
+}
+
+void Endurance::setTest(PatternType type, block_t firstBlock, block_t count,
+	unsigned int stripes)
+	throw ()
+{
+	this->type = type;
+	this->firstBlock = firstBlock;
+	this->count = count;
+	this->stripes = stripes;
+	return;
+}
+
+void Endurance::setRandomOrder(uint64_t seed)
+	throw ()
+{
+	this->randomOrder = true;
+	this->orderSeed = seed;
+	return;
+}
+
+void Endurance::setLimits(unsigned int maxSlowdown, long long maxNewBad)
+	throw ()
+{
+	this->maxSlowdown = maxSlowdown;
+	this->maxNewBad = maxNewBad;
+	return;
+}
+
+void Endurance::run(unsigned int cycles, uint64_t runID)
+	throw (error)
+{
+	this->cycles.clear();
+	this->allBad.clear();
+	this->wrapped = false;
+	this->partial = false;
+	this->stopReason.clear();
+	if (this->count == 0) {
+		this->count = this->dev->size() / DATA_BLOCK_SIZE - this->firstBlock;
+	}
+	try {
+		this->runCycles(cycles, runID);
+	} catch (const error&) {
+		// Each cycle's read() writes a partition table, but a failed cycle
+		// leaves its test data in sector 0
+		try {
+			this->writePartitionTable();
+		} catch (const error&) {
+			// Report the original problem instead
+		}
+		throw;
+	}
+	// Check::write() has already written one around the real size
+	if (!this->wrapped) this->writePartitionTable();
+	return;
+}
+
+void Endurance::runCycles(unsigned int cycles, uint64_t runID)
+	throw (error)
+{
+	EnduranceCallback ecb(this->cb);
+	block_t bytes = this->count * DATA_BLOCK_SIZE;
+
+	for (unsigned int c = 0; c < cycles; c++) {
+		EnduranceCycle result;
+		result.runID = runID + c;
+		std::cout << "\nCycle " << c + 1 << " of " << cycles << ", run ID "
+			<< std::hex << result.runID << std::dec << std::endl;
+
+		TimedDevice timed(this->dev);
+		Check chk(&timed, &ecb);
+		chk.setPattern(Pattern(this->type, result.runID));
+		chk.setRange(this->firstBlock, this->count);
+		chk.setStripes(this->stripes);
+		if (this->randomOrder) chk.setRandomOrder(this->orderSeed + c);
+
+		double tmStart = monotonicTime();
+		chk.write();
+		double writeTime = monotonicTime() - tmStart;
+		if (chk.wrapped()) {
+			this->wrapped = true;
+			this->partial = true;
+			this->stopReason = "the device wrapped around";
+			break;
+		}
+		tmStart = monotonicTime();
+		chk.read();
+		double readTime = monotonicTime() - tmStart;
+
+		result.writeRate = (writeTime > 0) ? bytes / 1024 / writeTime : 0;
+		result.readRate = (readTime > 0) ? bytes / 1024 / readTime : 0;
+		result.writeP50 = timed.writes.percentile(0.5);
+		result.writeP99 = timed.writes.percentile(0.99);
+		result.writeMax = timed.writes.max();
+		result.readP50 = timed.reads.percentile(0.5);
+		result.readP99 = timed.reads.percentile(0.99);
+		result.readMax = timed.reads.max();
+
+		// sort() drops sectors already listed, so the growth is what is new
+		const ExtentList& bad = chk.getBadSectors();
+		result.badSectors = bad.count();
+		block_t before = this->allBad.count();
+		this->allBad.extents.insert(this->allBad.extents.end(),
+			bad.extents.begin(), bad.extents.end());
+		this->allBad.sort();
+		result.newBadSectors = this->allBad.count() - before;
+		this->cycles.push_back(result);
+
+		const EnduranceCycle& first = this->cycles[0];
+		std::ostringstream why;
+		if ((this->maxNewBad >= 0) && (c > 0)
+			&& (result.newBadSectors > (block_t)this->maxNewBad)
+		) {
+			why << result.newBadSectors << " new bad sectors in one cycle";
+		} else if ((c > 0) && first.writeRate
+			&& (result.writeRate * 100 < first.writeRate * (100 - this->maxSlowdown))
+		) {
+			why << "the write speed dropped from " << first.writeRate << " to "
+				<< result.writeRate << " kB/sec";
+		} else if ((c > 0) && first.readRate
+			&& (result.readRate * 100 < first.readRate * (100 - this->maxSlowdown))
+		) {
+			why << "the read speed dropped from " << first.readRate << " to "
+				<< result.readRate << " kB/sec";
+		}
+		if (!why.str().empty()) {
+			this->stopReason = why.str();
+			break;
+		}
+	}
+	return;
+}
+
+void Endurance::writePartitionTable()
+	throw (error)
+{
+	block_t numBlocks = this->dev->size() / DATA_BLOCK_SIZE;
+	// Check::read() has already said what happened to a partial range
+	if ((this->firstBlock != 0) || (this->count != numBlocks)) return;
+
+	// Every cycle's bad sectors, as some only fail now and then
+	block_t size = numBlocks * DATA_BLOCK_SIZE;
+	if (this->allBad.empty()) {
+		this->dev->writePartitionTable(0, 0, size);
+	} else {
+		this->dev->writePartitionTable(
+			this->allBad.first() * SECTOR_SIZE,
+			this->allBad.end() * SECTOR_SIZE - 1,
+			size);
+	}
+	return;
+}
+
+bool Endurance::failed() const
+	throw ()
+{
+	return this->wrapped || !this->allBad.empty() || !this->stopReason.empty();
+}
+
+void Endurance::report(std::ostream& out) const
+	throw ()
+{
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	out << "Cycle            Run ID  Write kB/s  Read kB/s   Write ms p50/p99/max"
+		"    Read ms p50/p99/max    Bad    New\n" << std::setfill(' ');
+	for (unsigned int c = 0; c < this->cycles.size(); c++) {
+		const EnduranceCycle& r = this->cycles[c];
+		out << std::setw(5) << c + 1
+			<< std::setw(18) << std::hex << r.runID << std::dec
+			<< std::setw(12) << r.writeRate
+			<< std::setw(11) << r.readRate
+			<< std::fixed << std::setprecision(2)
+			<< std::setw(9) << r.writeP50 * 1000
+			<< std::setw(8) << r.writeP99 * 1000
+			<< std::setw(8) << r.writeMax * 1000
+			<< std::setw(9) << r.readP50 * 1000
+			<< std::setw(8) << r.readP99 * 1000
+			<< std::setw(8) << r.readMax * 1000
+			<< std::setw(7) << r.badSectors
+			<< std::setw(7) << r.newBadSectors << '\n';
+	}
+	out.flags(flags);
+	out.precision(precision);
+	if (this->partial) {
+		out << "Stopped part way through cycle " << this->cycles.size() + 1
+			<< " because " << this->stopReason << ".\n";
+	} else if (!this->stopReason.empty()) {
+		out << "Stopped after " << this->cycles.size() << " cycles because "
+			<< this->stopReason << ".\n";
+	}
+	if (!this->allBad.empty()) {
+		out << this->allBad.count() << " bad sectors found over all cycles:\n";
+		this->allBad.report(out, SECTOR_SIZE);
+	}
+	return;
+}
@@ -0,0 +1,229 @@
+/**
+ * @file  endurance.hpp
+ * @brief Test a device over and over, tracking how it wears.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENDURANCE_HPP_
+#define ENDURANCE_HPP_
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <pthread.h>
+#include "device.hpp"
+#include "error.hpp"
+#include "check.hpp"
+#include "extent.hpp"
+#include "latency.hpp"
+
+/// Stop if either speed drops by this percentage from the first cycle.
+#define ENDURANCE_DEFAULT_SLOWDOWN 50
+
+/// Device that passes everything through to another, timing each transfer.
+class TimedDevice: virtual public Device
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device to pass operations on to.  It must already be open.
+		 */
+		TimedDevice(Device *dev)
+			throw (error);
+
+		virtual ~TimedDevice()
+			throw ();
+
+		virtual void open(const char *path)
+			throw (error);
+
+		virtual void close()
+			throw (error);
+
+		virtual void reopen()
+			throw (error);
+
+		virtual block_t size()
+			throw (error);
+
+		virtual void seek(block_t off)
+			throw (error);
+
+		virtual void write(uint8_t *buf, unsigned int len)
+			throw (error);
+
+		virtual void read(uint8_t *buf, unsigned int len)
+			throw (error);
+
+		virtual void writeAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (error);
+
+		virtual void readAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (error);
+
+		virtual int tryWrite(uint8_t *buf, unsigned int len)
+			throw ();
+
+		virtual int tryRead(uint8_t *buf, unsigned int len)
+			throw ();
+
+		virtual int tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
+		virtual int tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
+		virtual void sync()
+			throw (error);
+
+		LatencyHistogram writes; ///< Time taken by each successful write
+		LatencyHistogram reads;  ///< Time taken by each successful read
+
+	protected:
+		Device *dev;          ///< Device doing the work
+		pthread_mutex_t lock; ///< Protects the histograms
+
+		/// Add a sample to one of the histograms.
+		void record(LatencyHistogram *hist, double start)
+			throw ();
+};
+
+/// Results of one write and verify cycle.
+struct EnduranceCycle
+{
+	uint64_t runID;           ///< Run ID the cycle wrote
+	unsigned long writeRate;  ///< Write phase speed, kB/sec
+	unsigned long readRate;   ///< Read phase speed, kB/sec
+	double writeP50;          ///< Median write latency, seconds
+	double writeP99;          ///< 99th percentile write latency
+	double writeMax;          ///< Slowest write
+	double readP50;           ///< Median read latency
+	double readP99;           ///< 99th percentile read latency
+	double readMax;           ///< Slowest read
+	block_t badSectors;       ///< Bad sectors found this cycle
+	block_t newBadSectors;    ///< Bad sectors not found by any earlier cycle
+};
+
+/// Write and verify a device a number of times, watching it wear out.
+/**
+ * Each cycle is a full Check with its own run ID, so data left by the last
+ * cycle never passes.  Every transfer is timed, and the speed, latency and
+ * bad sectors of each cycle are kept so the results show how the device
+ * changes as it is worn.  The test stops early if the device wraps around,
+ * slows down too much compared to the first cycle, or finds too many new bad
+ * sectors.
+ */
+class Endurance
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device to test.
+		 *
+		 * @param cb
+		 *   Progress reports for each cycle.  The question about resuming an
+		 *   earlier write is always answered no, without asking.
+		 */
+		Endurance(Device *dev, CheckCallback *cb)
+			throw ();
+
+		/// Set up each cycle's Check the same way.
+		/**
+		 * @param type
+		 *   Data to write.
+		 *
+		 * @param firstBlock
+		 *   First block to test.
+		 *
+		 * @param count
+		 *   Number of blocks to test.
+		 *
+		 * @param stripes
+		 *   Number of stripes to test at once.
+		 */
+		void setTest(PatternType type, block_t firstBlock, block_t count,
+			unsigned int stripes)
+			throw ();
+
+		/// Visit blocks in a pseudo-random order, different in each cycle.
+		void setRandomOrder(uint64_t seed)
+			throw ();
+
+		/// Set when to stop early.
+		/**
+		 * @param maxSlowdown
+		 *   Percentage either speed may drop by compared to the first cycle.
+		 *
+		 * @param maxNewBad
+		 *   Number of new bad sectors a single cycle may find, or -1 for no
+		 *   limit.
+		 */
+		void setLimits(unsigned int maxSlowdown, long long maxNewBad)
+			throw ();
+
+		/// Run up to the given number of cycles.
+		/**
+		 * When the whole device is tested, a partition table is written at the
+		 * end around every bad sector found by any cycle, even if a cycle fails
+		 * part way through, so sector 0 is not left holding test data.
+		 *
+		 * @param cycles
+		 *   Maximum number of cycles.
+		 *
+		 * @param runID
+		 *   Run ID for the first cycle.  Each later cycle adds one.
+		 */
+		void run(unsigned int cycles, uint64_t runID)
+			throw (error);
+
+		/// Did the device wrap, find bad sectors, or stop early?
+		bool failed() const
+			throw ();
+
+		/// Write a table of the results of each cycle.
+		void report(std::ostream& out) const
+			throw ();
+
+	protected:
+		Device *dev;            ///< Device being tested
+		CheckCallback *cb;      ///< Where progress goes
+		PatternType type;       ///< Data to write
+		block_t firstBlock;     ///< First block to test
+		block_t count;          ///< Number of blocks to test
+		unsigned int stripes;   ///< Stripes to test at once
+		bool randomOrder;       ///< Visit blocks in a pseudo-random order?
+		uint64_t orderSeed;     ///< Seed for the first cycle's order
+		unsigned int maxSlowdown; ///< Percentage drop in speed allowed
+		long long maxNewBad;    ///< New bad sectors allowed per cycle, or -1
+		std::vector<EnduranceCycle> cycles; ///< Results so far
+		ExtentList allBad;      ///< Every bad sector found by any cycle
+		bool wrapped;           ///< Did a cycle find the device wraps around?
+		bool partial;           ///< Did the test stop part way through a cycle?
+		std::string stopReason; ///< Why the test stopped early, if it did
+
+		/// Run the cycles themselves, for run().
+		void runCycles(unsigned int cycles, uint64_t runID)
+			throw (error);
+
+		/// Replace the partition table, if the whole device was tested.
+		void writePartitionTable()
+			throw (error);
+};
+
+#endif // ENDURANCE_HPP_
@@ -0,0 +1,258 @@
+/**
+ * @file  extent.cpp
+ * @brief List of bad areas found on a device.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include "extent.hpp"
+
+const char *badTypeName(BadType type)
+	throw ()
+{
+	switch (type) {
+		case BAD_READ_ERROR: return "Read errors";
+		case BAD_ZERO: return "Unwritten or erased (all 0x00)";
+		case BAD_ONES: return "Unwritten or erased (all 0xFF)";
+		case BAD_MOVED: return "Data written to another sector (aliased)";
+		case BAD_STALE: return "Data from a previous run";
+		case BAD_CORRUPT: return "Bit errors";
+		case BAD_GARBAGE: return "Random garbage";
+		case BAD_TYPE_COUNT: break;
+	}
+	return "Unknown";
+}
+
+block_t Extent::end() const
+	throw ()
+{
+	return this->start + this->len;
+}
+
+bool Extent::continuedBy(const Extent& next) const
+	throw ()
+{
+	if (next.start != this->end()) return false;
+	if (next.type != this->type) return false;
+	// Moved data must keep the same offset to be part of the same extent
+	if ((this->type == BAD_MOVED) && (next.movedFrom != this->movedFrom + this->len)) {
+		return false;
+	}
+	return true;
+}
+
+/// Order extents by starting sector.
+static bool extentBefore(const Extent& a, const Extent& b)
+{
+	return a.start < b.start;
+}
+
+ExtentList::ExtentList()
+	throw ()
+{
+}
+
+void ExtentList::clear()
+	throw ()
+{
+	this->extents.clear();
+	return;
+}
+
+void ExtentList::add(const Extent& e)
+	throw ()
+{
+	if (!this->extents.empty() && this->extents.back().continuedBy(e)) {
+		Extent& last = this->extents.back();
+		last.len += e.len;
+		last.flipsUp += e.flipsUp;
+		last.flipsDown += e.flipsDown;
+	} else {
+		this->extents.push_back(e);
+	}
+	return;
+}
+
+void ExtentList::sort()
+	throw ()
+{
+	if (this->extents.empty()) return;
+	// Stable, so where extents overlap the one added first comes first
+	std::stable_sort(this->extents.begin(), this->extents.end(), extentBefore);
+	std::vector<Extent> merged;
+	merged.push_back(this->extents[0]);
+	for (unsigned int i = 1; i < this->extents.size(); i++) {
+		Extent next = this->extents[i];
+		if (next.start < merged.back().end()) {
+			// Already covered, e.g. found again by a later pass, so only keep
+			// the part past the end of the earlier extent
+			if (next.end() <= merged.back().end()) continue;
+			block_t overlap = merged.back().end() - next.start;
+			next.start += overlap;
+			next.len -= overlap;
+			if (next.type == BAD_MOVED) next.movedFrom += overlap;
+		}
+		if (merged.back().continuedBy(next)) {
+			merged.back().len += next.len;
+			merged.back().flipsUp += next.flipsUp;
+			merged.back().flipsDown += next.flipsDown;
+		} else {
+			merged.push_back(next);
+		}
+	}
+	this->extents.swap(merged);
+	return;
+}
+
+bool ExtentList::empty() const
+	throw ()
+{
+	return this->extents.empty();
+}
+
+block_t ExtentList::count() const
+	throw ()
+{
+	block_t total = 0;
+	for (std::vector<Extent>::const_iterator
+		i = this->extents.begin(); i != this->extents.end(); i++
+	) {
+		total += i->len;
+	}
+	return total;
+}
+
+block_t ExtentList::first() const
+	throw ()
+{
+	block_t first = this->extents[0].start;
+	for (std::vector<Extent>::const_iterator
+		i = this->extents.begin(); i != this->extents.end(); i++
+	) {
+		if (i->start < first) first = i->start;
+	}
+	return first;
+}
+
+block_t ExtentList::end() const
+	throw ()
+{
+	block_t end = 0;
+	for (std::vector<Extent>::const_iterator
+		i = this->extents.begin(); i != this->extents.end(); i++
+	) {
+		if (i->end() > end) end = i->end();
+	}
+	return end;
+}
+
+ExtentList ExtentList::filter(BadType type) const
+	throw ()
+{
+	ExtentList list;
+	for (std::vector<Extent>::const_iterator
+		i = this->extents.begin(); i != this->extents.end(); i++
+	) {
+		if (i->type == type) list.extents.push_back(*i);
+	}
+	return list;
+}
+
+void ExtentList::flips(uint64_t *flipsUp, uint64_t *flipsDown) const
+	throw ()
+{
+	*flipsUp = *flipsDown = 0;
+	for (std::vector<Extent>::const_iterator
+		i = this->extents.begin(); i != this->extents.end(); i++
+	) {
+		*flipsUp += i->flipsUp;
+		*flipsDown += i->flipsDown;
+	}
+	return;
+}
+
+void ExtentList::report(std::ostream& out, unsigned int sectorSize) const
+	throw ()
+{
+	for (unsigned int t = 0; t < BAD_TYPE_COUNT; t++) {
+		ExtentList list = this->filter((BadType)t);
+		if (list.empty()) continue;
+		out << "  " << badTypeName((BadType)t) << ": " << list.count()
+			<< " sectors in " << list.extents.size() << " extents\n";
+		unsigned int n = 0;
+		for (std::vector<Extent>::const_iterator
+			i = list.extents.begin(); i != list.extents.end(); i++, n++
+		) {
+			if (n == EXTENT_REPORT_MAX) {
+				out << "    ...and " << list.extents.size() - n << " more\n";
+				break;
+			}
+			out << "    Sectors " << i->start << '-' << i->end() - 1 << " (bytes "
+				<< i->start * sectorSize << '-' << i->end() * sectorSize - 1 << ")";
+			if (i->type == BAD_MOVED) {
+				out << " hold data of sectors " << i->movedFrom << '-'
+					<< i->movedFrom + i->len - 1;
+			} else if ((i->type == BAD_CORRUPT) || (i->type == BAD_GARBAGE)) {
+				out << ", " << i->flipsUp + i->flipsDown << " bits flipped ("
+					<< i->flipsUp << " 0->1, " << i->flipsDown << " 1->0)";
+			}
+			out << '\n';
+		}
+	}
+	return;
+}
+
+void ExtentList::save(std::ostream& out, block_t numSectors) const
+	throw ()
+{
+	out << EXTENT_FILE_ID << ' ' << numSectors << '\n'
+		<< "# start length type movedFrom flipsUp flipsDown\n";
+	for (std::vector<Extent>::const_iterator
+		i = this->extents.begin(); i != this->extents.end(); i++
+	) {
+		out << i->start << ' ' << i->len << ' ' << (unsigned int)i->type << ' '
+			<< i->movedFrom << ' ' << i->flipsUp << ' ' << i->flipsDown << '\n';
+	}
+	return;
+}
+
+bool ExtentList::load(std::istream& in, block_t *numSectors)
+	throw ()
+{
+	std::string line, id;
+	if (!std::getline(in, line)) return false;
+	std::istringstream header(line);
+	if (!(header >> id >> *numSectors) || (id != EXTENT_FILE_ID)) return false;
+
+	this->extents.clear();
+	while (std::getline(in, line)) {
+		if (line.empty() || (line[0] == '#')) continue;
+		std::istringstream fields(line);
+		Extent e;
+		unsigned int type;
+		if (!(fields >> e.start >> e.len >> type >> e.movedFrom >> e.flipsUp
+			>> e.flipsDown) || (type >= BAD_TYPE_COUNT)
+		) {
+			return false;
+		}
+		e.type = (BadType)type;
+		this->extents.push_back(e);
+	}
+	return true;
+}
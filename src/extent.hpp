@@ -0,0 +1,167 @@
+/**
+ * @file  extent.hpp
+ * @brief List of bad areas found on a device.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef EXTENT_HPP_
+#define EXTENT_HPP_
+
+#include <vector>
+#include <istream>
+#include <ostream>
+#include "device.hpp"
+
+/// Maximum number of extents to list individually in a report.
+#define EXTENT_REPORT_MAX 20
+
+/// First word of a saved extent list.
+#define EXTENT_FILE_ID "scanflash-extents"
+
+/// What was wrong with a bad sector.
+enum BadType {
+	BAD_READ_ERROR, ///< Could not be read at all
+	BAD_ZERO,       ///< Every bit reads back as 0 (unwritten or erased)
+	BAD_ONES,       ///< Every bit reads back as 1 (unwritten or erased)
+	BAD_MOVED,      ///< Intact data from this test, but for another sector
+	BAD_STALE,      ///< Intact scanflash data, but from a previous run
+	BAD_CORRUPT,    ///< The right data, but some bits are wrong
+	BAD_GARBAGE,    ///< Nothing like the data that was written
+	BAD_TYPE_COUNT, ///< Number of types, not a type itself
+};
+
+/// Description of a type of bad sector.
+const char *badTypeName(BadType type)
+	throw ();
+
+/// Run of consecutive bad sectors that all failed in the same way.
+struct Extent
+{
+	block_t start;      ///< First bad sector
+	block_t len;        ///< Number of bad sectors
+	BadType type;       ///< What is wrong with the sectors
+	block_t movedFrom;  ///< If BAD_MOVED, the sector whose data is in start
+	uint64_t flipsUp;   ///< Total bits that should be 0 but read back as 1
+	uint64_t flipsDown; ///< Total bits that should be 1 but read back as 0
+
+	/// One past the last bad sector.
+	block_t end() const
+		throw ();
+
+	/// Can the other extent, which follows this one, be merged into it?
+	bool continuedBy(const Extent& next) const
+		throw ();
+};
+
+/// Collection of bad extents, kept merged and in order.
+class ExtentList
+{
+	public:
+		ExtentList()
+			throw ();
+
+		/// Remove all extents.
+		void clear()
+			throw ();
+
+		/// Add a bad area.
+		/**
+		 * Extents may be added in any order.  If the new extent directly follows
+		 * the last one added in the same way it is merged into it, otherwise it
+		 * is kept separate until sort() is called.
+		 */
+		void add(const Extent& e)
+			throw ();
+
+		/// Put the extents in order and merge any that are adjacent.
+		/**
+		 * Sectors listed more than once keep the extent that was added first.
+		 */
+		void sort()
+			throw ();
+
+		/// Are there no bad extents?
+		bool empty() const
+			throw ();
+
+		/// Total number of bad sectors.
+		block_t count() const
+			throw ();
+
+		/// First bad sector.  Only valid if !empty().
+		block_t first() const
+			throw ();
+
+		/// One past the last bad sector.  Only valid if !empty().
+		block_t end() const
+			throw ();
+
+		/// Get only the extents of one type.
+		ExtentList filter(BadType type) const
+			throw ();
+
+		/// Total number of flipped bits in sectors that could be read.
+		/**
+		 * @param flipsUp
+		 *   On return, bits that should be 0 but read back as 1.
+		 *
+		 * @param flipsDown
+		 *   On return, bits that should be 1 but read back as 0.
+		 */
+		void flips(uint64_t *flipsUp, uint64_t *flipsDown) const
+			throw ();
+
+		/// Write a human readable list of the extents, grouped by type.
+		/**
+		 * @param out
+		 *   Stream to write to.
+		 *
+		 * @param sectorSize
+		 *   Bytes per sector, to show byte offsets as well.
+		 */
+		void report(std::ostream& out, unsigned int sectorSize) const
+			throw ();
+
+		/// Write the extents to a file, to be loaded again with load().
+		/**
+		 * @param out
+		 *   Stream to write to.
+		 *
+		 * @param numSectors
+		 *   Size of the device the extents are for, so a list is not used on
+		 *   the wrong device.
+		 */
+		void save(std::ostream& out, block_t numSectors) const
+			throw ();
+
+		/// Replace the extents with ones written by save().
+		/**
+		 * @param in
+		 *   Stream to read from.
+		 *
+		 * @param numSectors
+		 *   On return, the size of the device the extents are for.
+		 *
+		 * @return false if the data is not a saved extent list.
+		 */
+		bool load(std::istream& in, block_t *numSectors)
+			throw ();
+
+		std::vector<Extent> extents;  ///< Bad areas
+};
+
+#endif // EXTENT_HPP_
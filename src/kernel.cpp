@@ -0,0 +1,262 @@
+/**
+ * @file  kernel.cpp
+ * @brief Fast routines for generating and checking test data.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "kernel.hpp"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#define KERNEL_X86
+#endif
+
+/// Number of interleaved generators.
+#define PRNG_LANES 4
+
+uint64_t mix64(uint64_t x)
+	throw ()
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x;
+}
+
+/// Set up the state of each generator from the seed.
+static void prngSeed(uint64_t *s0, uint64_t *s1, uint64_t seed)
+{
+	for (unsigned int l = 0; l < PRNG_LANES; l++) {
+		s0[l] = mix64(seed + (2 * l + 1) * 0x9E3779B97F4A7C15ULL);
+		s1[l] = mix64(s0[l] ^ 0x6A09E667F3BCC909ULL);
+		if ((s0[l] | s1[l]) == 0) s1[l] = 1; // all-zero state never changes
+	}
+	return;
+}
+
+#ifdef __SSE2__
+
+/// Advance two xorshift128+ generators held in a pair of registers.
+static inline __m128i prngStep(__m128i *a, __m128i *b)
+{
+	__m128i s1 = *a;
+	__m128i s0 = *b;
+	__m128i out = _mm_add_epi64(s0, s1);
+	*a = s0;
+	s1 = _mm_xor_si128(s1, _mm_slli_epi64(s1, 23));
+	*b = _mm_xor_si128(
+		_mm_xor_si128(s1, s0),
+		_mm_xor_si128(_mm_srli_epi64(s1, 17), _mm_srli_epi64(s0, 26))
+	);
+	return out;
+}
+
+void prngFill(uint8_t *buf, unsigned int len, uint64_t seed)
+	throw ()
+{
+	uint64_t s0[PRNG_LANES], s1[PRNG_LANES];
+	prngSeed(s0, s1, seed);
+	__m128i a0 = _mm_set_epi64x(s0[1], s0[0]), b0 = _mm_set_epi64x(s1[1], s1[0]);
+	__m128i a1 = _mm_set_epi64x(s0[3], s0[2]), b1 = _mm_set_epi64x(s1[3], s1[2]);
+	for (unsigned int i = 0; i < len; i += KERNEL_CHUNK) {
+		_mm_storeu_si128((__m128i *)&buf[i], prngStep(&a0, &b0));
+		_mm_storeu_si128((__m128i *)&buf[i + 16], prngStep(&a1, &b1));
+	}
+	return;
+}
+
+#else // !__SSE2__
+
+/// Advance one xorshift128+ generator.
+static inline uint64_t prngStep(uint64_t *a, uint64_t *b)
+{
+	uint64_t s1 = *a;
+	uint64_t s0 = *b;
+	uint64_t out = s0 + s1;
+	*a = s0;
+	s1 ^= s1 << 23;
+	*b = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+	return out;
+}
+
+void prngFill(uint8_t *buf, unsigned int len, uint64_t seed)
+	throw ()
+{
+	uint64_t s0[PRNG_LANES], s1[PRNG_LANES];
+	prngSeed(s0, s1, seed);
+	for (unsigned int i = 0; i < len; i += KERNEL_CHUNK) {
+		for (unsigned int l = 0; l < PRNG_LANES; l++) {
+			uint64_t v = prngStep(&s0[l], &s1[l]);
+			for (unsigned int j = 0; j < 8; j++) buf[i + l * 8 + j] = v >> (j * 8);
+		}
+	}
+	return;
+}
+
+#endif // __SSE2__
+
+/// Rotate a 64-bit value left.
+static inline uint64_t rotl64(uint64_t x, unsigned int n)
+{
+	n &= 63;
+	return n ? (x << n) | (x >> (64 - n)) : x;
+}
+
+void fillWords(uint8_t *buf, unsigned int len, uint64_t even, uint64_t odd)
+	throw ()
+{
+#ifdef __SSE2__
+	const __m128i v = _mm_set_epi64x(odd, even);
+	for (unsigned int i = 0; i < len; i += 16) {
+		_mm_storeu_si128((__m128i *)&buf[i], v);
+	}
+#else
+	for (unsigned int i = 0; i < len; i += 16) {
+		memcpy(&buf[i], &even, 8);
+		memcpy(&buf[i + 8], &odd, 8);
+	}
+#endif
+	return;
+}
+
+void walkFill(uint8_t *buf, unsigned int len, unsigned int shift)
+	throw ()
+{
+#ifdef __SSE2__
+	// Each register holds two neighbouring words, so both rotate by two places
+	// per store, and a rotate is the same shift count in every lane.
+	__m128i v = _mm_set_epi64x(rotl64(1, shift + 1), rotl64(1, shift));
+	for (unsigned int i = 0; i < len; i += 16) {
+		_mm_storeu_si128((__m128i *)&buf[i], v);
+		v = _mm_or_si128(_mm_slli_epi64(v, 2), _mm_srli_epi64(v, 62));
+	}
+#else
+	for (unsigned int i = 0; i < len; i += 8) {
+		uint64_t v = rotl64(1, shift + i / 8);
+		memcpy(&buf[i], &v, 8);
+	}
+#endif
+	return;
+}
+
+bool allBytes(const uint8_t *buf, unsigned int len, uint8_t value)
+	throw ()
+{
+#ifdef __SSE2__
+	const __m128i v = _mm_set1_epi8((char)value);
+	for (unsigned int i = 0; i < len; i += 16) {
+		__m128i d = _mm_loadu_si128((const __m128i *)&buf[i]);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, v)) != 0xFFFF) return false;
+	}
+#else
+	uint64_t v = value * 0x0101010101010101ULL;
+	for (unsigned int i = 0; i < len; i += 8) {
+		uint64_t d;
+		memcpy(&d, &buf[i], 8);
+		if (d != v) return false;
+	}
+#endif
+	return true;
+}
+
+/// Portable bit comparison, eight bytes at a time.
+static void bitDiffPlain(const uint8_t *expected, const uint8_t *actual,
+	unsigned int len, BitCounts *counts)
+{
+	uint64_t up = 0, down = 0, ones = 0;
+	for (unsigned int i = 0; i < len; i += 8) {
+		uint64_t e, a;
+		memcpy(&e, &expected[i], 8);
+		memcpy(&a, &actual[i], 8);
+		up += __builtin_popcountll(a & ~e);
+		down += __builtin_popcountll(e & ~a);
+		ones += __builtin_popcountll(a);
+	}
+	counts->flipsUp = up;
+	counts->flipsDown = down;
+	counts->ones = ones;
+	return;
+}
+
+#ifdef KERNEL_X86
+/// Count the bits in each byte, using pshufb as a 16-entry lookup table.
+__attribute__((target("ssse3")))
+static inline __m128i popcount8(__m128i v)
+{
+	const __m128i lookup = _mm_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m128i low = _mm_set1_epi8(0x0F);
+	__m128i lo = _mm_shuffle_epi8(lookup, _mm_and_si128(v, low));
+	__m128i hi = _mm_shuffle_epi8(lookup, _mm_and_si128(_mm_srli_epi16(v, 4), low));
+	return _mm_add_epi8(lo, hi);
+}
+
+/// SSSE3 bit comparison, only called if the CPU supports it.
+__attribute__((target("ssse3")))
+static void bitDiffSSSE3(const uint8_t *expected, const uint8_t *actual,
+	unsigned int len, BitCounts *counts)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i up = zero, down = zero, ones = zero;
+	for (unsigned int i = 0; i < len; i += 16) {
+		__m128i e = _mm_loadu_si128((const __m128i *)&expected[i]);
+		__m128i a = _mm_loadu_si128((const __m128i *)&actual[i]);
+		// psadbw against zero sums the byte counts into two 64-bit lanes
+		up = _mm_add_epi64(up, _mm_sad_epu8(popcount8(_mm_andnot_si128(e, a)), zero));
+		down = _mm_add_epi64(down, _mm_sad_epu8(popcount8(_mm_andnot_si128(a, e)), zero));
+		ones = _mm_add_epi64(ones, _mm_sad_epu8(popcount8(a), zero));
+	}
+	uint64_t v[2];
+	_mm_storeu_si128((__m128i *)v, up);
+	counts->flipsUp = v[0] + v[1];
+	_mm_storeu_si128((__m128i *)v, down);
+	counts->flipsDown = v[0] + v[1];
+	_mm_storeu_si128((__m128i *)v, ones);
+	counts->ones = v[0] + v[1];
+	return;
+}
+#endif
+
+/// Implementation picked on first use.
+typedef void (*BitDiffFunction)(const uint8_t *expected, const uint8_t *actual,
+	unsigned int len, BitCounts *counts);
+
+/// Work out which implementation to use.
+static BitDiffFunction bitDiffSelect()
+{
+#ifdef KERNEL_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) return bitDiffSSSE3;
+#endif
+	return bitDiffPlain;
+}
+
+static BitDiffFunction bitDiffImpl = bitDiffSelect();
+
+void bitDiff(const uint8_t *expected, const uint8_t *actual, unsigned int len,
+	BitCounts *counts)
+	throw ()
+{
+	bitDiffImpl(expected, actual, len, counts);
+	return;
+}
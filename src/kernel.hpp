@@ -0,0 +1,131 @@
+/**
+ * @file  kernel.hpp
+ * @brief Fast routines for generating and checking test data.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KERNEL_HPP_
+#define KERNEL_HPP_
+
+#include <stdint.h>
+
+/// Lengths passed to the kernels must be a multiple of this many bytes.
+#define KERNEL_CHUNK 32
+
+/// Mix the bits of a 64-bit value (splitmix64 finaliser).
+uint64_t mix64(uint64_t x)
+	throw ();
+
+/// Fill a buffer with a pseudo-random stream.
+/**
+ * The stream is four interleaved xorshift128+ generators, which maps directly
+ * onto SIMD registers.  The SIMD and plain versions produce identical data.
+ *
+ * @param buf
+ *   Buffer to fill.
+ *
+ * @param len
+ *   Number of bytes to write, a multiple of KERNEL_CHUNK.
+ *
+ * @param seed
+ *   Starting point of the stream.  Each seed gives a different stream.
+ */
+void prngFill(uint8_t *buf, unsigned int len, uint64_t seed)
+	throw ();
+
+/// Fill a buffer with two alternating 64-bit words.
+/**
+ * @param buf
+ *   Buffer to fill.
+ *
+ * @param len
+ *   Number of bytes to write, a multiple of KERNEL_CHUNK.
+ *
+ * @param even
+ *   Value of the first word and every second word after it.
+ *
+ * @param odd
+ *   Value of the words in between.
+ */
+void fillWords(uint8_t *buf, unsigned int len, uint64_t even, uint64_t odd)
+	throw ();
+
+/// Fill a buffer with 64-bit words each holding a single 1 bit.
+/**
+ * The bit moves up one place in each word, so 64 words walk it through
+ * every position.
+ *
+ * @param buf
+ *   Buffer to fill.
+ *
+ * @param len
+ *   Number of bytes to write, a multiple of KERNEL_CHUNK.
+ *
+ * @param shift
+ *   Position of the bit in the first word, 0 to 63.
+ */
+void walkFill(uint8_t *buf, unsigned int len, unsigned int shift)
+	throw ();
+
+/// Check whether every byte in a buffer has the same value.
+/**
+ * Stops at the first 16 bytes that differ, so rejecting typical data costs
+ * a single vector compare.
+ *
+ * @param buf
+ *   Data to check.
+ *
+ * @param len
+ *   Number of bytes in buf, a multiple of KERNEL_CHUNK.
+ *
+ * @param value
+ *   Value every byte must have.
+ *
+ * @return true if every byte is value.
+ */
+bool allBytes(const uint8_t *buf, unsigned int len, uint8_t value)
+	throw ();
+
+/// Number of bits that differ between two buffers, and in which direction.
+struct BitCounts
+{
+	uint64_t flipsUp;   ///< Bits expected to be 0 that read back as 1
+	uint64_t flipsDown; ///< Bits expected to be 1 that read back as 0
+	uint64_t ones;      ///< Bits set in the data read back
+};
+
+/// Compare data read back against what was expected, bit by bit.
+/**
+ * Uses an SSSE3 nibble lookup popcount on CPUs that have it.
+ *
+ * @param expected
+ *   Data that was written.
+ *
+ * @param actual
+ *   Data that was read back.
+ *
+ * @param len
+ *   Number of bytes in each buffer, a multiple of KERNEL_CHUNK.
+ *
+ * @param counts
+ *   On return, the number of flipped and set bits.
+ */
+void bitDiff(const uint8_t *expected, const uint8_t *actual, unsigned int len,
+	BitCounts *counts)
+	throw ();
+
+#endif // KERNEL_HPP_
@@ -0,0 +1,95 @@
+/**
+ * @file  latency.cpp
+ * @brief Distribution of I/O latencies.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include "latency.hpp"
+
+LatencyHistogram::LatencyHistogram()
+	throw ()
+{
+	this->clear();
+}
+
+void LatencyHistogram::clear()
+	throw ()
+{
+	for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) this->buckets[i] = 0;
+	this->total = 0;
+	this->longest = 0;
+	return;
+}
+
+void LatencyHistogram::add(double seconds)
+	throw ()
+{
+	// Bucket 0 is anything up to 1us, bucket n up to 2^(n/4) us
+	double us = seconds * 1000000;
+	unsigned int b = 0;
+	if (us > 1) {
+		b = (unsigned int)ceil(log2(us) * LATENCY_BUCKETS_PER_DOUBLING);
+		if (b >= LATENCY_BUCKETS) b = LATENCY_BUCKETS - 1;
+	}
+	this->buckets[b]++;
+	this->total++;
+	if (seconds > this->longest) this->longest = seconds;
+	return;
+}
+
+unsigned long LatencyHistogram::count() const
+	throw ()
+{
+	return this->total;
+}
+
+double LatencyHistogram::percentile(double fraction) const
+	throw ()
+{
+	if (this->total == 0) return 0;
+	unsigned long target = (unsigned long)ceil(this->total * fraction);
+	if (target < 1) target = 1;
+	unsigned long seen = 0;
+	for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+		seen += this->buckets[b];
+		if (seen >= target) {
+			double edge = LatencyHistogram::bucketEdge(b);
+			// The last bucket is open ended
+			return (edge < this->longest) ? edge : this->longest;
+		}
+	}
+	return this->longest;
+}
+
+double LatencyHistogram::max() const
+	throw ()
+{
+	return this->longest;
+}
+
+unsigned long LatencyHistogram::bucket(unsigned int b) const
+	throw ()
+{
+	return this->buckets[b];
+}
+
+double LatencyHistogram::bucketEdge(unsigned int b)
+	throw ()
+{
+	return pow(2, (double)b / LATENCY_BUCKETS_PER_DOUBLING) / 1000000;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file  latency.hpp
+ * @brief Distribution of I/O latencies.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LATENCY_HPP_
+#define LATENCY_HPP_
+
+/// Histogram buckets for each doubling of latency.
+#define LATENCY_BUCKETS_PER_DOUBLING 4
+
+/// Number of histogram buckets, covering 1us to over an hour.
+#define LATENCY_BUCKETS (32 * LATENCY_BUCKETS_PER_DOUBLING + 1)
+
+/// Distribution of I/O latencies, without keeping every sample.
+/**
+ * Each bucket covers a quarter of a doubling, so a percentile is accurate to
+ * within about 19%, whatever the number of samples.
+ */
+class LatencyHistogram
+{
+	public:
+		LatencyHistogram()
+			throw ();
+
+		/// Forget all samples.
+		void clear()
+			throw ();
+
+		/// Record one operation.
+		/**
+		 * @param seconds
+		 *   Time the operation took.
+		 */
+		void add(double seconds)
+			throw ();
+
+		/// Number of operations recorded.
+		unsigned long count() const
+			throw ();
+
+		/// Latency that the given fraction of operations did not exceed.
+		/**
+		 * @param fraction
+		 *   0.5 for the median, 0.99 for the 99th percentile, etc.
+		 *
+		 * @return Upper edge of the bucket the percentile falls in, in seconds,
+		 *   or 0 if there are no samples.
+		 */
+		double percentile(double fraction) const
+			throw ();
+
+		/// Longest single operation, in seconds.
+		double max() const
+			throw ();
+
+		/// Number of operations in one bucket.
+		/**
+		 * @param b
+		 *   Bucket number, less than LATENCY_BUCKETS.
+		 */
+		unsigned long bucket(unsigned int b) const
+			throw ();
+
+		/// Longest latency that falls in a bucket, in seconds.
+		/**
+		 * The last bucket has no upper limit, and holds anything longer than
+		 * the bucket before it.
+		 */
+		static double bucketEdge(unsigned int b)
+			throw ();
+
+	protected:
+		unsigned long buckets[LATENCY_BUCKETS]; ///< Operations in each bucket
+		unsigned long total;  ///< Sum of all buckets
+		double longest;       ///< Longest operation seen
+};
+
+#endif // LATENCY_HPP_
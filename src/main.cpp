@@ -20,6 +20,7 @@
 
 #include <iostream>
 #include <iomanip>
+#include <fstream>
 #ifndef _LARGEFILE64_SOURCE
 #define _LARGEFILE64_SOURCE
 #endif
@@ -32,12 +33,25 @@
 #include <stdint.h>
 #include <errno.h>
 #include <time.h>
+#include <getopt.h>
+#include <stdlib.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 
 #include "error.hpp"
 #include "device.hpp"
 #include "check.hpp"
+#include "writespeed.hpp"
+#include "bench.hpp"
+#include "surface.hpp"
+#include "backup.hpp"
+#include "retest.hpp"
+#include "endurance.hpp"
+#include "budget.hpp"
+#include "asyncui.hpp"
+#include "queue.hpp"
+#include "trace.hpp"
+#include "replay.hpp"
 
 enum ReturnCodes {
 	RET_DEVICE_OK     = 0, ///< Test completed successfully, flash drive good
@@ -62,8 +76,15 @@ class POSIXError: virtual public error
 class POSIXDevice: virtual public Device
 {
 	public:
-		POSIXDevice()
-			: fd(-1)
+		/// Constructor.
+		/**
+		 * @param readOnly
+		 *   Open the device read-only, so any attempt to write fails.
+		 */
+		POSIXDevice(bool readOnly)
+			: fd(-1),
+			  fdDirect(-1),
+			  readOnly(readOnly)
 		{
 		}
 
@@ -88,13 +109,19 @@ class POSIXDevice: virtual public Device
 		{
 			::close(fd);
 			this->fd = -1;
+			if (this->fdDirect >= 0) ::close(this->fdDirect);
+			this->fdDirect = -1;
 		}
 
 		virtual void reopen()
 			throw (POSIXError)
 		{
-			this->fd = ::open(this->devPath.c_str(), O_RDWR | O_SYNC);// | O_DSYNC | O_RSYNC | O_NONBLOCK);
+			int mode = this->readOnly ? O_RDONLY : (O_RDWR | O_SYNC);
+			this->fd = ::open(this->devPath.c_str(), mode);// | O_DSYNC | O_RSYNC | O_NONBLOCK);
 			if (this->fd < 0) throw POSIXError(errno);
+			// Second handle for aligned I/O that bypasses the page cache.  Not all
+			// devices support this, in which case the normal handle is used.
+			this->fdDirect = ::open(this->devPath.c_str(), mode | O_DIRECT);
 		}
 
 		virtual unsigned long long size()
@@ -115,17 +142,67 @@ class POSIXDevice: virtual public Device
 		virtual void write(uint8_t *buf, unsigned int len)
 			throw (POSIXError)
 		{
-			if (::write(this->fd, buf, len) < 0) throw POSIXError(errno);
+			int err = this->tryWrite(buf, len);
+			if (err) throw POSIXError(err);
 			return;
 		}
 
 		virtual void read(uint8_t *buf, unsigned int len)
 			throw (POSIXError)
 		{
-			if (::read(this->fd, buf, len) < 0) throw POSIXError(errno);
+			int err = this->tryRead(buf, len);
+			if (err) throw POSIXError(err);
 			return;
 		}
 
+		virtual void writeAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (POSIXError)
+		{
+			int err = this->tryWriteAt(buf, len, off);
+			if (err) throw POSIXError(err);
+			return;
+		}
+
+		virtual void readAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (POSIXError)
+		{
+			int err = this->tryReadAt(buf, len, off);
+			if (err) throw POSIXError(err);
+			return;
+		}
+
+		virtual int tryWrite(uint8_t *buf, unsigned int len)
+			throw ()
+		{
+			if (::write(this->fd, buf, len) < 0) return errno;
+			return 0;
+		}
+
+		virtual int tryRead(uint8_t *buf, unsigned int len)
+			throw ()
+		{
+			if (::read(this->fd, buf, len) < 0) return errno;
+			return 0;
+		}
+
+		virtual int tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ()
+		{
+			if (::pwrite64(this->handleFor(buf, len, off), buf, len, off) < 0) {
+				return errno;
+			}
+			return 0;
+		}
+
+		virtual int tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ()
+		{
+			if (::pread64(this->handleFor(buf, len, off), buf, len, off) < 0) {
+				return errno;
+			}
+			return 0;
+		}
+
 		virtual void sync()
 			throw (POSIXError)
 		{
@@ -142,13 +219,41 @@ class POSIXDevice: virtual public Device
 
 	protected:
 		int fd;
+		int fdDirect;  ///< Handle opened with O_DIRECT, or -1 if unsupported
+		bool readOnly; ///< Was the device opened read-only?
 		std::string devPath;
+
+		/// Pick the uncached handle if the request is suitably aligned.
+		int handleFor(uint8_t *buf, unsigned int len, block_t off)
+			throw ()
+		{
+			if ((this->fdDirect >= 0)
+				&& ((((uintptr_t)buf) | len | off) % DEVICE_ALIGN == 0)
+			) {
+				return this->fdDirect;
+			}
+			return this->fd;
+		}
 };
 
 /// Text console UI
 class ConsoleUI: virtual public CheckCallback
 {
 	public:
+		/// Constructor.
+		/**
+		 * @param minWriteSpeed
+		 *   Minimum sustained write speed in kB/sec, or 0 for no minimum.
+		 */
+		ConsoleUI(unsigned long minWriteSpeed)
+			throw ()
+			: firstReadError(0),
+			  minWriteSpeed(minWriteSpeed),
+			  writeSpeedFailed(false)
+		{
+			this->rate.valid = false;
+		}
+
 		virtual ~ConsoleUI()
 			throw ()
 		{
@@ -174,7 +279,9 @@ class ConsoleUI: virtual public CheckCallback
 		{
 			this->startBlock = startBlock;
 			this->numBlocks = numBlocks;
-			gettimeofday(&this->tmStart, NULL);
+			this->tmStart = monotonicTime();
+			this->rate.valid = false;
+			this->writeSpeed.start(startBlock, DATA_BLOCK_SIZE);
 			return;
 		}
 
@@ -182,25 +289,10 @@ class ConsoleUI: virtual public CheckCallback
 			throw ()
 		{
 			std::cout << "\rWriting to block " << b
-				<< " [" << b * 100 / (this->numBlocks - 1) << "%] ";
+				<< " [" << this->percent(b) << "%] ";
 			if (b > 0) {
-				struct timeval tmNow;
-				gettimeofday(&tmNow, NULL);
-				time_t duration = tmNow.tv_sec - this->tmStart.tv_sec;
-				unsigned long remTime = duration * (this->numBlocks - 1 - b) / (b - this->startBlock);
-				unsigned int s = remTime % 60;
-				unsigned int m = (remTime / 60) % 60;
-				unsigned int h = remTime / 3600;
-				std::cout << "ETA "
-					<< std::setw(2) << std::setfill('0') << h << ':'
-					<< std::setw(2) << std::setfill('0') << m << ':'
-					<< std::setw(2) << std::setfill('0') << s;
-				if (duration > 0) {
-					std::cout << ' '
-						<< ((b - this->startBlock) * (DATA_BLOCK_SIZE / 1024)) / duration
-						<< "kB/sec";
-				}
-				std::cout << std::flush;
+				this->writeSpeed.sample(b, monotonicTime() - this->tmStart);
+				this->showRate(b);
 			}
 			return;
 		}
@@ -209,6 +301,21 @@ class ConsoleUI: virtual public CheckCallback
 			throw ()
 		{
 			std::cout << "\n";
+			WriteSpeedResult res = this->writeSpeed.analyse();
+			if (!res.valid) return;
+			if (res.cliff) {
+				std::cout << "Write cache exhausted after "
+					<< res.cacheSize / 1048576 << "MB: " << res.burstRate
+					<< "kB/sec before, " << res.sustainedRate << "kB/sec after\n";
+			} else {
+				std::cout << "No write cache detected, sustained write speed "
+					<< res.sustainedRate << "kB/sec\n";
+			}
+			if (this->minWriteSpeed && (res.sustainedRate < this->minWriteSpeed)) {
+				std::cout << "FAIL: Sustained write speed is below the minimum of "
+					<< this->minWriteSpeed << "kB/sec\n";
+				this->writeSpeedFailed = true;
+			}
 			return;
 		}
 
@@ -217,8 +324,8 @@ class ConsoleUI: virtual public CheckCallback
 		{
 			this->startBlock = startBlock;
 			this->numBlocks = numBlocks;
-			gettimeofday(&this->tmStart, NULL);
-			this->lastDuration = 0;
+			this->tmStart = monotonicTime();
+			this->rate.valid = false;
 			this->firstReadError = 0;
 			return;
 		}
@@ -227,31 +334,13 @@ class ConsoleUI: virtual public CheckCallback
 			throw ()
 		{
 			std::cout << "\rReading from block " << b
-				<< " [" << b * 100 / (this->numBlocks - 1) << "%] ";
-			struct timeval tmNow;
-			gettimeofday(&tmNow, NULL);
-			time_t duration = tmNow.tv_sec - this->tmStart.tv_sec;
-			if ((b > 0) && (duration != lastDuration)) {
-				lastDuration = duration;
-				unsigned long remTime = duration * (this->numBlocks - 1 - b) / (b - this->startBlock);
-				unsigned int s = remTime % 60;
-				unsigned int m = (remTime / 60) % 60;
-				unsigned int h = remTime / 3600;
-				std::cout << "ETA "
-					<< std::setw(2) << std::setfill('0') << h << ':'
-					<< std::setw(2) << std::setfill('0') << m << ':'
-					<< std::setw(2) << std::setfill('0') << s;
-				if (duration > 0) {
-					std::cout << ' '
-						<< ((b - this->startBlock) * (DATA_BLOCK_SIZE / 1024)) / duration
-						<< "kB/sec";
-				}
-				std::cout << std::flush;
-			}
+				<< " [" << this->percent(b) << "%] ";
+			if (b > 0) this->showRate(b);
 			if (fail) {
+				double now = monotonicTime();
 				if (this->firstReadError == 0) {
-					this->firstReadError = duration;
-				} else if (duration - this->firstReadError > MAX_READ_ERROR_TIME) {
+					this->firstReadError = now;
+				} else if (now - this->firstReadError > MAX_READ_ERROR_TIME) {
 					std::cout << "\nRead bad blocks continuously for "
 						<< MAX_READ_ERROR_TIME << " seconds, aborting.\n";/*"Last error was: "
 						<< e.what();*/
@@ -278,34 +367,798 @@ class ConsoleUI: virtual public CheckCallback
 			return;
 		}
 
+		virtual void rateUpdate(const RateStatus& status)
+			throw ()
+		{
+			this->rate = status;
+			return;
+		}
+
+		/// Did the device fail the minimum sustained write speed?
+		bool failedWriteSpeed() const
+			throw ()
+		{
+			return this->writeSpeedFailed;
+		}
+
 	protected:
-		struct timeval tmStart;
-		time_t lastDuration;
-		time_t firstReadError; ///< Time of the first error in the current run of errors
+		/// How far through the current phase block b is.
+		unsigned int percent(block_t b) const
+			throw ()
+		{
+			if (this->numBlocks < 2) return 100;
+			return b * 100 / (this->numBlocks - 1);
+		}
+
+		/// Show the time left and current speed, once they are known.
+		void showRate(block_t b)
+			throw ()
+		{
+			if (!this->rate.valid) return;
+			// The final 100% update comes without a new rate
+			bool finished = (b + 1 >= this->numBlocks);
+			std::cout << "ETA ";
+			this->showTime(finished ? 0 : this->rate.phaseLeft);
+			if (this->rate.totalLeft > this->rate.phaseLeft) {
+				std::cout << " (all ";
+				this->showTime(this->rate.totalLeft
+					- (finished ? this->rate.phaseLeft : 0));
+				std::cout << ')';
+			}
+			std::cout << ' '
+				<< (unsigned long)(this->rate.recent * (DATA_BLOCK_SIZE / 1024))
+				<< "kB/sec " << std::flush;
+			return;
+		}
+
+		/// Write a number of seconds as hh:mm:ss.
+		void showTime(double seconds)
+			throw ()
+		{
+			unsigned long t = (unsigned long)(seconds + 0.5);
+			std::cout
+				<< std::setw(2) << std::setfill('0') << t / 3600 << ':'
+				<< std::setw(2) << std::setfill('0') << (t / 60) % 60 << ':'
+				<< std::setw(2) << std::setfill('0') << t % 60
+				<< std::setfill(' ');
+			return;
+		}
+
+		double tmStart;        ///< Time the current phase started
+		double firstReadError; ///< Time of the first error in the current run of errors, or 0
+		RateStatus rate;       ///< Latest speed and time left
 		block_t startBlock;
 		block_t numBlocks;
+		WriteSpeed writeSpeed;       ///< Write phase timing, to find cache size
+		unsigned long minWriteSpeed; ///< Minimum sustained kB/sec, 0 for none
+		bool writeSpeedFailed;       ///< Was the sustained speed too slow?
 };
 
+/// Pick a random 64-bit ID for this run.
+uint64_t newRunID()
+{
+	uint64_t id = 0;
+	int fd = ::open("/dev/urandom", O_RDONLY);
+	if (fd >= 0) {
+		if (::read(fd, &id, sizeof(id)) != sizeof(id)) id = 0;
+		::close(fd);
+	}
+	if (id == 0) {
+		// No /dev/urandom, fall back to something that changes between runs
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		id = ((uint64_t)tv.tv_sec << 32) ^ ((uint64_t)tv.tv_usec << 12) ^ getpid();
+	}
+	return id;
+}
+
+/// Read a length of time in seconds, with an optional m or h suffix.
+/**
+ * @return true if valid.
+ */
+bool parseDuration(const char *text, double *seconds)
+{
+	char *end;
+	*seconds = strtod(text, &end);
+	if (end == text) return false;
+	switch (*end) {
+		case 's': end++; break;
+		case 'm': *seconds *= 60; end++; break;
+		case 'h': *seconds *= 3600; end++; break;
+	}
+	return (*end == '\0') && (*seconds > 0);
+}
+
+/// Patterns used by --suite when no list is given.
+#define SUITE_DEFAULT "blocknum,inverse,checkerboard,walking,random"
+
+/// Look up a pattern type by the name used on the command line.
+/**
+ * @return true if the name is valid.
+ */
+bool parsePatternType(const std::string& name, PatternType *type)
+{
+	for (unsigned int t = 0; t < PATTERN_TYPE_COUNT; t++) {
+		if (name.compare(patternTypeName((PatternType)t)) == 0) {
+			*type = (PatternType)t;
+			return true;
+		}
+	}
+	return false;
+}
+
+/// Read a comma separated list of pattern types.
+/**
+ * @return true if every name is valid.
+ */
+bool parseSuite(const char *text, std::vector<PatternType> *suite)
+{
+	suite->clear();
+	std::string list(text);
+	std::string::size_type start = 0;
+	for (;;) {
+		std::string::size_type comma = list.find(',', start);
+		PatternType type;
+		if (!parsePatternType(list.substr(start, comma - start), &type)) {
+			return false;
+		}
+		suite->push_back(type);
+		if (comma == std::string::npos) break;
+		start = comma + 1;
+	}
+	return true;
+}
+
+/// Show command line usage.
+void usage()
+{
+	std::cerr << "Use: scanflash [options] <device>\n"
+		"\n"
+		"Options:\n"
+		"  -s, --min-write-speed=KB  Fail the device if the sustained write speed\n"
+		"                            (after any write cache is full) is below KB\n"
+		"                            kB/sec\n"
+		"  -p, --pattern=TYPE        Data to write: 'blocknum' (default) for the\n"
+		"                            block number, 'random' for incompressible\n"
+		"                            pseudo-random data, 'inverse' for the block\n"
+		"                            number with every bit flipped,\n"
+		"                            'checkerboard' for alternating bits, or\n"
+		"                            'walking' for a single 1 bit moving along\n"
+		"      --suite[=LIST]        Go through several patterns in turn, given as\n"
+		"                            a comma separated list of --pattern types\n"
+		"                            (default " SUITE_DEFAULT ").  Each\n"
+		"                            pattern is checked as the next is written.\n"
+		"                            Cannot be used with --pattern\n"
+		"  -r, --random-order[=SEED] Write and verify blocks in a pseudo-random\n"
+		"                            order, in 4 MB runs\n"
+		"  -b, --benchmark           Measure random 4 kB IOPS instead of scanning\n"
+		"      --bench-region=MB     Spread benchmark I/O over the first MB\n"
+		"                            megabytes (default 1024)\n"
+		"      --claimed-class=A1|A2 Fail the device if the benchmark does not meet\n"
+		"                            this SD application performance class\n"
+		"  -R, --read-only           Scan for read errors and slow areas without\n"
+		"                            writing anything, for cards already in use\n"
+		"  -q, --queue-depth=N       Reads to keep outstanding with --read-only\n"
+		"                            (default " << SCAN_DEFAULT_DEPTH << ")\n"
+		"  -W, --write-only          Write the test data but do not verify it, so\n"
+		"                            it can be verified later with --verify-only\n"
+		"  -V, --verify-only         Verify data written by an earlier run, e.g.\n"
+		"                            to test data retention, without writing\n"
+		"      --run-id=HEX          Run ID to write or verify, instead of a new\n"
+		"                            one or the one found on the device\n"
+		"  -N, --non-destructive=FILE\n"
+		"                            Keep the data on the device, by copying\n"
+		"                            each area to FILE before testing it and\n"
+		"                            copying it back afterwards.  FILE must have\n"
+		"                            room for a copy of the whole device.  If the\n"
+		"                            test is interrupted, run it again with the\n"
+		"                            same FILE to put the data back.\n"
+		"      --overwrite-backup    Let --non-destructive empty a FILE that\n"
+		"                            already holds data from an earlier run\n"
+		"      --offset=BYTES        Only test from BYTES into the device.  BYTES\n"
+		"                            may end in k, M or G, and is rounded down to\n"
+		"                            a whole block (" << DATA_BLOCK_SIZE / 1024 << " kB)\n"
+		"      --length=BYTES        Only test this much of the device, rounded up\n"
+		"                            to a whole block\n"
+		"      --stripes=N           Split the area being tested into N parts and\n"
+		"                            test them all at once, for devices that can\n"
+		"                            handle several requests in parallel\n"
+		"      --save-extents=FILE   Save the list of bad sectors found to FILE\n"
+		"      --retest=FILE         Test only the bad sectors listed in FILE by\n"
+		"                            --save-extents and the area around them,\n"
+		"                            several times over, to place the partitions\n"
+		"                            closer to the real edges of the damage\n"
+		"      --cycles=N            Write and verify the device N times, each\n"
+		"                            with a new run ID, and report how the speed,\n"
+		"                            latency and bad sectors change\n"
+		"      --max-slowdown=PCT    With --cycles, stop once the write or read\n"
+		"                            speed is PCT% below the first cycle's\n"
+		"                            (default " << ENDURANCE_DEFAULT_SLOWDOWN << ")\n"
+		"      --max-new-bad=N       With --cycles, stop once a cycle finds more\n"
+		"                            than N bad sectors no earlier cycle found\n"
+		"      --time-budget=TIME    Test as much of the device as will fit in TIME\n"
+		"                            seconds (or minutes/hours ending in m or h),\n"
+		"                            picking blocks evenly from across it\n"
+		"      --progressive         Verify every " << PROGRESSIVE_STRIDE << "th block first, then fill\n"
+		"                            in the gaps, stopping as soon as a block turns\n"
+		"                            out to hold another block's data or none\n"
+		"      --trace=FILE          Record the time, offset, length and result of\n"
+		"                            every transfer in FILE, to examine later with\n"
+		"                            scanflash-trace\n"
+		"      --replay=TRACE        Treat <device> as a file holding the data,\n"
+		"                            but make each transfer take as long and fail\n"
+		"                            in the same way as in a trace from --trace\n"
+		"  -h, --help                Show this help\n"
+		<< std::flush;
+	return;
+}
+
+/// Read a size in bytes, with an optional k, M or G suffix.
+/**
+ * @return true if valid.
+ */
+bool parseSize(const char *text, block_t *size)
+{
+	char *end;
+	*size = strtoull(text, &end, 10);
+	if (end == text) return false;
+	switch (*end) {
+		case 'k': case 'K': *size *= 1024ULL; end++; break;
+		case 'm': case 'M': *size *= 1048576ULL; end++; break;
+		case 'g': case 'G': *size *= 1073741824ULL; end++; break;
+	}
+	return *end == '\0';
+}
+
+/// Queue depths to run the benchmark at.
+static const unsigned int benchDepths[] = {1, 4, 16, 32};
+
+/// Run the random I/O benchmark and report the application class.
+/**
+ * @return Process return code.
+ */
+int runBenchmark(Device *dev, block_t regionSize, AppClass claimed)
+{
+	try {
+		Benchmark bench(dev, regionSize);
+		std::cout << "Filling benchmark region..." << std::flush;
+		bench.prepare();
+		std::cout << "\n\nQueue depth  Read IOPS  Write IOPS  Errors\n";
+		std::vector<BenchResult> results;
+		for (unsigned int i = 0; i < sizeof(benchDepths) / sizeof(benchDepths[0]); i++) {
+			BenchResult r = bench.run(benchDepths[i]);
+			std::cout << std::setfill(' ')
+				<< std::setw(11) << r.depth
+				<< std::setw(11) << r.readIOPS
+				<< std::setw(12) << r.writeIOPS
+				<< std::setw(8) << r.errors << std::endl;
+			results.push_back(r);
+		}
+		AppClass actual = Benchmark::grade(results);
+		std::cout << "\nA1 requires " << BENCH_A1_READ_IOPS << " read and "
+			<< BENCH_A1_WRITE_IOPS << " write IOPS, A2 requires "
+			<< BENCH_A2_READ_IOPS << " read and " << BENCH_A2_WRITE_IOPS
+			<< " write IOPS.\n";
+		if (actual == APP_CLASS_NONE) {
+			std::cout << "This device does not meet application class A1.\n";
+		} else {
+			std::cout << "This device meets application class A" << actual << ".\n";
+		}
+		if (actual < claimed) {
+			std::cout << "FAIL: Device is labelled A" << claimed
+				<< " but does not meet it.\n";
+			return RET_DEVICE_FAILED;
+		}
+	} catch (const error& e) {
+		std::cerr << "\nBenchmark failed: " << e.what() << std::endl;
+		return RET_DEVICE_FAILED;
+	}
+	return RET_DEVICE_OK;
+}
+
+/// Read the device without writing to it, timing each read.
+/**
+ * @return Process return code.
+ */
+int runSurfaceScan(Device *dev, CheckCallback *cb, unsigned int depth,
+	block_t firstBlock, block_t endBlock)
+{
+	try {
+		SurfaceScan scan(dev, cb);
+		scan.setRange(firstBlock, endBlock - firstBlock);
+		scan.run(depth);
+		std::cout << "\n";
+		scan.report(std::cout);
+		if (scan.failed()) return RET_DEVICE_FAILED;
+	} catch (const error& e) {
+		std::cerr << "\nSurface scan failed: " << e.what() << std::endl;
+		return RET_DEVICE_FAILED;
+	}
+	return RET_DEVICE_OK;
+}
+
+/// Test the device one region at a time, keeping its contents.
+/**
+ * @return Process return code.
+ */
+int runBackupCheck(Device *dev, const std::string& backupPath,
+	const Pattern& pattern, bool overwrite)
+{
+	try {
+		BackupCheck chk(dev, backupPath);
+		chk.setPattern(pattern);
+		chk.setOverwrite(overwrite);
+		unsigned int restored = chk.recover();
+		if (restored) {
+			std::cout << "Restored " << restored << " regions left over from an "
+				"interrupted run.\n";
+		}
+		chk.run();
+		std::cout << "\n";
+		chk.report(std::cout);
+		if (chk.foundBad()) return RET_DEVICE_FAILED;
+	} catch (const error& e) {
+		std::cerr << "\nNon-destructive test failed: " << e.what() << std::endl;
+		return RET_DEVICE_FAILED;
+	}
+	return RET_DEVICE_OK;
+}
+
+/// Write a list of bad sectors to a file for --retest.
+/**
+ * @return true on success.
+ */
+bool saveExtents(const std::string& path, const ExtentList& list,
+	block_t numSectors)
+{
+	std::ofstream out(path.c_str());
+	list.save(out, numSectors);
+	out.close();
+	if (!out) {
+		std::cerr << "Unable to save the bad sectors to " << path << std::endl;
+		return false;
+	}
+	std::cout << "Bad sectors saved to " << path << "\n";
+	return true;
+}
+
+/// Test the areas around bad sectors found by an earlier run.
+/**
+ * @return Process return code.
+ */
+int runRetest(Device *dev, const std::string& retestPath, uint64_t runID,
+	const std::string& savePath)
+{
+	block_t numSectors = dev->size() / DATA_BLOCK_SIZE * SECTORS_PER_BLOCK;
+	ExtentList previous;
+	block_t savedSectors;
+	std::ifstream in(retestPath.c_str());
+	if (!in || !previous.load(in, &savedSectors)) {
+		std::cerr << "Unable to read the bad sectors from " << retestPath
+			<< std::endl;
+		return RET_BAD_ARGS;
+	}
+	if (savedSectors != numSectors) {
+		std::cerr << "The bad sectors in " << retestPath << " are for a device "
+			"with " << savedSectors << " sectors, but this one has " << numSectors
+			<< std::endl;
+		return RET_BAD_ARGS;
+	}
+	if (previous.empty()) {
+		std::cout << "No bad sectors are listed in " << retestPath
+			<< ", nothing to retest." << std::endl;
+		return RET_DEVICE_OK;
+	}
+
+	try {
+		Retest retest(dev, previous);
+		retest.run(runID);
+		std::cout << "\n";
+		retest.report(std::cout);
+		std::cout << std::endl;
+		retest.writePartitionTable();
+		if (!savePath.empty()) {
+			saveExtents(savePath, retest.getBadSectors(), numSectors);
+		}
+		if (retest.foundBad()) return RET_DEVICE_FAILED;
+	} catch (const error& e) {
+		std::cerr << "\nRetest failed: " << e.what() << std::endl;
+		return RET_DEVICE_FAILED;
+	}
+	return RET_DEVICE_OK;
+}
+
+/// Write and verify the device several times, tracking how it wears.
+/**
+ * @return Process return code.
+ */
+int runEndurance(Endurance *test, unsigned int cycles, uint64_t runID)
+{
+	try {
+		test->run(cycles, runID);
+		std::cout << "\n";
+		test->report(std::cout);
+		std::cout << std::flush;
+		if (test->failed()) return RET_DEVICE_FAILED;
+	} catch (const error& e) {
+		std::cerr << "\nEndurance test failed: " << e.what() << std::endl;
+		return RET_DEVICE_FAILED;
+	}
+	return RET_DEVICE_OK;
+}
+
 int main(int argc, char *argv[])
 {
 	std::cout << "scanflash - scan memory cards to detect fakes\n"
 		"Copyright (C) 2012 Adam Nielsen <http://www.shikadi.net/scanflash>\n"
 		<< std::endl;
 
-	if (argc != 2) {
-		std::cerr << "Use: scanflash <device>" << std::endl;
+	unsigned long minWriteSpeed = 0;
+	bool benchmark = false;
+	block_t benchRegion = BENCH_DEFAULT_REGION;
+	AppClass claimedClass = APP_CLASS_NONE;
+	PatternType patternType = PATTERN_BLOCKNUM;
+	bool patternGiven = false;
+	bool randomOrder = false;
+	uint64_t orderSeed = time(NULL);
+	bool readOnly = false;
+	unsigned int queueDepth = SCAN_DEFAULT_DEPTH;
+	bool writeOnly = false;
+	bool verifyOnly = false;
+	uint64_t runID = 0;
+	std::string backupPath;
+	bool overwriteBackup = false;
+	block_t rangeOffset = 0;
+	block_t rangeLength = 0; // 0 means to the end of the device
+	unsigned int stripes = 1;
+	std::string saveExtentsPath;
+	std::string retestPath;
+	std::vector<PatternType> suite;
+	unsigned int cycles = 1;
+	unsigned int maxSlowdown = ENDURANCE_DEFAULT_SLOWDOWN;
+	long long maxNewBad = -1; // no limit
+	double timeBudget = 0; // no limit
+	bool progressive = false;
+	std::string tracePath;
+	std::string replayPath;
+
+	enum {
+		OPT_BENCH_REGION = 256,
+		OPT_CLAIMED_CLASS,
+		OPT_RUN_ID,
+		OPT_OFFSET,
+		OPT_LENGTH,
+		OPT_STRIPES,
+		OPT_SAVE_EXTENTS,
+		OPT_RETEST,
+		OPT_SUITE,
+		OPT_CYCLES,
+		OPT_MAX_SLOWDOWN,
+		OPT_MAX_NEW_BAD,
+		OPT_TIME_BUDGET,
+		OPT_PROGRESSIVE,
+		OPT_TRACE,
+		OPT_REPLAY,
+		OPT_OVERWRITE_BACKUP,
+	};
+	static const struct option longOpts[] = {
+		{"min-write-speed", required_argument, NULL, 's'},
+		{"pattern",         required_argument, NULL, 'p'},
+		{"random-order",    optional_argument, NULL, 'r'},
+		{"benchmark",       no_argument,       NULL, 'b'},
+		{"bench-region",    required_argument, NULL, OPT_BENCH_REGION},
+		{"claimed-class",   required_argument, NULL, OPT_CLAIMED_CLASS},
+		{"read-only",       no_argument,       NULL, 'R'},
+		{"queue-depth",     required_argument, NULL, 'q'},
+		{"write-only",      no_argument,       NULL, 'W'},
+		{"verify-only",     no_argument,       NULL, 'V'},
+		{"run-id",          required_argument, NULL, OPT_RUN_ID},
+		{"non-destructive", required_argument, NULL, 'N'},
+		{"overwrite-backup", no_argument,      NULL, OPT_OVERWRITE_BACKUP},
+		{"offset",          required_argument, NULL, OPT_OFFSET},
+		{"length",          required_argument, NULL, OPT_LENGTH},
+		{"stripes",         required_argument, NULL, OPT_STRIPES},
+		{"save-extents",    required_argument, NULL, OPT_SAVE_EXTENTS},
+		{"retest",          required_argument, NULL, OPT_RETEST},
+		{"suite",           optional_argument, NULL, OPT_SUITE},
+		{"cycles",          required_argument, NULL, OPT_CYCLES},
+		{"max-slowdown",    required_argument, NULL, OPT_MAX_SLOWDOWN},
+		{"max-new-bad",     required_argument, NULL, OPT_MAX_NEW_BAD},
+		{"time-budget",     required_argument, NULL, OPT_TIME_BUDGET},
+		{"progressive",     no_argument,       NULL, OPT_PROGRESSIVE},
+		{"trace",           required_argument, NULL, OPT_TRACE},
+		{"replay",          required_argument, NULL, OPT_REPLAY},
+		{"help",            no_argument,       NULL, 'h'},
+		{NULL,              0,                 NULL, 0},
+	};
+	int c;
+	while ((c = getopt_long(argc, argv, "s:p:r::bRq:WVN:h", longOpts, NULL)) != -1) {
+		switch (c) {
+			case 's':
+				minWriteSpeed = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				if (!parsePatternType(optarg, &patternType)) {
+					std::cerr << "Unknown pattern: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				patternGiven = true;
+				break;
+			case 'r':
+				randomOrder = true;
+				if (optarg) orderSeed = strtoull(optarg, NULL, 0);
+				break;
+			case 'b':
+				benchmark = true;
+				break;
+			case OPT_BENCH_REGION:
+				benchRegion = strtoull(optarg, NULL, 10) * 1048576;
+				if (benchRegion == 0) {
+					std::cerr << "Benchmark region must be at least 1 MB" << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_CLAIMED_CLASS:
+				if (strcasecmp(optarg, "A1") == 0) claimedClass = APP_CLASS_A1;
+				else if (strcasecmp(optarg, "A2") == 0) claimedClass = APP_CLASS_A2;
+				else {
+					std::cerr << "Unknown application class: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case 'R':
+				readOnly = true;
+				break;
+			case 'q':
+				queueDepth = strtoul(optarg, NULL, 10);
+				if (queueDepth < 1) {
+					std::cerr << "Queue depth must be at least 1" << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case 'W':
+				writeOnly = true;
+				break;
+			case 'V':
+				verifyOnly = true;
+				break;
+			case 'N':
+				backupPath = optarg;
+				break;
+			case OPT_OVERWRITE_BACKUP:
+				overwriteBackup = true;
+				break;
+			case OPT_OFFSET:
+				if (!parseSize(optarg, &rangeOffset)) {
+					std::cerr << "Invalid offset: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_LENGTH:
+				if (!parseSize(optarg, &rangeLength) || (rangeLength == 0)) {
+					std::cerr << "Invalid length: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_STRIPES:
+				stripes = strtoul(optarg, NULL, 10);
+				if (stripes < 1) {
+					std::cerr << "There must be at least one stripe" << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_SAVE_EXTENTS:
+				saveExtentsPath = optarg;
+				break;
+			case OPT_RETEST:
+				retestPath = optarg;
+				break;
+			case OPT_SUITE:
+				if (!parseSuite(optarg ? optarg : SUITE_DEFAULT, &suite)) {
+					std::cerr << "Invalid pattern list: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_CYCLES:
+				cycles = strtoul(optarg, NULL, 10);
+				if (cycles < 1) {
+					std::cerr << "There must be at least one cycle" << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_MAX_SLOWDOWN:
+				maxSlowdown = strtoul(optarg, NULL, 10);
+				if (maxSlowdown > 100) {
+					std::cerr << "Slowdown must be a percentage" << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_MAX_NEW_BAD:
+				maxNewBad = strtoll(optarg, NULL, 10);
+				if (maxNewBad < 0) {
+					std::cerr << "Invalid number of bad sectors: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_TIME_BUDGET:
+				if (!parseDuration(optarg, &timeBudget)) {
+					std::cerr << "Invalid time: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case OPT_PROGRESSIVE:
+				progressive = true;
+				break;
+			case OPT_TRACE:
+				tracePath = optarg;
+				break;
+			case OPT_REPLAY:
+				replayPath = optarg;
+				break;
+			case OPT_RUN_ID:
+				runID = strtoull(optarg, NULL, 16);
+				if (runID == 0) {
+					std::cerr << "Invalid run ID: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case 'h':
+				usage();
+				return RET_DEVICE_OK;
+			default:
+				usage();
+				return RET_BAD_ARGS;
+		}
+	}
+	if (argc - optind != 1) {
+		usage();
+		return RET_BAD_ARGS;
+	}
+	if (randomOrder && (stripes > 1)) {
+		std::cerr << "--random-order and --stripes cannot be used together"
+			<< std::endl;
 		return RET_BAD_ARGS;
 	}
+	if (benchmark + writeOnly + verifyOnly + readOnly + !backupPath.empty()
+		+ !retestPath.empty() > 1
+	) {
+		std::cerr << "Only one of --benchmark, --write-only, --verify-only, "
+			"--read-only, --non-destructive and --retest can be used" << std::endl;
+		return RET_BAD_ARGS;
+	}
+	if (!suite.empty() && (randomOrder || benchmark || writeOnly || verifyOnly
+		|| readOnly || !backupPath.empty() || !retestPath.empty())
+	) {
+		std::cerr << "--suite can only be used for a normal test, in order"
+			<< std::endl;
+		return RET_BAD_ARGS;
+	}
+	if (overwriteBackup && backupPath.empty()) {
+		std::cerr << "--overwrite-backup can only be used with --non-destructive"
+			<< std::endl;
+		return RET_BAD_ARGS;
+	}
+	if (!suite.empty() && patternGiven) {
+		std::cerr << "--pattern and --suite cannot be used together, list the "
+			"patterns with --suite instead" << std::endl;
+		return RET_BAD_ARGS;
+	}
+	if ((cycles > 1) && (!suite.empty() || benchmark || writeOnly || verifyOnly
+		|| readOnly || !backupPath.empty() || !retestPath.empty())
+	) {
+		std::cerr << "--cycles can only be used for a normal test" << std::endl;
+		return RET_BAD_ARGS;
+	}
+	if ((timeBudget > 0) && ((cycles > 1) || !suite.empty() || randomOrder
+		|| (stripes > 1) || benchmark || writeOnly || verifyOnly || readOnly
+		|| !backupPath.empty() || !retestPath.empty())
+	) {
+		std::cerr << "--time-budget can only be used for a normal test, in order"
+			<< std::endl;
+		return RET_BAD_ARGS;
+	}
+	if (progressive && (randomOrder || (stripes > 1) || (cycles > 1)
+		|| (timeBudget > 0) || benchmark || writeOnly || readOnly
+		|| !backupPath.empty() || !retestPath.empty())
+	) {
+		std::cerr << "--progressive can only be used for a normal test or with "
+			"--verify-only, in order" << std::endl;
+		return RET_BAD_ARGS;
+	}
+	const char *devPath = argv[optind];
 
-	Device *dev = new POSIXDevice();
+	// Verifying never writes, not even a partition table
+	Device *dev = new POSIXDevice(readOnly || verifyOnly);
 	try {
-		dev->open(argv[1]);
+		dev->open(devPath);
 	} catch (const error& e) {
 		std::cerr << "Unable to open device: " << e.what() << std::endl;
 		return RET_NO_OPEN;
 	}
+	if (!replayPath.empty()) {
+		try {
+			dev = new ReplayDevice(dev, replayPath.c_str());
+		} catch (const error& e) {
+			std::cerr << "Unable to replay trace: " << e.what() << std::endl;
+			delete dev;
+			return RET_BAD_ARGS;
+		}
+	}
+	if (!tracePath.empty()) {
+		try {
+			dev = new TraceDevice(dev, tracePath.c_str());
+		} catch (const error& e) {
+			std::cerr << "Unable to start trace: " << e.what() << std::endl;
+			delete dev;
+			return RET_BAD_ARGS;
+		}
+	}
+
+	block_t deviceBlocks = dev->size() / DATA_BLOCK_SIZE;
+	block_t firstBlock = rangeOffset / DATA_BLOCK_SIZE;
+	block_t endBlock = deviceBlocks;
+	if (rangeLength) {
+		endBlock = (rangeOffset + rangeLength + DATA_BLOCK_SIZE - 1) / DATA_BLOCK_SIZE;
+	}
+	if ((firstBlock >= endBlock) || (endBlock > deviceBlocks)) {
+		std::cerr << "The range to test is outside the device, which is "
+			<< deviceBlocks * DATA_BLOCK_SIZE << " bytes long" << std::endl;
+		delete dev;
+		return RET_BAD_ARGS;
+	}
+
+	if (readOnly) {
+		// Nothing is written, so there is no need to ask first
+		ConsoleUI ui(0);
+		AsyncCallback async(&ui);
+		int ret = runSurfaceScan(dev, &async, queueDepth, firstBlock, endBlock);
+		delete dev;
+		return ret;
+	}
+
+	if (verifyOnly) {
+		ConsoleUI ui(0);
+		AsyncCallback async(&ui);
+		Check chk(dev, &async);
+		chk.setPattern(Pattern(patternType, runID));
+		int ret = RET_DEVICE_OK;
+		try {
+			chk.setRange(firstBlock, endBlock - firstBlock);
+			chk.setStripes(stripes);
+			runID = chk.useExistingData(runID);
+			std::cout << "Verifying run ID " << std::hex << runID << std::dec
+				<< "\n";
+			if (randomOrder) chk.setRandomOrder(orderSeed);
+			if (progressive) chk.setProgressive(PROGRESSIVE_STRIDE);
+			chk.setPhases(1);
+			chk.read();
+			std::cout << "\n";
+			if (!saveExtentsPath.empty()) {
+				saveExtents(saveExtentsPath, chk.getBadSectors(),
+					deviceBlocks * SECTORS_PER_BLOCK);
+			}
+			if (chk.foundBad()) ret = RET_DEVICE_FAILED;
+		} catch (const error& e) {
+			std::cerr << "Unable to verify: " << e.what() << std::endl;
+			ret = RET_DEVICE_FAILED;
+		}
+		delete dev;
+		return ret;
+	}
+
+	if (runID == 0) runID = newRunID();
+
+	if (!backupPath.empty()) {
+		std::cout << "The data on " << devPath << " will be copied to " << backupPath
+			<< " and put back\nafter testing.  Run ID " << std::hex << runID
+			<< std::dec << "\n";
+		int ret = runBackupCheck(dev, backupPath, Pattern(patternType, runID),
+			overwriteBackup);
+		delete dev;
+		return ret;
+	}
 
-	std::cout << "WARNING: All data on " << argv[1] << " will be erased permanently!\n"
+	std::cout << "WARNING: All data on " << devPath << " will be erased permanently!\n"
 		"Are you sure you wish to continue (Y/N)? " << std::flush;
 
 	char key = 'n';
@@ -316,16 +1169,113 @@ int main(int argc, char *argv[])
 		return RET_ABORTED;
 	}
 
-	ConsoleUI *ui = new ConsoleUI();
-	Check *chk = new Check(dev, ui);
+	if (benchmark) {
+		int ret = runBenchmark(dev, benchRegion, claimedClass);
+		delete dev;
+		return ret;
+	}
+
+	if (!retestPath.empty()) {
+		int ret = runRetest(dev, retestPath, runID, saveExtentsPath);
+		delete dev;
+		return ret;
+	}
+
+	if (cycles > 1) {
+		ConsoleUI ui(minWriteSpeed);
+		AsyncCallback async(&ui);
+		Endurance test(dev, &async);
+		test.setTest(patternType, firstBlock, endBlock - firstBlock, stripes);
+		if (randomOrder) test.setRandomOrder(orderSeed);
+		test.setLimits(maxSlowdown, maxNewBad);
+		int ret = runEndurance(&test, cycles, runID);
+		if (ui.failedWriteSpeed()) ret = RET_DEVICE_FAILED;
+		delete dev;
+		return ret;
+	}
+
+	// Only created with a time budget, in which case only these blocks are tested
+	TimeBudget *budget = NULL;
+	SampledOrder *sample = NULL;
+	if (timeBudget > 0) {
+		budget = new TimeBudget(dev, timeBudget);
+		try {
+			budget->calibrate(firstBlock, endBlock);
+		} catch (const error& e) {
+			std::cerr << e.what() << std::endl;
+			delete budget;
+			delete dev;
+			return RET_DEVICE_FAILED;
+		}
+		sample = new SampledOrder(firstBlock, endBlock, budget->plan(), orderSeed);
+		budget->describe(std::cout, *sample, endBlock - firstBlock);
+	}
+
+	ConsoleUI *ui = new ConsoleUI(minWriteSpeed);
+	AsyncCallback *async = new AsyncCallback(ui);
+	Check *chk = new Check(dev, async);
+	std::cout << "Run ID " << std::hex << runID << std::dec << "\n";
+	if (!suite.empty()) patternType = suite[0];
+	chk->setPattern(Pattern(patternType, runID));
+	if (randomOrder) {
+		std::cout << "Visiting blocks in random order, seed " << orderSeed << "\n";
+		chk->setRandomOrder(orderSeed);
+	}
+	if ((firstBlock != 0) || (endBlock != deviceBlocks)) {
+		std::cout << "Testing bytes " << firstBlock * DATA_BLOCK_SIZE << '-'
+			<< endBlock * DATA_BLOCK_SIZE - 1 << "\n";
+	}
+	chk->setRange(firstBlock, endBlock - firstBlock);
+	if (sample) chk->setOrder(sample);
+	if (progressive) chk->setProgressive(PROGRESSIVE_STRIDE);
+	if (stripes > 1) {
+		std::cout << "Testing " << stripes << " stripes at once\n";
+		chk->setStripes(stripes);
+	}
+	// write(), any rewrite() for the rest of the suite, then read()
+	if (writeOnly) chk->setPhases(1);
+	else if (suite.size() > 1) chk->setPhases(suite.size() + 1);
 	chk->write();
 	std::cout << "\n";
-	chk->read();
-	std::cout << "\n";
+	if (chk->wrapped()) {
+		// Already reported, and nothing worth verifying
+	} else if (writeOnly) {
+		std::cout << "Data written but not verified.  To verify it later, run:\n"
+			"  scanflash --verify-only " << devPath << "\n" << std::endl;
+	} else {
+		for (unsigned int i = 1; i < suite.size(); i++) {
+			std::cout << "Pattern " << i + 1 << " of " << suite.size()
+				<< ": checking " << patternTypeName(suite[i - 1]) << ", writing "
+				<< patternTypeName(suite[i]) << "\n";
+			chk->rewrite(suite[i]);
+		}
+		if (!suite.empty()) {
+			std::cout << "Checking " << patternTypeName(suite.back()) << "\n";
+		}
+		chk->read();
+		std::cout << "\n";
+		if (!saveExtentsPath.empty()) {
+			saveExtents(saveExtentsPath, chk->getBadSectors(),
+				deviceBlocks * SECTORS_PER_BLOCK);
+		}
+	}
+
+	if (budget && !chk->wrapped()) {
+		budget->report(std::cout, *sample, endBlock - firstBlock, chk->foundBad());
+		std::cout << std::endl;
+	}
+
+	int ret = RET_DEVICE_OK;
+	if (ui->failedWriteSpeed() || chk->wrapped() || chk->foundBad()) {
+		ret = RET_DEVICE_FAILED;
+	}
 
 	delete chk;
+	delete async;
 	delete ui;
+	delete sample;
+	delete budget;
 	delete dev;
 
-	return 0;
+	return ret;
 }
@@ -0,0 +1,225 @@
+/**
+ * @file  order.cpp
+ * @brief Order in which blocks are visited during a check.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "order.hpp"
+#include "kernel.hpp"
+
+BlockOrder::~BlockOrder()
+	throw ()
+{
+}
+
+SequentialOrder::SequentialOrder(block_t startBlock, block_t numBlocks)
+	throw ()
+	: startBlock(startBlock),
+	  numBlocks(numBlocks),
+	  pos(startBlock)
+{
+}
+
+void SequentialOrder::rewind()
+	throw ()
+{
+	this->pos = this->startBlock;
+	return;
+}
+
+bool SequentialOrder::next(block_t *first, block_t *count)
+	throw ()
+{
+	if (this->pos >= this->numBlocks) return false;
+	*first = this->pos;
+	*count = this->numBlocks - this->pos;
+	this->pos = this->numBlocks;
+	return true;
+}
+
+PermutedOrder::PermutedOrder(block_t startBlock, block_t numBlocks,
+	uint64_t seed)
+	throw ()
+	: startBlock(startBlock),
+	  numBlocks(numBlocks),
+	  pos(0)
+{
+	block_t len = (numBlocks > startBlock) ? numBlocks - startBlock : 0;
+	this->numRuns = (len + ORDER_RUN_BLOCKS - 1) / ORDER_RUN_BLOCKS;
+	unsigned int bits = 0;
+	while ((bits < 64) && ((1ULL << bits) < this->numRuns)) bits++;
+	this->halfBits = (bits + 1) / 2;
+	if (this->halfBits < 1) this->halfBits = 1;
+	for (unsigned int i = 0; i < FEISTEL_ROUNDS; i++) {
+		this->keys[i] = mix64(seed + i * 0x9E3779B97F4A7C15ULL);
+	}
+}
+
+void PermutedOrder::rewind()
+	throw ()
+{
+	this->pos = 0;
+	return;
+}
+
+bool PermutedOrder::next(block_t *first, block_t *count)
+	throw ()
+{
+	if (this->pos >= this->numRuns) return false;
+	block_t run = this->permute(this->pos++);
+	*first = this->startBlock + run * ORDER_RUN_BLOCKS;
+	*count = ORDER_RUN_BLOCKS;
+	if (*first + *count > this->numBlocks) *count = this->numBlocks - *first;
+	return true;
+}
+
+block_t PermutedOrder::permute(block_t index) const
+	throw ()
+{
+	uint64_t mask = (1ULL << this->halfBits) - 1;
+	block_t x = index;
+	do {
+		uint64_t left = x >> this->halfBits;
+		uint64_t right = x & mask;
+		for (unsigned int i = 0; i < FEISTEL_ROUNDS; i++) {
+			uint64_t f = mix64(right ^ this->keys[i]) & mask;
+			uint64_t t = right;
+			right = left ^ f;
+			left = t;
+		}
+		x = (left << this->halfBits) | right;
+	} while (x >= this->numRuns); // cycle walk back into range
+	return x;
+}
+
+ProgressiveOrder::ProgressiveOrder(block_t startBlock, block_t numBlocks,
+	block_t stride)
+	throw ()
+	: startBlock(startBlock),
+	  numBlocks(numBlocks)
+{
+	this->firstStride = 1;
+	while (this->firstStride * 2 <= stride) this->firstStride *= 2;
+	this->rewind();
+}
+
+void ProgressiveOrder::rewind()
+	throw ()
+{
+	this->stride = this->firstStride;
+	this->pos = 0;
+	return;
+}
+
+bool ProgressiveOrder::next(block_t *first, block_t *count)
+	throw ()
+{
+	block_t len = (this->numBlocks > this->startBlock)
+		? this->numBlocks - this->startBlock : 0;
+	while (this->stride && (this->pos >= len)) {
+		// Start the next round at the first block not visited yet
+		this->stride /= 2;
+		this->pos = this->stride;
+	}
+	if (!this->stride) return false;
+	*first = this->startBlock + this->pos;
+	*count = 1;
+	// The first round visits every multiple of the stride, later rounds only
+	// the odd multiples as the even ones were visited in an earlier round
+	this->pos += (this->stride == this->firstStride) ? this->stride : this->stride * 2;
+	return true;
+}
+
+SampledOrder::SampledOrder(block_t startBlock, block_t numBlocks,
+	block_t sampleRuns, uint64_t seed)
+	throw ()
+	: numBlocks(numBlocks),
+	  numRandom(0),
+	  pos(0)
+{
+	block_t len = (numBlocks > startBlock) ? numBlocks - startBlock : 0;
+	block_t numRuns = (len + ORDER_RUN_BLOCKS - 1) / ORDER_RUN_BLOCKS;
+	if (sampleRuns >= numRuns) {
+		for (block_t r = 0; r < numRuns; r++) {
+			this->runs.push_back(startBlock + r * ORDER_RUN_BLOCKS);
+		}
+		return;
+	}
+
+	for (block_t b = 0; b < len; b = b ? b * 2 : 1) {
+		this->runs.push_back(startBlock + b / ORDER_RUN_BLOCKS * ORDER_RUN_BLOCKS);
+	}
+	std::sort(this->runs.begin(), this->runs.end());
+	this->runs.erase(std::unique(this->runs.begin(), this->runs.end()),
+		this->runs.end());
+
+	if (sampleRuns > this->runs.size()) {
+		this->numRandom = sampleRuns - this->runs.size();
+		for (block_t i = 0; i < this->numRandom; i++) {
+			block_t from = i * numRuns / this->numRandom;
+			block_t to = (i + 1) * numRuns / this->numRandom;
+			block_t r = from + mix64(seed + i) % (to - from);
+			this->runs.push_back(startBlock + r * ORDER_RUN_BLOCKS);
+		}
+		std::sort(this->runs.begin(), this->runs.end());
+		this->runs.erase(std::unique(this->runs.begin(), this->runs.end()),
+			this->runs.end());
+	}
+}
+
+SampledOrder::~SampledOrder()
+	throw ()
+{
+}
+
+void SampledOrder::rewind()
+	throw ()
+{
+	this->pos = 0;
+	return;
+}
+
+bool SampledOrder::next(block_t *first, block_t *count)
+	throw ()
+{
+	if (this->pos >= this->runs.size()) return false;
+	*first = this->runs[this->pos++];
+	*count = ORDER_RUN_BLOCKS;
+	if (*first + *count > this->numBlocks) *count = this->numBlocks - *first;
+	return true;
+}
+
+block_t SampledOrder::size() const
+	throw ()
+{
+	block_t total = 0;
+	for (std::vector<block_t>::const_iterator
+		i = this->runs.begin(); i != this->runs.end(); i++
+	) {
+		block_t n = ORDER_RUN_BLOCKS;
+		if (*i + n > this->numBlocks) n = this->numBlocks - *i;
+		total += n;
+	}
+	return total;
+}
+
+block_t SampledOrder::randomRuns() const
+	throw ()
+{
+	return this->numRandom;
+}
@@ -0,0 +1,234 @@
+/**
+ * @file  order.hpp
+ * @brief Order in which blocks are visited during a check.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ORDER_HPP_
+#define ORDER_HPP_
+
+#include <vector>
+#include "device.hpp"
+
+/// Number of consecutive blocks visited together when not going in order.
+/**
+ * 128 blocks of 32 kB is 4 MB, the allocation unit of most SD cards, so each
+ * run still looks like a sequential write to the controller.
+ */
+#define ORDER_RUN_BLOCKS 128
+
+/// Number of rounds in the Feistel network used by PermutedOrder.
+#define FEISTEL_ROUNDS 4
+
+/// Sequence of block numbers to visit.
+/**
+ * Blocks are returned in runs of consecutive block numbers, so that callers
+ * only need to seek once per run.
+ */
+class BlockOrder
+{
+	public:
+		virtual ~BlockOrder()
+			throw ();
+
+		/// Go back to the first run.
+		virtual void rewind()
+			throw () = 0;
+
+		/// Get the next run of blocks to visit.
+		/**
+		 * @param first
+		 *   On return, the first block in the run.
+		 *
+		 * @param count
+		 *   On return, the number of blocks in the run.  Always at least 1.
+		 *
+		 * @return true if a run was returned, false if every block has been
+		 *   visited.
+		 */
+		virtual bool next(block_t *first, block_t *count)
+			throw () = 0;
+};
+
+/// Visit blocks from first to last.
+class SequentialOrder: virtual public BlockOrder
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param startBlock
+		 *   First block to visit.
+		 *
+		 * @param numBlocks
+		 *   Visit up to but not including this block.
+		 */
+		SequentialOrder(block_t startBlock, block_t numBlocks)
+			throw ();
+
+		virtual void rewind()
+			throw ();
+
+		virtual bool next(block_t *first, block_t *count)
+			throw ();
+
+	protected:
+		block_t startBlock;  ///< First block to visit
+		block_t numBlocks;   ///< One past the last block to visit
+		block_t pos;         ///< Next block to return
+};
+
+/// Visit runs of blocks in a pseudo-random order.
+/**
+ * The run index is put through a Feistel network keyed on the seed, which
+ * gives a permutation of the runs without having to store an order table.
+ * The network works on a power-of-two domain, so any result past the last
+ * run is fed back through it ("cycle walking") until it lands in range.
+ */
+class PermutedOrder: virtual public BlockOrder
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param startBlock
+		 *   First block to visit.  Runs are counted from here.
+		 *
+		 * @param numBlocks
+		 *   Visit up to but not including this block.
+		 *
+		 * @param seed
+		 *   Key for the permutation.  The same seed gives the same order.
+		 */
+		PermutedOrder(block_t startBlock, block_t numBlocks, uint64_t seed)
+			throw ();
+
+		virtual void rewind()
+			throw ();
+
+		virtual bool next(block_t *first, block_t *count)
+			throw ();
+
+	protected:
+		block_t startBlock;   ///< First block to visit
+		block_t numBlocks;    ///< One past the last block to visit
+		block_t numRuns;      ///< Number of runs, the last may be short
+		block_t pos;          ///< Index of the next run to return
+		unsigned int halfBits; ///< Bits in each half of the Feistel block
+		uint64_t keys[FEISTEL_ROUNDS]; ///< Round keys
+
+		/// Map a run index to its place in the permutation.
+		block_t permute(block_t index) const
+			throw ();
+};
+
+/// Visit a coarse grid of blocks first, then fill in the gaps.
+/**
+ * The first round visits every stride'th block.  Each later round halves the
+ * stride and visits the blocks half way between those already visited, until
+ * every block has been visited once.  A problem that affects a large part of
+ * the range is found within the first few rounds.
+ */
+class ProgressiveOrder: virtual public BlockOrder
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param startBlock
+		 *   First block to visit.
+		 *
+		 * @param numBlocks
+		 *   Visit up to but not including this block.
+		 *
+		 * @param stride
+		 *   Gap between blocks in the first round, rounded down to a power of
+		 *   two.
+		 */
+		ProgressiveOrder(block_t startBlock, block_t numBlocks, block_t stride)
+			throw ();
+
+		virtual void rewind()
+			throw ();
+
+		virtual bool next(block_t *first, block_t *count)
+			throw ();
+
+	protected:
+		block_t startBlock;   ///< First block to visit
+		block_t numBlocks;    ///< One past the last block to visit
+		block_t firstStride;  ///< Gap between blocks in the first round
+		block_t stride;       ///< Gap in the current round, 0 once finished
+		block_t pos;          ///< Offset of the next block from startBlock
+};
+
+/// Visit a sample of the runs of blocks, in order.
+/**
+ * The range is split into equal strata and one run is picked at random from
+ * each, so the sample is spread evenly but no part of the range is favoured.
+ * The runs holding each power-of-two block (counting from the start of the
+ * range) are always included, as these are where Check looks for the device
+ * wrapping around.
+ */
+class SampledOrder: virtual public BlockOrder
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param startBlock
+		 *   First block of the range.  Runs are counted from here.
+		 *
+		 * @param numBlocks
+		 *   Visit up to but not including this block.
+		 *
+		 * @param sampleRuns
+		 *   Number of runs to visit.  If this covers the whole range, every run
+		 *   is visited.
+		 *
+		 * @param seed
+		 *   Key for picking runs.  The same seed gives the same sample.
+		 */
+		SampledOrder(block_t startBlock, block_t numBlocks, block_t sampleRuns,
+			uint64_t seed)
+			throw ();
+
+		virtual ~SampledOrder()
+			throw ();
+
+		virtual void rewind()
+			throw ();
+
+		virtual bool next(block_t *first, block_t *count)
+			throw ();
+
+		/// Total number of blocks visited.
+		block_t size() const
+			throw ();
+
+		/// Number of runs that were picked at random.
+		/**
+		 * Only these count as a random sample when working out how much of the
+		 * range is likely to be bad.  Zero if every run is visited.
+		 */
+		block_t randomRuns() const
+			throw ();
+
+	protected:
+		block_t numBlocks;   ///< One past the last block to visit
+		std::vector<block_t> runs; ///< First block of each run, in order
+		block_t numRandom;   ///< Runs picked from the strata
+		block_t pos;         ///< Index of the next run to return
+};
+
+#endif // ORDER_HPP_
@@ -0,0 +1,185 @@
+/**
+ * @file  pattern.cpp
+ * @brief Data written to each block, so it can be recognised later.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "pattern.hpp"
+#include "kernel.hpp"
+#include "crc32c.hpp"
+
+/// Write a 64-bit little-endian value to a buffer, regardless of host endianness
+static void store64le(uint8_t *dest, uint64_t val)
+{
+	for (unsigned int i = 0; i < 8; i++) dest[i] = (val >> (i * 8)) & 0xFF;
+	return;
+}
+
+/// Read a 64-bit little-endian value from a buffer
+static uint64_t load64le(const uint8_t *src)
+{
+	uint64_t val = 0;
+	for (unsigned int i = 0; i < 8; i++) val |= (uint64_t)src[i] << (i * 8);
+	return val;
+}
+
+/// Read a 32-bit little-endian value from a buffer
+static uint32_t load32le(const uint8_t *src)
+{
+	return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+const char *patternTypeName(PatternType type)
+	throw ()
+{
+	switch (type) {
+		case PATTERN_BLOCKNUM: return "blocknum";
+		case PATTERN_RANDOM: return "random";
+		case PATTERN_INVERSE: return "inverse";
+		case PATTERN_CHECKERBOARD: return "checkerboard";
+		case PATTERN_WALKING: return "walking";
+		case PATTERN_TYPE_COUNT: break;
+	}
+	return "unknown";
+}
+
+Pattern::Pattern(PatternType type, uint64_t key)
+	throw ()
+	: type(type),
+	  key(key)
+{
+}
+
+void Pattern::fill(uint8_t *buf, unsigned int len, block_t off) const
+	throw ()
+{
+	block_t sectorNum = off / SECTOR_SIZE;
+	for (unsigned int i = 0; i < len; i += SECTOR_SIZE) {
+		this->fillSector(&buf[i], sectorNum++);
+	}
+	return;
+}
+
+uint64_t Pattern::verify(const uint8_t *buf, unsigned int len, block_t off)
+	const
+	throw ()
+{
+	// The checksum proves the sector is intact and the header proves it is the
+	// right one, so the expected data never has to be generated.
+	block_t sectorNum = off / SECTOR_SIZE;
+	uint64_t bad = 0;
+	for (unsigned int i = 0; i < len / SECTOR_SIZE; i++) {
+		block_t found;
+		uint64_t key;
+		if (!Pattern::decode(&buf[i * SECTOR_SIZE], &found, &key)
+			|| (found != sectorNum + i) || (key != this->key)
+		) {
+			bad |= 1ULL << i;
+		}
+	}
+	return bad;
+}
+
+uint64_t Pattern::getKey() const
+	throw ()
+{
+	return this->key;
+}
+
+void Pattern::setKey(uint64_t key)
+	throw ()
+{
+	this->key = key;
+	return;
+}
+
+void Pattern::readHeader(const uint8_t *sector, block_t *sectorNum,
+	uint64_t *key)
+	throw ()
+{
+	*sectorNum = load64le(&sector[SECTOR_HDR_NUM]);
+	*key = load64le(&sector[SECTOR_HDR_KEY]);
+	return;
+}
+
+bool Pattern::decode(const uint8_t *sector, block_t *sectorNum, uint64_t *key)
+	throw ()
+{
+	Pattern::readHeader(sector, sectorNum, key);
+	return crc32c(sector, SECTOR_CHECKSUM) == load32le(&sector[SECTOR_CHECKSUM]);
+}
+
+bool Pattern::identify(const uint8_t *sector, Pattern *pattern)
+	throw ()
+{
+	block_t sectorNum;
+	uint64_t key;
+	if (!Pattern::decode(sector, &sectorNum, &key)) return false;
+	uint8_t expected[SECTOR_SIZE];
+	for (unsigned int t = 0; t < PATTERN_TYPE_COUNT; t++) {
+		Pattern candidate((PatternType)t, key);
+		candidate.fillSector(expected, sectorNum);
+		if (memcmp(expected, sector, SECTOR_SIZE) == 0) {
+			*pattern = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+void Pattern::fillSector(uint8_t *buf, block_t sectorNum) const
+	throw ()
+{
+	switch (this->type) {
+		case PATTERN_BLOCKNUM: {
+			block_t val = sectorNum + 1; // avoid sector 0 having all zeroes
+			fillWords(buf, SECTOR_SIZE, val, val);
+			break;
+		}
+		case PATTERN_RANDOM:
+			prngFill(buf, SECTOR_SIZE, mix64(this->key ^ mix64(sectorNum)));
+			break;
+		case PATTERN_INVERSE: {
+			block_t val = ~(sectorNum + 1);
+			fillWords(buf, SECTOR_SIZE, val, val);
+			break;
+		}
+		case PATTERN_CHECKERBOARD:
+			if (sectorNum & 1) {
+				fillWords(buf, SECTOR_SIZE, 0xAAAAAAAAAAAAAAAAULL, 0x5555555555555555ULL);
+			} else {
+				fillWords(buf, SECTOR_SIZE, 0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL);
+			}
+			break;
+		case PATTERN_WALKING:
+			// Start each sector one place further on, so every bit of every word
+			// holds the 1 somewhere in each run of 64 sectors
+			walkFill(buf, SECTOR_SIZE, sectorNum % 64);
+			break;
+		case PATTERN_TYPE_COUNT:
+			break;
+	}
+	store64le(&buf[SECTOR_HDR_NUM], sectorNum);
+	store64le(&buf[SECTOR_HDR_KEY], this->key);
+	uint32_t sum = crc32c(buf, SECTOR_CHECKSUM);
+	buf[SECTOR_CHECKSUM + 0] = sum & 0xFF;
+	buf[SECTOR_CHECKSUM + 1] = (sum >> 8) & 0xFF;
+	buf[SECTOR_CHECKSUM + 2] = (sum >> 16) & 0xFF;
+	buf[SECTOR_CHECKSUM + 3] = (sum >> 24) & 0xFF;
+	return;
+}
@@ -0,0 +1,191 @@
+/**
+ * @file  pattern.hpp
+ * @brief Data written to each block, so it can be recognised later.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATTERN_HPP_
+#define PATTERN_HPP_
+
+#include "device.hpp"
+
+/// Key used for the pattern when no run ID is given.
+#define PATTERN_DEFAULT_KEY 0x7363616E666C7368ULL // "scanflsh"
+
+/// Size of each individually stamped sector.
+#define SECTOR_SIZE 512
+
+/// Largest buffer verify() can report on, one bit per sector.
+#define PATTERN_MAX_LEN (64 * SECTOR_SIZE)
+
+/// Offset of the absolute sector number in each sector.
+#define SECTOR_HDR_NUM 0
+
+/// Offset of the pattern key (run ID) in each sector.
+#define SECTOR_HDR_KEY 8
+
+/// Offset of the CRC32C in each sector, which covers everything before it.
+#define SECTOR_CHECKSUM (SECTOR_SIZE - 4)
+
+/// Type of data to write.
+enum PatternType {
+	PATTERN_BLOCKNUM, ///< Sector number repeated across the sector
+	PATTERN_RANDOM,   ///< Keyed pseudo-random data, incompressible
+	PATTERN_INVERSE,  ///< Bitwise inverse of PATTERN_BLOCKNUM
+	PATTERN_CHECKERBOARD, ///< Alternating 0x55/0xAA, swapped in odd sectors
+	PATTERN_WALKING,  ///< A single 1 bit in each word, moving up each word
+	PATTERN_TYPE_COUNT, ///< Number of types, not a type itself
+};
+
+/// Name of a pattern type, as given on the command line.
+const char *patternTypeName(PatternType type)
+	throw ();
+
+/// Generate and check the data for each block.
+/**
+ * Every 512-byte sector is stamped with its own absolute sector number and
+ * the pattern key at the start, and a CRC32C at the end, with the pattern
+ * data in between.  This way a bad sector can be pinned down within a block,
+ * and when a sector holds the wrong data the header says where it came from.
+ * All values are stored little-endian.
+ */
+class Pattern
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param type
+		 *   Kind of data to write.
+		 *
+		 * @param key
+		 *   Run ID.  This is mixed with the sector number to seed PATTERN_RANDOM,
+		 *   and stored in each sector header, so data left over from another run
+		 *   never passes verification.
+		 */
+		Pattern(PatternType type, uint64_t key)
+			throw ();
+
+		/// Write the data for part of the device into a buffer.
+		/**
+		 * @param buf
+		 *   Buffer to fill.
+		 *
+		 * @param len
+		 *   Size of buf, a multiple of SECTOR_SIZE.
+		 *
+		 * @param off
+		 *   Offset on the device the data is for, in bytes.  Must be a multiple
+		 *   of SECTOR_SIZE.
+		 */
+		void fill(uint8_t *buf, unsigned int len, block_t off) const
+			throw ();
+
+		/// Check which sectors in a buffer do not hold the expected data.
+		/**
+		 * A sector is good if its CRC32C matches and its header has the
+		 * expected sector number and key.  This takes a single pass over the
+		 * data, without generating the expected pattern.
+		 *
+		 * @param buf
+		 *   Data read back from the device.
+		 *
+		 * @param len
+		 *   Size of buf, a multiple of SECTOR_SIZE no larger than
+		 *   PATTERN_MAX_LEN.
+		 *
+		 * @param off
+		 *   Offset on the device the data was read from, in bytes.
+		 *
+		 * @return Bitmask with bit N set if sector N in buf is bad, so zero if
+		 *   the whole buffer is correct.
+		 */
+		uint64_t verify(const uint8_t *buf, unsigned int len, block_t off) const
+			throw ();
+
+		/// Get the key (run ID) stored in each sector header.
+		uint64_t getKey() const
+			throw ();
+
+		/// Change the key (run ID), e.g. to carry on an earlier run.
+		void setKey(uint64_t key)
+			throw ();
+
+		/// Read the header of a sector without checking it.
+		/**
+		 * @param sector
+		 *   SECTOR_SIZE bytes of data.
+		 *
+		 * @param sectorNum
+		 *   On return, the sector number from the header.
+		 *
+		 * @param key
+		 *   On return, the pattern key from the header.
+		 */
+		static void readHeader(const uint8_t *sector, block_t *sectorNum,
+			uint64_t *key)
+			throw ();
+
+		/// Read the header of a sector, and confirm it with the checksum.
+		/**
+		 * @param sector
+		 *   SECTOR_SIZE bytes of data.
+		 *
+		 * @param sectorNum
+		 *   On return, the sector number from the header.
+		 *
+		 * @param key
+		 *   On return, the pattern key from the header.
+		 *
+		 * @return true if the checksum is valid, so the sector was written by
+		 *   scanflash (although possibly for another sector or another run).
+		 */
+		static bool decode(const uint8_t *sector, block_t *sectorNum,
+			uint64_t *key)
+			throw ();
+
+		/// Work out which pattern an intact sector was written with.
+		/**
+		 * @param sector
+		 *   SECTOR_SIZE bytes of data read back from the device.
+		 *
+		 * @param pattern
+		 *   On return, the pattern that generates exactly this sector, with the
+		 *   key from its header.  Unchanged if there isn't one.
+		 *
+		 * @return true if the sector is intact scanflash data and its pattern
+		 *   type was recognised.
+		 */
+		static bool identify(const uint8_t *sector, Pattern *pattern)
+			throw ();
+
+		/// Generate the data for one sector.
+		/**
+		 * @param buf
+		 *   SECTOR_SIZE bytes to fill.
+		 *
+		 * @param sectorNum
+		 *   Absolute sector number the data is for.
+		 */
+		void fillSector(uint8_t *buf, block_t sectorNum) const
+			throw ();
+
+	protected:
+		PatternType type;  ///< Kind of data to write
+		uint64_t key;      ///< Key for PATTERN_RANDOM and the sector headers
+};
+
+#endif // PATTERN_HPP_
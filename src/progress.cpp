@@ -0,0 +1,118 @@
+/**
+ * @file  progress.cpp
+ * @brief Batched progress reports, sent a few times a second.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "progress.hpp"
+#include "queue.hpp"
+
+ProgressSink::~ProgressSink()
+	throw ()
+{
+}
+
+ProgressBatcher::ProgressBatcher(ProgressSink *sink)
+	throw ()
+	: sink(sink),
+	  write(false),
+	  done(0),
+	  lastDone(0),
+	  lastFlush(0),
+	  aborted(false)
+{
+}
+
+void ProgressBatcher::setSink(ProgressSink *sink)
+	throw ()
+{
+	this->sink = sink;
+	return;
+}
+
+void ProgressBatcher::start(bool write, block_t done)
+	throw ()
+{
+	this->write = write;
+	this->events.clear();
+	this->done = this->lastDone = done;
+	this->lastFlush = monotonicTime();
+	this->aborted = false;
+	return;
+}
+
+bool ProgressBatcher::good(block_t b)
+	throw ()
+{
+	return this->add(PROGRESS_GOOD, b, 0);
+}
+
+bool ProgressBatcher::bad(block_t b, int cause)
+	throw ()
+{
+	return this->add(PROGRESS_BAD, b, cause);
+}
+
+bool ProgressBatcher::flush()
+	throw ()
+{
+	if (this->events.empty()) return !this->aborted;
+
+	double now = monotonicTime();
+	ProgressEvent rate;
+	rate.kind = PROGRESS_RATE;
+	rate.first = 0;
+	rate.count = this->done - this->lastDone;
+	rate.cause = 0;
+	rate.rate = (now > this->lastFlush) ? rate.count / (now - this->lastFlush) : 0;
+	rate.done = this->done;
+	this->events.push_back(rate);
+
+	if (!this->sink->progress(this->write, this->events)) this->aborted = true;
+	this->events.clear();
+	this->lastDone = this->done;
+	this->lastFlush = now;
+	return !this->aborted;
+}
+
+bool ProgressBatcher::add(ProgressKind kind, block_t b, int cause)
+	throw ()
+{
+	this->done++;
+	ProgressEvent *last = this->events.empty() ? NULL : &this->events.back();
+	if (last && (last->kind == kind) && (last->cause == cause)
+		&& (last->first + last->count == b)
+	) {
+		last->count++;
+		last->done = this->done;
+	} else {
+		ProgressEvent ev;
+		ev.kind = kind;
+		ev.first = b;
+		ev.count = 1;
+		ev.cause = cause;
+		ev.rate = 0;
+		ev.done = this->done;
+		this->events.push_back(ev);
+	}
+	if ((this->events.size() >= PROGRESS_MAX_EVENTS)
+		|| (monotonicTime() - this->lastFlush >= PROGRESS_INTERVAL)
+	) {
+		return this->flush();
+	}
+	return !this->aborted;
+}
@@ -0,0 +1,154 @@
+/**
+ * @file  progress.hpp
+ * @brief Batched progress reports, sent a few times a second.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROGRESS_HPP_
+#define PROGRESS_HPP_
+
+#include <vector>
+#include "device.hpp"
+
+/// Seconds between batches of progress events.
+#define PROGRESS_INTERVAL 0.25
+
+/// Send a batch early once it holds this many events, so it stays small
+/// when blocks finish out of order.
+#define PROGRESS_MAX_EVENTS 1024
+
+/// What a ProgressEvent describes.
+enum ProgressKind {
+	PROGRESS_GOOD, ///< Blocks the device read or wrote without an error
+	PROGRESS_BAD,  ///< Blocks the device returned an error for
+	PROGRESS_RATE, ///< How quickly blocks were finished since the last batch
+};
+
+/// Something that happened to a run of blocks.
+struct ProgressEvent
+{
+	ProgressKind kind;
+	block_t first;  ///< First block in the run, for GOOD and BAD
+	block_t count;  ///< Blocks in the run, or finished in the interval for RATE
+	int cause;      ///< For BAD, the errno value the device returned
+	double rate;    ///< For RATE, blocks finished per second
+	block_t done;   ///< Blocks finished in this phase, including this event
+};
+
+/// Receives progress a batch at a time.
+class ProgressSink
+{
+	public:
+		virtual ~ProgressSink()
+			throw ();
+
+		/// Some blocks have been finished.
+		/**
+		 * @param write
+		 *   true during a write phase, false when reading.
+		 *
+		 * @param events
+		 *   What happened since the last batch, in the order it happened.  Runs
+		 *   of blocks next to each other with the same outcome are merged.  The
+		 *   batch ends with a PROGRESS_RATE event.
+		 *
+		 * @return true to keep going, false to abort.  Only honoured when
+		 *   reading.
+		 */
+		virtual bool progress(bool write, const std::vector<ProgressEvent>& events)
+			throw () = 0;
+};
+
+/// Collect the outcome of each block and pass it on in batches.
+/**
+ * Calls are cheap and do no I/O of their own, so they can be made for every
+ * block.  The sink is only called when PROGRESS_INTERVAL has passed since
+ * the last batch, or the batch gets too large, so a device with millions of
+ * bad blocks costs no more to report on than a good one.
+ *
+ * Not thread safe; callers running several requests at once must serialise
+ * their calls, as IOQueue does for IOJob::done().
+ */
+class ProgressBatcher
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param sink
+		 *   Where to send each batch.
+		 */
+		ProgressBatcher(ProgressSink *sink)
+			throw ();
+
+		/// Change where batches are sent.
+		void setSink(ProgressSink *sink)
+			throw ();
+
+		/// A new phase is starting.
+		/**
+		 * Any events not yet sent are dropped.
+		 *
+		 * @param write
+		 *   true for a write phase, false for a read phase.
+		 *
+		 * @param done
+		 *   Number of blocks already finished, e.g. by an earlier run that is
+		 *   being resumed.
+		 */
+		void start(bool write, block_t done)
+			throw ();
+
+		/// A block was read or written successfully.
+		/**
+		 * @return false if the sink has asked to abort.
+		 */
+		bool good(block_t b)
+			throw ();
+
+		/// The device returned an error for a block.
+		/**
+		 * @param cause
+		 *   errno value from the device, or 0 if the block was read but held
+		 *   the wrong data.
+		 *
+		 * @return false if the sink has asked to abort.
+		 */
+		bool bad(block_t b, int cause)
+			throw ();
+
+		/// Send anything not yet sent, whether or not it is due.
+		/**
+		 * @return false if the sink has asked to abort.
+		 */
+		bool flush()
+			throw ();
+
+	protected:
+		ProgressSink *sink;   ///< Where batches go
+		bool write;           ///< Is the current phase writing?
+		std::vector<ProgressEvent> events; ///< Waiting to be sent
+		block_t done;         ///< Blocks finished so far in this phase
+		block_t lastDone;     ///< Value of done when the last batch was sent
+		double lastFlush;     ///< Time the last batch was sent
+		bool aborted;         ///< Has the sink asked to stop?
+
+		/// Add one block to the batch, merging it into the last run if it can.
+		bool add(ProgressKind kind, block_t b, int cause)
+			throw ();
+};
+
+#endif // PROGRESS_HPP_
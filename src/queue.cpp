@@ -0,0 +1,141 @@
+/**
+ * @file  queue.cpp
+ * @brief Run several I/O requests against a device at the same time.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "queue.hpp"
+
+double monotonicTime()
+	throw ()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+IOJob::~IOJob()
+	throw ()
+{
+}
+
+void IOJob::process(unsigned int slot, const IORequest& req, bool ok)
+	throw ()
+{
+	return;
+}
+
+IOQueue::IOQueue(Device *dev, unsigned int depth, unsigned int bufSize)
+	throw (error)
+	: dev(dev),
+	  depth(depth),
+	  job(NULL)
+{
+	if (depth < 1) throw error("Queue depth must be at least 1");
+	for (unsigned int i = 0; i < depth; i++) {
+		void *buf;
+		if (posix_memalign(&buf, DEVICE_ALIGN, bufSize) != 0) {
+			for (unsigned int j = 0; j < i; j++) free(this->bufs[j]);
+			throw error("Out of memory allocating I/O buffers");
+		}
+		memset(buf, 0, bufSize);
+		this->bufs.push_back((uint8_t *)buf);
+	}
+	pthread_mutex_init(&this->lock, NULL);
+}
+
+IOQueue::~IOQueue()
+	throw ()
+{
+	pthread_mutex_destroy(&this->lock);
+	for (unsigned int i = 0; i < this->depth; i++) free(this->bufs[i]);
+}
+
+void IOQueue::run(IOJob *job)
+	throw (error)
+{
+	this->job = job;
+	if (this->depth == 1) {
+		// No point starting a thread for a single slot
+		this->runSlot(0);
+		this->job = NULL;
+		return;
+	}
+
+	std::vector<pthread_t> threads(this->depth);
+	std::vector<Slot> slots(this->depth);
+	unsigned int started = 0;
+	for (unsigned int i = 0; i < this->depth; i++) {
+		slots[i].queue = this;
+		slots[i].index = i;
+		if (pthread_create(&threads[i], NULL, IOQueue::worker, &slots[i]) != 0) {
+			break;
+		}
+		started++;
+	}
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	this->job = NULL;
+	if (started < this->depth) throw error("Unable to start I/O threads");
+	return;
+}
+
+void *IOQueue::worker(void *slot)
+	throw ()
+{
+	Slot *s = (Slot *)slot;
+	s->queue->runSlot(s->index);
+	return NULL;
+}
+
+void IOQueue::runSlot(unsigned int slot)
+	throw ()
+{
+	IORequest req;
+	for (;;) {
+		req.write = false;
+		req.off = 0;
+		req.len = 0;
+		req.buf = this->bufs[slot];
+		req.err = 0;
+
+		pthread_mutex_lock(&this->lock);
+		bool more = this->job->next(slot, &req);
+		pthread_mutex_unlock(&this->lock);
+		if (!more) break;
+
+		double tmStart = monotonicTime();
+		if (req.write) {
+			req.err = this->dev->tryWriteAt(req.buf, req.len, req.off);
+		} else {
+			req.err = this->dev->tryReadAt(req.buf, req.len, req.off);
+		}
+		bool ok = (req.err == 0);
+		double latency = monotonicTime() - tmStart;
+
+		this->job->process(slot, req, ok);
+
+		pthread_mutex_lock(&this->lock);
+		this->job->done(slot, req, ok, latency);
+		pthread_mutex_unlock(&this->lock);
+	}
+	return;
+}
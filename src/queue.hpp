@@ -0,0 +1,162 @@
+/**
+ * @file  queue.hpp
+ * @brief Run several I/O requests against a device at the same time.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QUEUE_HPP_
+#define QUEUE_HPP_
+
+#include <vector>
+#include <pthread.h>
+#include "device.hpp"
+#include "error.hpp"
+
+/// A single read or write operation.
+struct IORequest
+{
+	bool write;        ///< true to write, false to read
+	block_t off;       ///< Offset on the device, in bytes
+	unsigned int len;  ///< Number of bytes, no larger than the queue bufSize
+	uint8_t *buf;      ///< Queue slot's buffer, aligned to DEVICE_ALIGN
+	int err;           ///< errno value if the request failed, set before done()
+};
+
+/// Source of requests to run through an IOQueue.
+/**
+ * Calls to next() and done() are serialised by the queue, so implementations
+ * do not need to do their own locking.  The I/O itself and process() run in
+ * parallel.
+ */
+class IOJob
+{
+	public:
+		virtual ~IOJob()
+			throw ();
+
+		/// Get the next request for a queue slot.
+		/**
+		 * @param slot
+		 *   Index of the queue slot, 0 to depth-1.  Each slot only has one
+		 *   request outstanding at a time.
+		 *
+		 * @param req
+		 *   Request to fill in.  req->buf already points to the slot's buffer,
+		 *   which must be filled with the data to write, if writing.
+		 *
+		 * @return true to run the request, false if this slot has finished.
+		 */
+		virtual bool next(unsigned int slot, IORequest *req)
+			throw () = 0;
+
+		/// Work on a completed request's data before done() is called.
+		/**
+		 * This is called without the queue's lock held, so slow work such as
+		 * checking the data read back does not hold up the other slots.  It
+		 * must only touch req.buf and state belonging to this slot, and leave
+		 * anything shared to done().  The default does nothing.
+		 *
+		 * @param slot
+		 *   Queue slot the request was issued on.
+		 *
+		 * @param req
+		 *   The request.  req.buf belongs to the slot until the next call to
+		 *   next().
+		 *
+		 * @param ok
+		 *   false if the device reported an error.
+		 */
+		virtual void process(unsigned int slot, const IORequest& req, bool ok)
+			throw ();
+
+		/// A request has completed.
+		/**
+		 * @param slot
+		 *   Queue slot the request was issued on.
+		 *
+		 * @param req
+		 *   The request.  For reads, req.buf holds the data read back.
+		 *
+		 * @param ok
+		 *   false if the device reported an error, in which case req.err says
+		 *   what it was.
+		 *
+		 * @param latency
+		 *   Time taken by the device, in seconds.
+		 */
+		virtual void done(unsigned int slot, const IORequest& req, bool ok,
+			double latency)
+			throw () = 0;
+};
+
+/// Keep a fixed number of requests outstanding on a device.
+/**
+ * Each queue slot is a thread issuing positional I/O through
+ * Device::readAt() and Device::writeAt(), so a queue depth of N keeps N
+ * requests in flight at once.
+ */
+class IOQueue
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device to run requests against.
+		 *
+		 * @param depth
+		 *   Number of requests to keep outstanding.
+		 *
+		 * @param bufSize
+		 *   Largest request, in bytes.  Should be a multiple of DEVICE_ALIGN.
+		 */
+		IOQueue(Device *dev, unsigned int depth, unsigned int bufSize)
+			throw (error);
+
+		~IOQueue()
+			throw ();
+
+		/// Run requests from the job until every slot has finished.
+		void run(IOJob *job)
+			throw (error);
+
+	protected:
+		Device *dev;          ///< Device to run requests against
+		unsigned int depth;   ///< Number of slots
+		std::vector<uint8_t *> bufs; ///< One aligned buffer per slot
+		IOJob *job;           ///< Job currently being run
+		pthread_mutex_t lock; ///< Serialises calls into the job
+
+		/// Per-thread context
+		struct Slot {
+			IOQueue *queue;
+			unsigned int index;
+		};
+
+		/// Thread entry point.
+		static void *worker(void *slot)
+			throw ();
+
+		/// Run requests for a single slot until the job says stop.
+		void runSlot(unsigned int slot)
+			throw ();
+};
+
+/// Current time in seconds, from a clock that never goes backwards.
+double monotonicTime()
+	throw ();
+
+#endif // QUEUE_HPP_
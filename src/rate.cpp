@@ -0,0 +1,84 @@
+/**
+ * @file  rate.cpp
+ * @brief Throughput and time remaining for each phase of a check.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include "rate.hpp"
+#include "queue.hpp"
+
+RateEstimator::RateEstimator()
+	throw ()
+{
+	this->start(0, 0, 0);
+}
+
+void RateEstimator::start(block_t done, block_t blocks, block_t later)
+	throw ()
+{
+	this->current.valid = false;
+	this->current.done = done;
+	this->current.blocks = blocks;
+	this->current.elapsed = 0;
+	this->current.average = 0;
+	this->current.recent = 0;
+	this->current.phaseLeft = 0;
+	this->current.totalLeft = 0;
+	this->firstDone = this->lastDone = done;
+	this->later = later;
+	this->tmStart = this->lastTime = monotonicTime();
+	return;
+}
+
+void RateEstimator::sample(block_t done)
+	throw ()
+{
+	double now = monotonicTime();
+	double interval = now - this->lastTime;
+	if ((interval <= 0) || (done < this->lastDone)) return;
+
+	RateStatus& s = this->current;
+	double rate = (done - this->lastDone) / interval;
+	if (!s.valid) {
+		s.recent = rate;
+	} else {
+		// Weight by time rather than by sample, so irregular updates (e.g.
+		// batches sent early) do not skew the rate
+		double weight = 1 - exp(-interval / RATE_EWMA_TIME);
+		s.recent += weight * (rate - s.recent);
+	}
+	s.valid = true;
+	s.done = done;
+	s.elapsed = now - this->tmStart;
+	s.average = (done - this->firstDone) / s.elapsed;
+
+	if (s.recent > 0) {
+		block_t left = (s.blocks > done) ? s.blocks - done : 0;
+		s.phaseLeft = left / s.recent;
+		s.totalLeft = (left + this->later) / s.recent;
+	}
+	this->lastTime = now;
+	this->lastDone = done;
+	return;
+}
+
+const RateStatus& RateEstimator::status() const
+	throw ()
+{
+	return this->current;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file  rate.hpp
+ * @brief Throughput and time remaining for each phase of a check.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RATE_HPP_
+#define RATE_HPP_
+
+#include "device.hpp"
+
+/// Seconds over which the recent rate forgets about older samples.  Short
+/// enough to follow a write cache running out within a few updates.
+#define RATE_EWMA_TIME 5.0
+
+/// How a phase is going, as estimated by RateEstimator.
+struct RateStatus
+{
+	bool valid;          ///< false until enough time has passed to measure
+	block_t done;        ///< Blocks finished in this phase, including resumed
+	block_t blocks;      ///< Blocks in this phase
+	double elapsed;      ///< Seconds since the phase started
+	double average;      ///< Blocks per second since the phase started
+	double recent;       ///< Blocks per second, weighted towards the last few
+	double phaseLeft;    ///< Seconds until this phase is finished
+	double totalLeft;    ///< Seconds until this and any later phases finish
+};
+
+/// Measure how fast a phase is going and how long it has left.
+/**
+ * Times come from the monotonic clock, so the estimate is not upset by the
+ * system time changing, and are kept to the microsecond so updates a
+ * fraction of a second apart still give a rate.
+ *
+ * The time left is worked out from an exponentially weighted rate rather
+ * than the average since the start, so it settles on the new speed within a
+ * few seconds when a device slows down part way through, e.g. once its
+ * write cache is full.  Phases still to come are assumed to go at the same
+ * rate as this one.
+ */
+class RateEstimator
+{
+	public:
+		RateEstimator()
+			throw ();
+
+		/// A new phase is starting.
+		/**
+		 * @param done
+		 *   Blocks already finished, e.g. by an earlier run being resumed.
+		 *   These do not count towards the rate.
+		 *
+		 * @param blocks
+		 *   Number of blocks in the phase.
+		 *
+		 * @param later
+		 *   Number of blocks in the phases that will follow this one, or 0 if
+		 *   this is the last.
+		 */
+		void start(block_t done, block_t blocks, block_t later)
+			throw ();
+
+		/// Record how many blocks have been finished so far in this phase.
+		void sample(block_t done)
+			throw ();
+
+		/// Get the latest estimate.
+		const RateStatus& status() const
+			throw ();
+
+	protected:
+		RateStatus current;   ///< Latest estimate
+		block_t firstDone;    ///< Value of done when the phase started
+		block_t later;        ///< Blocks in the phases after this one
+		double tmStart;       ///< Time the phase started
+		double lastTime;      ///< Time of the last sample
+		block_t lastDone;     ///< Value of done at the last sample
+};
+
+#endif // RATE_HPP_
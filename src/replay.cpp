@@ -0,0 +1,296 @@
+/**
+ * @file  replay.cpp
+ * @brief Device that behaves like the one a trace was recorded from.
+ *
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "replay.hpp"
+#include "queue.hpp"
+#include "pattern.hpp"
+
+/// Longest latency that can be replayed, in microseconds.
+#define REPLAY_MAX_LATENCY 0xFFFFFFFFUL
+
+/// Order outcomes by offset.
+struct OutcomeOffsetLess
+{
+	bool operator() (const ReplayOutcome& a, const ReplayOutcome& b) const
+		throw ()
+	{
+		return a.offset < b.offset;
+	}
+};
+
+ReplayDevice::ReplayDevice(Device *dev, const char *path)
+	throw (error)
+	: dev(dev),
+	  nextSync(0),
+	  pos(0)
+{
+	TraceReader trace(path);
+	this->traceSize = trace.deviceSize();
+	if (dev->size() < this->traceSize) {
+		throw error("The traced device is larger than the one to replay it on.  "
+			"Create a file of the right size with truncate -s");
+	}
+
+	double readTime = 0, writeTime = 0;
+	block_t readBytes = 0, writeBytes = 0;
+	TraceRecord rec;
+	while (trace.next(&rec)) {
+		ReplayOutcome o;
+		o.offset = rec.offset;
+		o.source = rec.offset;
+		if (rec.header && (rec.sector * SECTOR_SIZE + rec.length <= this->traceSize)) {
+			o.source = rec.sector * SECTOR_SIZE;
+		}
+		o.length = rec.length;
+		o.latency = (rec.latency > REPLAY_MAX_LATENCY)
+			? REPLAY_MAX_LATENCY : rec.latency;
+		o.result = rec.result;
+		switch (rec.op) {
+			case TRACE_READ:
+				this->reads.outcomes.push_back(o);
+				if (!o.result) {
+					readTime += o.latency;
+					readBytes += o.length;
+				}
+				break;
+			case TRACE_WRITE:
+				this->writes.outcomes.push_back(o);
+				if (!o.result) {
+					writeTime += o.latency;
+					writeBytes += o.length;
+				}
+				break;
+			case TRACE_SYNC:
+				this->syncs.push_back(o);
+				break;
+		}
+	}
+	// Keep retries of the same offset in the order they happened
+	std::stable_sort(this->reads.outcomes.begin(), this->reads.outcomes.end(),
+		OutcomeOffsetLess());
+	std::stable_sort(this->writes.outcomes.begin(), this->writes.outcomes.end(),
+		OutcomeOffsetLess());
+	this->reads.perByte = readBytes ? readTime / readBytes : 0;
+	this->writes.perByte = writeBytes ? writeTime / writeBytes : 0;
+
+	if (pthread_mutex_init(&this->lock, NULL) != 0) {
+		throw error("Unable to create mutex");
+	}
+}
+
+ReplayDevice::~ReplayDevice()
+	throw ()
+{
+	pthread_mutex_destroy(&this->lock);
+	delete this->dev;
+}
+
+void ReplayDevice::open(const char *path)
+	throw (error)
+{
+	this->dev->open(path);
+	return;
+}
+
+void ReplayDevice::close()
+	throw (error)
+{
+	this->dev->close();
+	return;
+}
+
+void ReplayDevice::reopen()
+	throw (error)
+{
+	this->dev->reopen();
+	return;
+}
+
+block_t ReplayDevice::size()
+	throw (error)
+{
+	return this->traceSize;
+}
+
+void ReplayDevice::seek(block_t off)
+	throw (error)
+{
+	this->pos = off;
+	return;
+}
+
+void ReplayDevice::write(uint8_t *buf, unsigned int len)
+	throw (error)
+{
+	int err = this->tryWrite(buf, len);
+	if (err) throw error(strerror(err));
+	return;
+}
+
+void ReplayDevice::read(uint8_t *buf, unsigned int len)
+	throw (error)
+{
+	int err = this->tryRead(buf, len);
+	if (err) throw error(strerror(err));
+	return;
+}
+
+void ReplayDevice::writeAt(uint8_t *buf, unsigned int len, block_t off)
+	throw (error)
+{
+	int err = this->tryWriteAt(buf, len, off);
+	if (err) throw error(strerror(err));
+	return;
+}
+
+void ReplayDevice::readAt(uint8_t *buf, unsigned int len, block_t off)
+	throw (error)
+{
+	int err = this->tryReadAt(buf, len, off);
+	if (err) throw error(strerror(err));
+	return;
+}
+
+int ReplayDevice::tryWrite(uint8_t *buf, unsigned int len)
+	throw ()
+{
+	block_t off = this->pos;
+	this->pos += len;
+	return this->transfer(true, buf, len, off);
+}
+
+int ReplayDevice::tryRead(uint8_t *buf, unsigned int len)
+	throw ()
+{
+	block_t off = this->pos;
+	this->pos += len;
+	return this->transfer(false, buf, len, off);
+}
+
+int ReplayDevice::tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+	throw ()
+{
+	return this->transfer(true, buf, len, off);
+}
+
+int ReplayDevice::tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+	throw ()
+{
+	return this->transfer(false, buf, len, off);
+}
+
+void ReplayDevice::sync()
+	throw (error)
+{
+	double start = monotonicTime();
+	ReplayOutcome o;
+	o.latency = 0;
+	o.result = 0;
+	pthread_mutex_lock(&this->lock);
+	if (!this->syncs.empty()) {
+		o = this->syncs[this->nextSync];
+		if (this->nextSync + 1 < this->syncs.size()) this->nextSync++;
+	}
+	pthread_mutex_unlock(&this->lock);
+	if (!o.result) this->dev->sync();
+	waitUntil(start, o.latency);
+	if (o.result) throw error(strerror(o.result));
+	return;
+}
+
+ReplayOutcome ReplayDevice::lookup(OpModel *model, block_t off,
+	unsigned int len)
+	throw ()
+{
+	ReplayOutcome res;
+	res.offset = off;
+	res.source = off;
+	res.length = len;
+	res.latency = (uint32_t)(model->perByte * len);
+	res.result = 0;
+
+	// Find the last transfer recorded at or before this offset
+	ReplayOutcome key;
+	key.offset = off;
+	std::vector<ReplayOutcome>::iterator end = std::upper_bound(
+		model->outcomes.begin(), model->outcomes.end(), key, OutcomeOffsetLess());
+	if (end == model->outcomes.begin()) return res;
+	const ReplayOutcome& last = *(end - 1);
+	if (off >= last.offset + last.length) return res; // in a gap in the trace
+
+	// Pick the next of the transfers recorded at that offset
+	key.offset = last.offset;
+	std::vector<ReplayOutcome>::iterator first = std::lower_bound(
+		model->outcomes.begin(), end, key, OutcomeOffsetLess());
+	const ReplayOutcome *rec = &*first;
+	if (end - first > 1) {
+		pthread_mutex_lock(&this->lock);
+		unsigned int& n = model->cursor[last.offset];
+		rec = &*(first + n);
+		if (first + n + 1 < end) n++;
+		pthread_mutex_unlock(&this->lock);
+	}
+
+	res.result = rec->result;
+	res.latency = rec->latency;
+	if ((rec->source != rec->offset)
+		&& (rec->source + (off - rec->offset) + len <= this->traceSize)
+	) {
+		res.source = rec->source + (off - rec->offset);
+	}
+	if ((len != rec->length) && rec->length) {
+		res.latency = (uint32_t)((double)rec->latency * len / rec->length);
+	}
+	return res;
+}
+
+int ReplayDevice::transfer(bool write, uint8_t *buf, unsigned int len,
+	block_t off)
+	throw ()
+{
+	double start = monotonicTime();
+	ReplayOutcome o = this->lookup(write ? &this->writes : &this->reads, off, len);
+	int err = o.result;
+	if (!err) {
+		// Aliased reads come from where their data was really written
+		err = write
+			? this->dev->tryWriteAt(buf, len, off)
+			: this->dev->tryReadAt(buf, len, o.source);
+	}
+	waitUntil(start, o.latency);
+	return err;
+}
+
+void ReplayDevice::waitUntil(double start, uint32_t latency)
+	throw ()
+{
+	double left = start + latency / 1000000.0 - monotonicTime();
+	if (left <= 0) return;
+	struct timespec ts;
+	ts.tv_sec = (time_t)left;
+	ts.tv_nsec = (long)((left - ts.tv_sec) * 1000000000);
+	while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR)) { }
+	return;
+}
@@ -0,0 +1,170 @@
+/**
+ * @file  replay.hpp
+ * @brief Device that behaves like the one a trace was recorded from.
+ *
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAY_HPP_
+#define REPLAY_HPP_
+
+#include <vector>
+#include <map>
+#include <pthread.h>
+#include "device.hpp"
+#include "error.hpp"
+#include "tracefile.hpp"
+
+/// How one recorded transfer went.
+struct ReplayOutcome
+{
+	block_t offset;      ///< Byte offset of the transfer
+	block_t source;      ///< Where the data read back was written, normally offset
+	unsigned int length; ///< Bytes transferred
+	uint32_t latency;    ///< Microseconds it took, capped at about an hour
+	int result;          ///< 0 on success, otherwise an errno value
+};
+
+/// Device that passes data through to another, but with recorded timing.
+/**
+ * A trace recorded with --trace from a problem device is loaded, and every
+ * transfer is made to take as long as the recorded transfer at the same
+ * offset did, and to fail with the same error.  Transfers that were retried
+ * get each recorded outcome in turn, then repeat the last one.  Transfers at
+ * offsets the trace does not cover take the average time per byte, and
+ * succeed.  Syncs go through the recorded sync outcomes in order.
+ *
+ * Reads that returned test data written for another sector, as an aliased
+ * fake device does, return the data from that sector instead, so the same
+ * faults are found.
+ *
+ * This lets changes to how the device is tested be compared against the
+ * real device's worst behaviour, without having the device.  The data
+ * itself is not in the trace, so it is stored on the device passed in,
+ * usually a sparse file.  Each recorded outcome takes 32 bytes of memory.
+ */
+class ReplayDevice: virtual public Device
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device holding the data.  It must already be open, be at least as
+		 *   large as the traced device, and is deleted along with this one.
+		 *
+		 * @param path
+		 *   Trace file to replay.
+		 *
+		 * @throw error if the trace cannot be read or dev is too small.
+		 */
+		ReplayDevice(Device *dev, const char *path)
+			throw (error);
+
+		virtual ~ReplayDevice()
+			throw ();
+
+		virtual void open(const char *path)
+			throw (error);
+
+		virtual void close()
+			throw (error);
+
+		virtual void reopen()
+			throw (error);
+
+		/// Size of the traced device, not the one holding the data.
+		virtual block_t size()
+			throw (error);
+
+		virtual void seek(block_t off)
+			throw (error);
+
+		virtual void write(uint8_t *buf, unsigned int len)
+			throw (error);
+
+		virtual void read(uint8_t *buf, unsigned int len)
+			throw (error);
+
+		virtual void writeAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (error);
+
+		virtual void readAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (error);
+
+		virtual int tryWrite(uint8_t *buf, unsigned int len)
+			throw ();
+
+		virtual int tryRead(uint8_t *buf, unsigned int len)
+			throw ();
+
+		virtual int tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
+		virtual int tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
+		virtual void sync()
+			throw (error);
+
+	protected:
+		/// Recorded transfers of one kind, sorted by offset.
+		struct OpModel {
+			std::vector<ReplayOutcome> outcomes; ///< Every recorded transfer
+			std::map<block_t, unsigned int> cursor; ///< Next outcome for retried offsets
+			double perByte;  ///< Average microseconds per byte, for unknown offsets
+		};
+
+		Device *dev;          ///< Device holding the data
+		block_t traceSize;    ///< Size of the traced device
+		OpModel reads;        ///< Recorded reads
+		OpModel writes;       ///< Recorded writes
+		std::vector<ReplayOutcome> syncs; ///< Recorded syncs, in order
+		unsigned int nextSync; ///< Next entry in syncs
+		block_t pos;          ///< Seek position, for read() and write()
+		pthread_mutex_t lock; ///< Protects the cursors
+
+		/// Work out how a transfer should go.
+		/**
+		 * @param model
+		 *   Recorded transfers of the same kind.
+		 *
+		 * @param off
+		 *   Byte offset of the transfer.
+		 *
+		 * @param len
+		 *   Length of the transfer.
+		 *
+		 * @return The recorded outcome, with the latency scaled to len and the
+		 *   source moved along by as far as off is into the recorded transfer.
+		 */
+		ReplayOutcome lookup(OpModel *model, block_t off, unsigned int len)
+			throw ();
+
+		/// Run a transfer on the data device, then wait out the rest of the
+		/// recorded time.
+		/**
+		 * @return 0 on success, otherwise an errno value.
+		 */
+		int transfer(bool write, uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
+		/// Sleep until the given number of microseconds after start.
+		static void waitUntil(double start, uint32_t latency)
+			throw ();
+};
+
+#endif // REPLAY_HPP_
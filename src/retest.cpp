@@ -0,0 +1,295 @@
+/**
+ * @file  retest.cpp
+ * @brief Test only the areas an earlier run found to be bad.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include "retest.hpp"
+#include "check.hpp"
+#include "classify.hpp"
+
+/// Number of sectors in each DEVICE_ALIGN unit, the smallest unit read.
+#define ALIGN_SECTORS (DEVICE_ALIGN / SECTOR_SIZE)
+
+/// Data written on each pass, so every bit is tested both ways.
+static const PatternType retestPatterns[RETEST_PASSES] = {
+	PATTERN_BLOCKNUM,
+	PATTERN_INVERSE,
+	PATTERN_RANDOM,
+};
+
+Retest::Retest(Device *dev, const ExtentList& previous)
+	throw (error)
+	: dev(dev),
+	  previous(previous),
+	  buf(NULL)
+{
+	block_t len = this->dev->size();
+	this->numBlocks = len / DATA_BLOCK_SIZE;
+	block_t numSectors = this->numBlocks * SECTORS_PER_BLOCK;
+
+	for (std::vector<Extent>::const_iterator
+		i = previous.extents.begin(); i != previous.extents.end(); i++
+	) {
+		if (i->end() > numSectors) {
+			throw error("The bad extents do not fit on this device");
+		}
+		block_t start = (i->start > RETEST_MARGIN) ? i->start - RETEST_MARGIN : 0;
+		this->addRegion(start, i->end() + RETEST_MARGIN);
+		if (i->type == BAD_MOVED) {
+			// Write the sectors that landed here too, in case they still do
+			this->addRegion(i->movedFrom, i->movedFrom + i->len);
+		}
+	}
+
+	void *p;
+	if (posix_memalign(&p, DEVICE_ALIGN, RETEST_CHUNK_SIZE) != 0) {
+		throw error("Out of memory allocating I/O buffers");
+	}
+	this->buf = (uint8_t *)p;
+}
+
+Retest::~Retest()
+	throw ()
+{
+	free(this->buf);
+}
+
+void Retest::run(uint64_t runID)
+	throw (error)
+{
+	if (this->regions.empty()) throw error("There are no bad extents to retest");
+
+	block_t total = 0;
+	for (std::vector<RetestRegion>::const_iterator
+		i = this->regions.begin(); i != this->regions.end(); i++
+	) {
+		total += i->end - i->start;
+	}
+	std::cout << "Retesting " << this->previous.extents.size() << " bad extents, "
+		<< total * SECTOR_SIZE / 1048576 << "MB in " << this->regions.size()
+		<< " areas including a " << RETEST_MARGIN * SECTOR_SIZE / 1024
+		<< " kB margin either side" << std::endl;
+
+	this->badSectors.clear();
+	for (unsigned int pass = 0; pass < RETEST_PASSES; pass++) {
+		// A different key each time, so data left over from an earlier pass is
+		// caught as well
+		Pattern pattern(retestPatterns[pass], runID + pass);
+		std::cout << "Pass " << pass + 1 << " of " << RETEST_PASSES
+			<< ": writing..." << std::flush;
+		this->writeRegions(pattern);
+		std::cout << " verifying..." << std::flush;
+		this->verifyRegions(pattern);
+		std::cout << " " << this->badSectors.count() << " bad sectors so far"
+			<< std::endl;
+	}
+	this->badSectors.sort();
+	return;
+}
+
+bool Retest::foundBad() const
+	throw ()
+{
+	return !this->badSectors.empty();
+}
+
+const ExtentList& Retest::getBadSectors() const
+	throw ()
+{
+	return this->badSectors;
+}
+
+void Retest::report(std::ostream& out) const
+	throw ()
+{
+	out << "Before retest: " << this->previous.count() << " bad sectors, "
+		"sectors " << this->previous.first() << '-' << this->previous.end() - 1
+		<< "\n";
+	if (this->badSectors.empty()) {
+		out << "After retest: no bad sectors, every sector passed all "
+			<< RETEST_PASSES << " passes\n";
+		return;
+	}
+	block_t firstBad = this->badSectors.first();
+	block_t endBad = this->badSectors.end();
+	out << "After retest: " << this->badSectors.count() << " bad sectors, "
+		"sectors " << firstBad << '-' << endBad - 1 << "\n";
+	// The margins and movedFrom sources are retested too, so the bad area can
+	// grow past either end of the old one
+	if (firstBad >= this->previous.first()) {
+		out << "  >> " << (firstBad - this->previous.first()) * SECTOR_SIZE / 1024
+			<< " kB more are good at the start of the bad area\n";
+	} else {
+		out << "  >> The bad area has grown by "
+			<< (this->previous.first() - firstBad) * SECTOR_SIZE / 1024
+			<< " kB at the start\n";
+	}
+	if (endBad <= this->previous.end()) {
+		out << "  >> " << (this->previous.end() - endBad) * SECTOR_SIZE / 1024
+			<< " kB more are good at the end of the bad area\n";
+	} else {
+		out << "  >> The bad area has grown by "
+			<< (endBad - this->previous.end()) * SECTOR_SIZE / 1024
+			<< " kB at the end\n";
+	}
+	this->badSectors.report(out, SECTOR_SIZE);
+	return;
+}
+
+void Retest::writePartitionTable()
+	throw (error)
+{
+	block_t size = this->numBlocks * DATA_BLOCK_SIZE;
+	if (this->badSectors.empty()) {
+		this->dev->writePartitionTable(0, 0, size);
+	} else {
+		this->dev->writePartitionTable(
+			this->badSectors.first() * SECTOR_SIZE,
+			this->badSectors.end() * SECTOR_SIZE - 1,
+			size);
+	}
+	return;
+}
+
+void Retest::addRegion(block_t start, block_t end)
+	throw ()
+{
+	// Expand to whole aligned units, so the reads bypass the page cache
+	start -= start % ALIGN_SECTORS;
+	end += ALIGN_SECTORS - 1;
+	end -= end % ALIGN_SECTORS;
+	block_t numSectors = this->numBlocks * SECTORS_PER_BLOCK;
+	if (end > numSectors) end = numSectors;
+	if (start >= end) return;
+
+	// Swallow any regions this one overlaps or touches
+	std::vector<RetestRegion>::iterator i = this->regions.begin();
+	while ((i != this->regions.end()) && (i->end < start)) i++;
+	std::vector<RetestRegion>::iterator j = i;
+	while ((j != this->regions.end()) && (j->start <= end)) {
+		if (j->start < start) start = j->start;
+		if (j->end > end) end = j->end;
+		j++;
+	}
+	i = this->regions.erase(i, j);
+
+	RetestRegion r;
+	r.start = start;
+	r.end = end;
+	r.bad.assign(end - start, false);
+	this->regions.insert(i, r);
+	return;
+}
+
+void Retest::writeRegions(const Pattern& pattern)
+	throw ()
+{
+	for (std::vector<RetestRegion>::const_iterator
+		i = this->regions.begin(); i != this->regions.end(); i++
+	) {
+		for (block_t s = i->start; s < i->end; s += RETEST_CHUNK_SIZE / SECTOR_SIZE) {
+			unsigned int n = RETEST_CHUNK_SIZE;
+			if ((i->end - s) * SECTOR_SIZE < n) n = (i->end - s) * SECTOR_SIZE;
+			pattern.fill(this->buf, n, s * SECTOR_SIZE);
+			try {
+				this->dev->writeAt(this->buf, n, s * SECTOR_SIZE);
+			} catch (const error& e) {
+				// Whatever went wrong will show up when it is read back
+			}
+		}
+	}
+	return;
+}
+
+void Retest::verifyRegions(const Pattern& pattern)
+	throw ()
+{
+	for (std::vector<RetestRegion>::iterator
+		i = this->regions.begin(); i != this->regions.end(); i++
+	) {
+		for (block_t s = i->start; s < i->end; s += RETEST_CHUNK_SIZE / SECTOR_SIZE) {
+			unsigned int n = RETEST_CHUNK_SIZE;
+			if ((i->end - s) * SECTOR_SIZE < n) n = (i->end - s) * SECTOR_SIZE;
+			bool chunkRead = true;
+			try {
+				this->dev->readAt(this->buf, n, s * SECTOR_SIZE);
+			} catch (const error& e) {
+				chunkRead = false;
+			}
+			if (chunkRead) {
+				for (unsigned int off = 0; off < n; off += PATTERN_MAX_LEN) {
+					unsigned int len = PATTERN_MAX_LEN;
+					if (n - off < len) len = n - off;
+					this->checkData(*i, s + off / SECTOR_SIZE, &this->buf[off], len,
+						pattern);
+				}
+				continue;
+			}
+			// Read each aligned unit on its own to narrow down the bad ones
+			for (unsigned int off = 0; off < n; off += DEVICE_ALIGN) {
+				const uint8_t *data = &this->buf[off];
+				try {
+					this->dev->readAt(&this->buf[off], DEVICE_ALIGN,
+						s * SECTOR_SIZE + off);
+				} catch (const error& e) {
+					data = NULL;
+				}
+				this->checkData(*i, s + off / SECTOR_SIZE, data, DEVICE_ALIGN,
+					pattern);
+			}
+		}
+	}
+	return;
+}
+
+void Retest::checkData(RetestRegion& region, block_t sector,
+	const uint8_t *data, unsigned int len, const Pattern& pattern)
+	throw ()
+{
+	uint64_t badMask;
+	if (data) {
+		badMask = pattern.verify(data, len, sector * SECTOR_SIZE);
+		if (!badMask) return;
+	} else {
+		badMask = ~0ULL;
+	}
+
+	Classifier classifier(pattern);
+	for (unsigned int s = 0; s < len / SECTOR_SIZE; s++) {
+		if (!(badMask & (1ULL << s))) continue;
+		// Only the first way each sector failed is kept
+		block_t idx = sector + s - region.start;
+		if (region.bad[idx]) continue;
+		region.bad[idx] = true;
+
+		Extent ext;
+		if (data) {
+			classifier.classify(&data[s * SECTOR_SIZE], sector + s, &ext);
+		} else {
+			ext.start = sector + s;
+			ext.len = 1;
+			ext.type = BAD_READ_ERROR;
+			ext.movedFrom = 0;
+			ext.flipsUp = ext.flipsDown = 0;
+		}
+		this->badSectors.add(ext);
+	}
+	return;
+}
@@ -0,0 +1,146 @@
+/**
+ * @file  retest.hpp
+ * @brief Test only the areas an earlier run found to be bad.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RETEST_HPP_
+#define RETEST_HPP_
+
+#include <vector>
+#include <ostream>
+#include "device.hpp"
+#include "error.hpp"
+#include "pattern.hpp"
+#include "extent.hpp"
+
+/// Good area to test either side of each bad extent, in sectors (1MB).
+#define RETEST_MARGIN (1048576 / SECTOR_SIZE)
+
+/// Size of each read and write.
+#define RETEST_CHUNK_SIZE 1048576
+
+/// Number of times each area is written and verified, each with other data.
+#define RETEST_PASSES 3
+
+/// Area to write and verify on each pass.
+struct RetestRegion
+{
+	block_t start;         ///< First sector, a multiple of DEVICE_ALIGN
+	block_t end;           ///< One past the last sector, also aligned
+	std::vector<bool> bad; ///< Sectors already found bad by an earlier pass
+};
+
+/// Write and verify the areas around a list of bad extents.
+/**
+ * A full test only needs to find roughly where the damage is, and it places
+ * the partitions using the first and last bad sector.  This goes back over
+ * each bad extent along with RETEST_MARGIN sectors either side, writing and
+ * verifying each sector several times with different data, so the bad area
+ * can be narrowed down without testing the whole device again.
+ *
+ * A sector is bad if it fails any pass.  Sectors that pass every time are
+ * dropped from the list, so an extent may shrink or disappear entirely.
+ *
+ * The areas an extent's data was aliased from are tested in the same pass,
+ * so if writing them still lands on the extent it is found again.
+ */
+class Retest
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device to test.
+		 *
+		 * @param previous
+		 *   Bad extents found by an earlier run on the same device.
+		 */
+		Retest(Device *dev, const ExtentList& previous)
+			throw (error);
+
+		~Retest()
+			throw ();
+
+		/// Write and verify each area RETEST_PASSES times.
+		/**
+		 * @param runID
+		 *   Key for the test data, varied for each pass.
+		 */
+		void run(uint64_t runID)
+			throw (error);
+
+		/// Did run() find any bad sectors?
+		bool foundBad() const
+			throw ();
+
+		/// Get the bad sectors found by run().
+		const ExtentList& getBadSectors() const
+			throw ();
+
+		/// Write a human readable comparison with the earlier results.
+		void report(std::ostream& out) const
+			throw ();
+
+		/// Replace the partition table to avoid only the bad sectors now found.
+		void writePartitionTable()
+			throw (error);
+
+	protected:
+		Device *dev;           ///< Device being tested
+		block_t numBlocks;     ///< Size of device, in blocks
+		ExtentList previous;   ///< Bad areas from the earlier run
+		ExtentList badSectors; ///< Bad areas found by run()
+		std::vector<RetestRegion> regions; ///< Areas to test, in order
+		uint8_t *buf;          ///< Aligned I/O buffer
+
+		/// Add an area to test, merging it with any it overlaps.
+		void addRegion(block_t start, block_t end)
+			throw ();
+
+		/// Write the test data to every region.
+		void writeRegions(const Pattern& pattern)
+			throw ();
+
+		/// Read back every region, adding any newly bad sectors.
+		void verifyRegions(const Pattern& pattern)
+			throw ();
+
+		/// Check data read back from part of a region.
+		/**
+		 * @param region
+		 *   Region the data belongs to.
+		 *
+		 * @param sector
+		 *   First sector in buf.
+		 *
+		 * @param data
+		 *   Data read back, or NULL if it could not be read.
+		 *
+		 * @param len
+		 *   Length of the data in bytes, a multiple of DEVICE_ALIGN no larger
+		 *   than PATTERN_MAX_LEN.
+		 *
+		 * @param pattern
+		 *   Data that was written.
+		 */
+		void checkData(RetestRegion& region, block_t sector, const uint8_t *data,
+			unsigned int len, const Pattern& pattern)
+			throw ();
+};
+
+#endif // RETEST_HPP_
@@ -0,0 +1,278 @@
+/**
+ * @file  surface.cpp
+ * @brief Read-only scan of a device, timing every read.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <iomanip>
+#include "surface.hpp"
+#include "queue.hpp"
+
+double ScanRegion::meanLatency() const
+	throw ()
+{
+	if (this->reads == 0) return 0;
+	return this->totalLatency / this->reads;
+}
+
+/// Read each block in turn, putting failed blocks back in the queue.
+class ScanJob: virtual public IOJob
+{
+	public:
+		ScanJob(SurfaceScan *scan)
+			throw ()
+			: scan(scan),
+			  nextBlock(scan->firstBlock),
+			  completed(0),
+			  aborted(false)
+		{
+		}
+
+		virtual ~ScanJob()
+			throw ()
+		{
+		}
+
+		virtual bool next(unsigned int slot, IORequest *req)
+			throw ()
+		{
+			if (this->aborted) return false;
+			block_t b;
+			if (!this->retries.empty()) {
+				b = this->retries.front();
+				this->retries.pop_front();
+			} else if (this->nextBlock < this->scan->endBlock) {
+				b = this->nextBlock++;
+			} else {
+				return false;
+			}
+			req->write = false;
+			req->off = b * DATA_BLOCK_SIZE;
+			req->len = DATA_BLOCK_SIZE;
+			return true;
+		}
+
+		virtual void done(unsigned int slot, const IORequest& req, bool ok,
+			double latency)
+			throw ()
+		{
+			block_t b = req.off / DATA_BLOCK_SIZE;
+			ScanRegion& region = this->scan->regions[
+				(b - this->scan->firstBlock) / SCAN_REGION_BLOCKS];
+			if (latency > region.maxLatency) region.maxLatency = latency;
+
+			std::map<block_t, unsigned int>::iterator a = this->attempts.find(b);
+			if (ok) {
+				region.reads++;
+				region.totalLatency += latency;
+				if (a != this->attempts.end()) {
+					region.retried++;
+					this->attempts.erase(a);
+				}
+			} else {
+				unsigned int tries = (a == this->attempts.end()) ? 1 : a->second + 1;
+				if (tries <= SCAN_RETRIES) {
+					// Try again later, rather than straight away while the device
+					// may still be recovering
+					this->attempts[b] = tries;
+					this->retries.push_back(b);
+					return;
+				}
+				if (a != this->attempts.end()) this->attempts.erase(a);
+				region.failed++;
+				Extent ext;
+				ext.start = b * SECTORS_PER_BLOCK;
+				ext.len = SECTORS_PER_BLOCK;
+				ext.type = BAD_READ_ERROR;
+				ext.movedFrom = 0;
+				ext.flipsUp = ext.flipsDown = 0;
+				this->scan->badSectors.add(ext);
+			}
+
+			if (ok ? !this->scan->progress.good(b)
+				: !this->scan->progress.bad(b, req.err)
+			) {
+				this->aborted = true;
+			}
+			this->completed++;
+			return;
+		}
+
+		SurfaceScan *scan;
+		block_t nextBlock;  ///< Next block not yet read at all
+		block_t completed;  ///< Blocks read or given up on
+		bool aborted;       ///< Did the UI ask to stop?
+		std::deque<block_t> retries; ///< Failed blocks waiting to be retried
+		std::map<block_t, unsigned int> attempts; ///< Failures so far, by block
+};
+
+SurfaceScan::SurfaceScan(Device *dev, CheckCallback *cb)
+	throw (error)
+	: dev(dev),
+	  cb(cb),
+	  cbSink(cb),
+	  progress(&this->cbSink),
+	  duration(0)
+{
+	block_t len = this->dev->size();
+	this->numBlocks = len / DATA_BLOCK_SIZE;
+	if (this->numBlocks == 0) throw error("Device is too small to scan");
+	this->firstBlock = 0;
+	this->endBlock = this->numBlocks;
+}
+
+SurfaceScan::~SurfaceScan()
+	throw ()
+{
+}
+
+void SurfaceScan::setRange(block_t firstBlock, block_t count)
+	throw (error)
+{
+	if ((count == 0) || (firstBlock >= this->numBlocks)
+		|| (count > this->numBlocks - firstBlock)
+	) {
+		throw error("Range to scan is outside the device");
+	}
+	this->firstBlock = firstBlock;
+	this->endBlock = firstBlock + count;
+	return;
+}
+
+void SurfaceScan::run(unsigned int depth)
+	throw (error)
+{
+	ScanRegion empty;
+	empty.reads = 0;
+	empty.totalLatency = 0;
+	empty.maxLatency = 0;
+	empty.retried = 0;
+	empty.failed = 0;
+	empty.slow = false;
+	block_t count = this->endBlock - this->firstBlock;
+	this->regions.assign(
+		(count + SCAN_REGION_BLOCKS - 1) / SCAN_REGION_BLOCKS, empty);
+	this->badSectors.clear();
+
+	IOQueue queue(this->dev, depth, DATA_BLOCK_SIZE);
+	ScanJob job(this);
+	this->cb->readStart(0, count);
+	this->progress.start(false, 0);
+	this->cbSink.start(0, count, 0);
+	double tmStart = monotonicTime();
+	queue.run(&job);
+	this->duration = monotonicTime() - tmStart;
+	this->progress.flush();
+	if (job.aborted) throw error("Surface scan aborted");
+	this->cb->readProgress(count - 1, false); // signal 100%
+	this->cb->readFinish();
+
+	this->badSectors.sort();
+	this->analyse();
+	return;
+}
+
+void SurfaceScan::analyse()
+	throw ()
+{
+	std::vector<double> means;
+	for (std::vector<ScanRegion>::const_iterator
+		i = this->regions.begin(); i != this->regions.end(); i++
+	) {
+		if (i->reads) means.push_back(i->meanLatency());
+	}
+	double median = 0;
+	if (!means.empty()) {
+		std::nth_element(means.begin(), means.begin() + means.size() / 2,
+			means.end());
+		median = means[means.size() / 2];
+	}
+	for (std::vector<ScanRegion>::iterator
+		i = this->regions.begin(); i != this->regions.end(); i++
+	) {
+		i->slow = (i->maxLatency > SCAN_STALL_TIME)
+			|| (i->reads && (i->meanLatency() > median * SCAN_SLOW_FACTOR));
+	}
+	return;
+}
+
+void SurfaceScan::report(std::ostream& out) const
+	throw ()
+{
+	block_t count = this->endBlock - this->firstBlock;
+	if (this->duration > 0) {
+		out << "Read " << count * DATA_BLOCK_SIZE / 1048576 << "MB in "
+			<< (unsigned long)this->duration << " seconds, "
+			<< (unsigned long)(count * (DATA_BLOCK_SIZE / 1024)
+				/ this->duration) << "kB/sec\n";
+	}
+
+	out << "\nSpeed map, " << SCAN_REGION_BLOCKS * DATA_BLOCK_SIZE / 1048576
+		<< "MB per character (. ok, S slow, R needed retries, X unreadable):\n";
+	for (unsigned int i = 0; i < this->regions.size(); i++) {
+		if ((i % SCAN_MAP_WIDTH) == 0) {
+			if (i) out << '\n';
+			out << std::setw(8) << (this->firstBlock + (block_t)i * SCAN_REGION_BLOCKS)
+				* DATA_BLOCK_SIZE / 1048576 << "MB ";
+		}
+		const ScanRegion& r = this->regions[i];
+		if (r.failed) out << 'X';
+		else if (r.retried) out << 'R';
+		else if (r.slow) out << 'S';
+		else out << '.';
+	}
+	out << "\n\n";
+
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < this->regions.size(); i++) {
+		const ScanRegion& r = this->regions[i];
+		if (!r.slow && !r.retried && !r.failed) continue;
+		if (n == 0) out << "Problem regions:\n";
+		if (n++ == EXTENT_REPORT_MAX) {
+			out << "  ...and more\n";
+			break;
+		}
+		block_t start = (this->firstBlock + (block_t)i * SCAN_REGION_BLOCKS)
+			* DATA_BLOCK_SIZE;
+		block_t end = start + SCAN_REGION_BLOCKS * DATA_BLOCK_SIZE;
+		if (end > this->endBlock * DATA_BLOCK_SIZE) {
+			end = this->endBlock * DATA_BLOCK_SIZE;
+		}
+		out << "  Bytes " << start << '-' << end - 1 << ": average "
+			<< (unsigned long)(r.meanLatency() * 1000000) << "us, worst "
+			<< (unsigned long)(r.maxLatency * 1000000) << "us per read";
+		if (r.retried) out << ", " << r.retried << " blocks needed retries";
+		if (r.failed) out << ", " << r.failed << " blocks unreadable";
+		out << '\n';
+	}
+	if (n == 0) out << "No slow or unreliable regions found.\n";
+
+	if (!this->badSectors.empty()) {
+		out << this->badSectors.count() << " unreadable sectors in total:\n";
+		this->badSectors.report(out, SECTOR_SIZE);
+	}
+	return;
+}
+
+bool SurfaceScan::failed() const
+	throw ()
+{
+	return !this->badSectors.empty();
+}
@@ -0,0 +1,141 @@
+/**
+ * @file  surface.hpp
+ * @brief Read-only scan of a device, timing every read.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SURFACE_HPP_
+#define SURFACE_HPP_
+
+#include <vector>
+#include <ostream>
+#include "device.hpp"
+#include "error.hpp"
+#include "check.hpp"
+#include "extent.hpp"
+
+/// Number of blocks in each region of the speed map (64MB).
+#define SCAN_REGION_BLOCKS 2048
+
+/// Number of times to retry a block that could not be read.
+#define SCAN_RETRIES 3
+
+/// A region is slow if its average read takes this many times the median.
+#define SCAN_SLOW_FACTOR 4
+
+/// A region is slow if any single read in it takes this many seconds.
+#define SCAN_STALL_TIME 1.0
+
+/// Default number of reads to keep outstanding.
+#define SCAN_DEFAULT_DEPTH 32
+
+/// Number of regions shown on each line of the speed map.
+#define SCAN_MAP_WIDTH 64
+
+/// Read timing and errors for one region of the device.
+struct ScanRegion
+{
+	unsigned long reads;   ///< Number of successful reads
+	double totalLatency;   ///< Sum of the time taken by successful reads
+	double maxLatency;     ///< Longest single read, including failures
+	unsigned long retried; ///< Blocks that failed at least once, then read
+	unsigned long failed;  ///< Blocks that could not be read at all
+	bool slow;             ///< Set by SurfaceScan::analyse()
+
+	/// Average time taken by each successful read, in seconds.
+	double meanLatency() const
+		throw ();
+};
+
+/// Read every block on a device without changing anything.
+/**
+ * This is for checking a card that is already in use, so it only ever reads.
+ * Blocks are read through an IOQueue so a deep queue can be kept outstanding,
+ * and every read is timed.  Blocks that fail are retried before being written
+ * off, since a block that needs retries is likely to fail soon anyway.
+ *
+ * The contents of the device are unknown, so there is no verification of the
+ * data itself.  Progress and read errors go through the same CheckCallback as
+ * Check::read(), batched the same way, so the UI's handling of runs of read
+ * errors still applies.
+ */
+class SurfaceScan
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device to scan.  It is never written to.
+		 *
+		 * @param cb
+		 *   Who to notify about progress and read errors.
+		 */
+		SurfaceScan(Device *dev, CheckCallback *cb)
+			throw (error);
+
+		~SurfaceScan()
+			throw ();
+
+		/// Only scan part of the device.
+		/**
+		 * @param firstBlock
+		 *   First block to read.
+		 *
+		 * @param count
+		 *   Number of blocks to read.
+		 *
+		 * @throw error if the range does not fit on the device.
+		 */
+		void setRange(block_t firstBlock, block_t count)
+			throw (error);
+
+		/// Read every block in the range, the whole device by default.
+		/**
+		 * @param depth
+		 *   Number of reads to keep outstanding.
+		 */
+		void run(unsigned int depth)
+			throw (error);
+
+		/// Write the speed map and a list of problem regions.
+		void report(std::ostream& out) const
+			throw ();
+
+		/// Were there any blocks that could not be read at all?
+		bool failed() const
+			throw ();
+
+	protected:
+		Device *dev;        ///< Device being scanned
+		CheckCallback *cb;  ///< Who to notify about events
+		CheckCallbackSink cbSink; ///< Passes batched progress on to cb
+		ProgressBatcher progress; ///< Collects the outcome of each block
+		block_t numBlocks;  ///< Size of device, in blocks
+		block_t firstBlock; ///< First block to read
+		block_t endBlock;   ///< One past the last block to read
+		std::vector<ScanRegion> regions; ///< Timing for each region, from firstBlock
+		ExtentList badSectors; ///< Blocks that could not be read
+		double duration;    ///< Time taken by run(), in seconds
+
+		friend class ScanJob;
+
+		/// Flag regions that are much slower than the rest of the device.
+		void analyse()
+			throw ();
+};
+
+#endif // SURFACE_HPP_
@@ -0,0 +1,222 @@
+/**
+ * @file  trace.cpp
+ * @brief Device that records every operation to a trace file.
+ *
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include "trace.hpp"
+#include "queue.hpp"
+#include "pattern.hpp"
+
+TraceDevice::TraceDevice(Device *dev, const char *path)
+	throw (error)
+	: dev(dev),
+	  trace(path, dev->size()),
+	  tmStart(monotonicTime()),
+	  pos(0)
+{
+	if (pthread_mutex_init(&this->lock, NULL) != 0) {
+		throw error("Unable to create mutex");
+	}
+}
+
+TraceDevice::~TraceDevice()
+	throw ()
+{
+	pthread_mutex_destroy(&this->lock);
+	delete this->dev;
+}
+
+void TraceDevice::open(const char *path)
+	throw (error)
+{
+	this->dev->open(path);
+	return;
+}
+
+void TraceDevice::close()
+	throw (error)
+{
+	this->dev->close();
+	return;
+}
+
+void TraceDevice::reopen()
+	throw (error)
+{
+	this->dev->reopen();
+	return;
+}
+
+block_t TraceDevice::size()
+	throw (error)
+{
+	return this->dev->size();
+}
+
+void TraceDevice::seek(block_t off)
+	throw (error)
+{
+	this->dev->seek(off);
+	this->pos = off;
+	return;
+}
+
+void TraceDevice::write(uint8_t *buf, unsigned int len)
+	throw (error)
+{
+	block_t off = this->pos;
+	this->pos += len;
+	double start = monotonicTime();
+	try {
+		this->dev->write(buf, len);
+	} catch (const error&) {
+		// The exception does not say why, so record a generic I/O error
+		this->record(TRACE_WRITE, off, len, start, EIO, NULL);
+		throw;
+	}
+	this->record(TRACE_WRITE, off, len, start, 0, NULL);
+	return;
+}
+
+void TraceDevice::read(uint8_t *buf, unsigned int len)
+	throw (error)
+{
+	block_t off = this->pos;
+	this->pos += len;
+	double start = monotonicTime();
+	try {
+		this->dev->read(buf, len);
+	} catch (const error&) {
+		this->record(TRACE_READ, off, len, start, EIO, NULL);
+		throw;
+	}
+	this->record(TRACE_READ, off, len, start, 0, buf);
+	return;
+}
+
+void TraceDevice::writeAt(uint8_t *buf, unsigned int len, block_t off)
+	throw (error)
+{
+	double start = monotonicTime();
+	try {
+		this->dev->writeAt(buf, len, off);
+	} catch (const error&) {
+		this->record(TRACE_WRITE, off, len, start, EIO, NULL);
+		throw;
+	}
+	this->record(TRACE_WRITE, off, len, start, 0, NULL);
+	return;
+}
+
+void TraceDevice::readAt(uint8_t *buf, unsigned int len, block_t off)
+	throw (error)
+{
+	double start = monotonicTime();
+	try {
+		this->dev->readAt(buf, len, off);
+	} catch (const error&) {
+		this->record(TRACE_READ, off, len, start, EIO, NULL);
+		throw;
+	}
+	this->record(TRACE_READ, off, len, start, 0, buf);
+	return;
+}
+
+int TraceDevice::tryWrite(uint8_t *buf, unsigned int len)
+	throw ()
+{
+	block_t off = this->pos;
+	this->pos += len;
+	double start = monotonicTime();
+	int err = this->dev->tryWrite(buf, len);
+	this->record(TRACE_WRITE, off, len, start, err, NULL);
+	return err;
+}
+
+int TraceDevice::tryRead(uint8_t *buf, unsigned int len)
+	throw ()
+{
+	block_t off = this->pos;
+	this->pos += len;
+	double start = monotonicTime();
+	int err = this->dev->tryRead(buf, len);
+	this->record(TRACE_READ, off, len, start, err, buf);
+	return err;
+}
+
+int TraceDevice::tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+	throw ()
+{
+	double start = monotonicTime();
+	int err = this->dev->tryWriteAt(buf, len, off);
+	this->record(TRACE_WRITE, off, len, start, err, NULL);
+	return err;
+}
+
+int TraceDevice::tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+	throw ()
+{
+	double start = monotonicTime();
+	int err = this->dev->tryReadAt(buf, len, off);
+	this->record(TRACE_READ, off, len, start, err, buf);
+	return err;
+}
+
+void TraceDevice::sync()
+	throw (error)
+{
+	double start = monotonicTime();
+	try {
+		this->dev->sync();
+	} catch (const error&) {
+		this->record(TRACE_SYNC, 0, 0, start, EIO, NULL);
+		throw;
+	}
+	this->record(TRACE_SYNC, 0, 0, start, 0, NULL);
+	pthread_mutex_lock(&this->lock);
+	this->trace.flush();
+	pthread_mutex_unlock(&this->lock);
+	return;
+}
+
+void TraceDevice::record(TraceOp op, block_t off, unsigned int len,
+	double start, int result, const uint8_t *data)
+	throw ()
+{
+	double end = monotonicTime();
+	TraceRecord rec;
+	rec.op = op;
+	rec.start = (uint64_t)((start - this->tmStart) * 1000000);
+	rec.offset = off;
+	rec.length = len;
+	rec.latency = (uint64_t)((end - start) * 1000000);
+	rec.result = result;
+	rec.header = false;
+	rec.sector = 0;
+	rec.key = 0;
+	if (data && !result && (len >= SECTOR_SIZE)) {
+		// Only worth keeping if it really is test data
+		rec.header = Pattern::decode(data, &rec.sector, &rec.key);
+	}
+	pthread_mutex_lock(&this->lock);
+	this->trace.add(rec);
+	pthread_mutex_unlock(&this->lock);
+	return;
+}
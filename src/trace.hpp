@@ -0,0 +1,134 @@
+/**
+ * @file  trace.hpp
+ * @brief Device that records every operation to a trace file.
+ *
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_HPP_
+#define TRACE_HPP_
+
+#include <pthread.h>
+#include "device.hpp"
+#include "error.hpp"
+#include "tracefile.hpp"
+
+/// Device that passes everything through to another, logging each transfer.
+/**
+ * Every read, write and sync is timed and added to a TraceWriter, with its
+ * offset, length and result, so what the device did can be worked out later
+ * with scanflash-trace.  Reads that return intact test data also note which
+ * sector the data was written for, so a replay can hand back the same
+ * misplaced data.  Records are encoded into a memory buffer and only written
+ * out a megabyte or a second at a time, or when the device is synced, so
+ * tracing adds very little to each operation and little is lost if the run
+ * is interrupted.
+ */
+class TraceDevice: virtual public Device
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param dev
+		 *   Device to pass operations on to.  It must already be open, and is
+		 *   deleted along with this one.
+		 *
+		 * @param path
+		 *   Trace file to create.
+		 */
+		TraceDevice(Device *dev, const char *path)
+			throw (error);
+
+		virtual ~TraceDevice()
+			throw ();
+
+		virtual void open(const char *path)
+			throw (error);
+
+		virtual void close()
+			throw (error);
+
+		virtual void reopen()
+			throw (error);
+
+		virtual block_t size()
+			throw (error);
+
+		virtual void seek(block_t off)
+			throw (error);
+
+		virtual void write(uint8_t *buf, unsigned int len)
+			throw (error);
+
+		virtual void read(uint8_t *buf, unsigned int len)
+			throw (error);
+
+		virtual void writeAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (error);
+
+		virtual void readAt(uint8_t *buf, unsigned int len, block_t off)
+			throw (error);
+
+		virtual int tryWrite(uint8_t *buf, unsigned int len)
+			throw ();
+
+		virtual int tryRead(uint8_t *buf, unsigned int len)
+			throw ();
+
+		virtual int tryWriteAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
+		virtual int tryReadAt(uint8_t *buf, unsigned int len, block_t off)
+			throw ();
+
+		/// Flush the device, then write out the trace so far.
+		virtual void sync()
+			throw (error);
+
+	protected:
+		Device *dev;          ///< Device doing the work
+		TraceWriter trace;    ///< Where records go
+		double tmStart;       ///< Time the trace started
+		block_t pos;          ///< Seek position, for read() and write()
+		pthread_mutex_t lock; ///< Protects trace
+
+		/// Add an operation to the trace.
+		/**
+		 * @param op
+		 *   Kind of operation.
+		 *
+		 * @param off
+		 *   Byte offset of the transfer.
+		 *
+		 * @param len
+		 *   Length of the transfer.
+		 *
+		 * @param start
+		 *   Time the operation started.
+		 *
+		 * @param result
+		 *   0 on success, otherwise an errno value.
+		 *
+		 * @param data
+		 *   Data read back, to note the header of its first sector, or NULL.
+		 */
+		void record(TraceOp op, block_t off, unsigned int len, double start,
+			int result, const uint8_t *data)
+			throw ();
+};
+
+#endif // TRACE_HPP_
@@ -0,0 +1,258 @@
+/**
+ * @file  tracefile.cpp
+ * @brief Compact binary record of every I/O sent to a device.
+ *
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include "tracefile.hpp"
+#include "pattern.hpp"
+
+/// Append an unsigned variable length integer, seven bits per byte.
+static void putVarint(std::vector<uint8_t> *buf, uint64_t v)
+	throw ()
+{
+	while (v >= 0x80) {
+		buf->push_back((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	buf->push_back((uint8_t)v);
+	return;
+}
+
+/// Map a signed value to an unsigned one, keeping small negatives small.
+static uint64_t zigzag(int64_t v)
+	throw ()
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+/// Undo zigzag().
+static int64_t unzigzag(uint64_t v)
+	throw ()
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/// Record state before the first record, shared by the writer and reader.
+static void resetRecord(TraceRecord *rec)
+	throw ()
+{
+	rec->op = TRACE_READ;
+	rec->start = 0;
+	rec->offset = 0;
+	rec->length = 0;
+	rec->latency = 0;
+	rec->result = 0;
+	rec->header = false;
+	rec->sector = 0;
+	rec->key = 0;
+	return;
+}
+
+TraceWriter::TraceWriter(const char *path, block_t deviceSize)
+	throw (error)
+	: lastFlush(0),
+	  failed(false)
+{
+	this->f = fopen(path, "wb");
+	if (!this->f) {
+		throw error(std::string("Unable to create ") + path + ": "
+			+ strerror(errno));
+	}
+	resetRecord(&this->last);
+	this->buf.reserve(TRACE_BUFFER_SIZE + 64);
+	const char magic[] = TRACE_MAGIC;
+	this->buf.insert(this->buf.end(), magic, magic + sizeof(magic) - 1);
+	this->buf.push_back(TRACE_VERSION);
+	putVarint(&this->buf, time(NULL));
+	putVarint(&this->buf, deviceSize);
+	if (!this->flush()) {
+		fclose(this->f);
+		throw error(std::string("Unable to write to ") + path + ": "
+			+ strerror(errno));
+	}
+}
+
+TraceWriter::~TraceWriter()
+	throw ()
+{
+	this->flush();
+	fclose(this->f);
+}
+
+void TraceWriter::add(const TraceRecord& rec)
+	throw ()
+{
+	if (this->failed) return;
+
+	uint8_t flags = rec.op & TRACE_FLAG_OP;
+	bool transfer = (rec.op != TRACE_SYNC);
+	block_t lastEnd = this->last.offset + this->last.length;
+	if (rec.result != 0) flags |= TRACE_FLAG_FAILED;
+	if (rec.header) flags |= TRACE_FLAG_HEADER;
+	if (!transfer || (rec.length == this->last.length)) {
+		flags |= TRACE_FLAG_SAME_LENGTH;
+	}
+	if (!transfer || (rec.offset == lastEnd)) flags |= TRACE_FLAG_CONTIGUOUS;
+
+	this->buf.push_back(flags);
+	putVarint(&this->buf, zigzag(rec.start - this->last.start));
+	if (!(flags & TRACE_FLAG_CONTIGUOUS)) {
+		putVarint(&this->buf, zigzag(rec.offset - lastEnd));
+	}
+	if (!(flags & TRACE_FLAG_SAME_LENGTH)) putVarint(&this->buf, rec.length);
+	putVarint(&this->buf, rec.latency);
+	if (flags & TRACE_FLAG_FAILED) putVarint(&this->buf, rec.result);
+	if (flags & TRACE_FLAG_HEADER) {
+		putVarint(&this->buf, zigzag(rec.sector - rec.offset / SECTOR_SIZE));
+		putVarint(&this->buf, rec.key ^ this->last.key);
+		this->last.key = rec.key;
+	}
+
+	this->last.start = rec.start;
+	if (transfer) {
+		this->last.offset = rec.offset;
+		this->last.length = rec.length;
+	}
+	if ((this->buf.size() >= TRACE_BUFFER_SIZE)
+		|| (rec.start >= this->lastFlush + TRACE_FLUSH_INTERVAL)
+	) {
+		this->flush();
+		this->lastFlush = rec.start;
+	}
+	return;
+}
+
+bool TraceWriter::flush()
+	throw ()
+{
+	if (!this->failed && !this->buf.empty()) {
+		if ((fwrite(&this->buf[0], this->buf.size(), 1, this->f) != 1)
+			|| (fflush(this->f) != 0)
+		) {
+			this->failed = true;
+		}
+	}
+	this->buf.clear();
+	return !this->failed;
+}
+
+TraceReader::TraceReader(const char *path)
+	throw (error)
+{
+	this->f = fopen(path, "rb");
+	if (!this->f) {
+		throw error(std::string("Unable to open ") + path + ": " + strerror(errno));
+	}
+	resetRecord(&this->last);
+	const char magic[] = TRACE_MAGIC;
+	char header[sizeof(magic)];
+	try {
+		if ((fread(header, sizeof(header), 1, this->f) != 1)
+			|| (memcmp(header, magic, sizeof(magic) - 1) != 0)
+		) {
+			throw error(std::string(path) + " is not a scanflash trace");
+		}
+		if (header[sizeof(magic) - 1] != TRACE_VERSION) {
+			throw error(std::string(path) + " is from a different version of "
+				"scanflash");
+		}
+		this->tmStart = this->readVarint();
+		this->size = this->readVarint();
+	} catch (const error&) {
+		fclose(this->f);
+		throw;
+	}
+}
+
+TraceReader::~TraceReader()
+	throw ()
+{
+	fclose(this->f);
+}
+
+block_t TraceReader::deviceSize() const
+	throw ()
+{
+	return this->size;
+}
+
+time_t TraceReader::startTime() const
+	throw ()
+{
+	return this->tmStart;
+}
+
+bool TraceReader::next(TraceRecord *rec)
+	throw (error)
+{
+	int flags = getc(this->f);
+	if (flags == EOF) return false;
+	if ((flags & ~(TRACE_FLAG_OP | TRACE_FLAG_FAILED | TRACE_FLAG_SAME_LENGTH
+		| TRACE_FLAG_CONTIGUOUS | TRACE_FLAG_HEADER))
+		|| ((flags & TRACE_FLAG_OP) > TRACE_SYNC)
+	) {
+		throw error("Trace is damaged: unknown record type");
+	}
+	rec->op = (TraceOp)(flags & TRACE_FLAG_OP);
+	bool transfer = (rec->op != TRACE_SYNC);
+	block_t lastEnd = this->last.offset + this->last.length;
+
+	rec->start = this->last.start + unzigzag(this->readVarint());
+	rec->offset = lastEnd;
+	if (!(flags & TRACE_FLAG_CONTIGUOUS)) {
+		rec->offset += unzigzag(this->readVarint());
+	}
+	rec->length = this->last.length;
+	if (!(flags & TRACE_FLAG_SAME_LENGTH)) rec->length = this->readVarint();
+	rec->latency = this->readVarint();
+	rec->result = (flags & TRACE_FLAG_FAILED) ? this->readVarint() : 0;
+	rec->header = (flags & TRACE_FLAG_HEADER) != 0;
+	rec->sector = 0;
+	rec->key = 0;
+	if (rec->header) {
+		rec->sector = rec->offset / SECTOR_SIZE + unzigzag(this->readVarint());
+		rec->key = this->last.key ^ this->readVarint();
+		this->last.key = rec->key;
+	}
+
+	this->last.start = rec->start;
+	if (transfer) {
+		this->last.offset = rec->offset;
+		this->last.length = rec->length;
+	} else {
+		rec->offset = 0;
+		rec->length = 0;
+	}
+	return true;
+}
+
+uint64_t TraceReader::readVarint()
+	throw (error)
+{
+	uint64_t v = 0;
+	for (unsigned int shift = 0; shift < 64; shift += 7) {
+		int c = getc(this->f);
+		if (c == EOF) throw error("Trace ends part way through a record");
+		v |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) return v;
+	}
+	throw error("Trace is damaged: number too long");
+}
@@ -0,0 +1,190 @@
+/**
+ * @file  tracefile.hpp
+ * @brief Compact binary record of every I/O sent to a device.
+ *
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACEFILE_HPP_
+#define TRACEFILE_HPP_
+
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include "device.hpp"
+#include "error.hpp"
+
+/// First bytes of every trace file, followed by TRACE_VERSION.
+#define TRACE_MAGIC "SFTRACE"
+
+/// Format version, bumped whenever the record layout changes.
+#define TRACE_VERSION 2
+
+/// Bytes of encoded records kept in memory before they are written out.
+#define TRACE_BUFFER_SIZE 1048576
+
+/// Longest time records are kept in memory before they are written out, in
+/// microseconds, so little is lost if scanflash is killed.
+#define TRACE_FLUSH_INTERVAL 1000000
+
+/// Bits of a record's flags byte holding the TraceOp.
+#define TRACE_FLAG_OP          0x03
+
+/// The operation failed, and the errno value follows the latency.
+#define TRACE_FLAG_FAILED      0x04
+
+/// The length is the same as the last transfer's, and is left out.
+#define TRACE_FLAG_SAME_LENGTH 0x08
+
+/// The offset is where the last transfer ended, and is left out.
+#define TRACE_FLAG_CONTIGUOUS  0x10
+
+/// The read returned intact test data, and its first sector's header follows.
+#define TRACE_FLAG_HEADER      0x20
+
+/// Kind of operation a TraceRecord describes.
+enum TraceOp {
+	TRACE_READ  = 0, ///< Data read from the device
+	TRACE_WRITE = 1, ///< Data written to the device
+	TRACE_SYNC  = 2, ///< Cached data flushed to the device
+};
+
+/// One operation sent to the device.
+struct TraceRecord
+{
+	TraceOp op;
+	uint64_t start;      ///< Microseconds from the start of the trace
+	block_t offset;      ///< Byte offset, or 0 for TRACE_SYNC
+	unsigned int length; ///< Bytes transferred, or 0 for TRACE_SYNC
+	uint64_t latency;    ///< Microseconds the operation took
+	int result;          ///< 0 on success, otherwise an errno value
+	bool header;         ///< Are sector and key valid?
+	block_t sector;      ///< Sector number in the first sector read back
+	uint64_t key;        ///< Pattern key in the first sector read back
+};
+
+/// Write trace records to a file.
+/**
+ * Each record is stored relative to the one before it, with every number as
+ * a variable length integer, so sequential transfers of the same size take
+ * about six bytes each and a trace of a whole device stays small.  After the
+ * header, a record is a flags byte followed by:
+ *
+ *  - the start time minus the last record's start time (zigzag encoded, as
+ *    records from several threads can be written out of order),
+ *  - unless TRACE_FLAG_CONTIGUOUS is set, the offset minus the end of the
+ *    last transfer (zigzag encoded),
+ *  - unless TRACE_FLAG_SAME_LENGTH is set, the length,
+ *  - the latency,
+ *  - if TRACE_FLAG_FAILED is set, the errno value,
+ *  - if TRACE_FLAG_HEADER is set, the sector number from the header minus
+ *    the sector at the offset (zigzag encoded), then the key XORed with the
+ *    last key recorded.
+ *
+ * TRACE_SYNC records have no offset or length, and leave them unchanged for
+ * the next record.
+ *
+ * Not thread safe; callers must serialise calls to add().
+ */
+class TraceWriter
+{
+	public:
+		/// Create a new trace file, replacing any existing one.
+		/**
+		 * @param path
+		 *   Filename to write to.
+		 *
+		 * @param deviceSize
+		 *   Size in bytes of the device being traced, stored in the header.
+		 */
+		TraceWriter(const char *path, block_t deviceSize)
+			throw (error);
+
+		/// Write out anything still buffered and close the file.
+		~TraceWriter()
+			throw ();
+
+		/// Add one operation to the trace.
+		/**
+		 * Records are written out once TRACE_BUFFER_SIZE bytes are waiting, or
+		 * once rec.start is TRACE_FLUSH_INTERVAL past the last time they were.
+		 */
+		void add(const TraceRecord& rec)
+			throw ();
+
+		/// Write out all buffered records.
+		/**
+		 * Once writing to the file fails, later records are dropped instead of
+		 * reporting the error on every operation.
+		 *
+		 * @return false if the trace is incomplete because a write failed.
+		 */
+		bool flush()
+			throw ();
+
+	protected:
+		FILE *f;                  ///< Trace file
+		std::vector<uint8_t> buf; ///< Records not yet written out
+		TraceRecord last;         ///< Previous record, for the deltas
+		uint64_t lastFlush;       ///< Start time of the record last written out
+		bool failed;              ///< Has writing to the file failed?
+};
+
+/// Read trace records back from a file, one at a time.
+/**
+ * Only a small buffer is kept, so traces of any size can be read.
+ */
+class TraceReader
+{
+	public:
+		/// Open a trace file and read its header.
+		TraceReader(const char *path)
+			throw (error);
+
+		~TraceReader()
+			throw ();
+
+		/// Size of the traced device in bytes, from the header.
+		block_t deviceSize() const
+			throw ();
+
+		/// Time the trace was started, from the header.
+		time_t startTime() const
+			throw ();
+
+		/// Read the next record.
+		/**
+		 * @return true if a record was read, false at the end of the file.
+		 *
+		 * @throw error if the file is corrupted, or ends part way through a
+		 *   record (e.g. the trace was cut short by a crash).
+		 */
+		bool next(TraceRecord *rec)
+			throw (error);
+
+	protected:
+		FILE *f;            ///< Trace file
+		block_t size;       ///< Device size from the header
+		time_t tmStart;     ///< Wall clock time from the header
+		TraceRecord last;   ///< Previous record, for the deltas
+
+		/// Read a variable length integer.
+		uint64_t readVarint()
+			throw (error);
+};
+
+#endif // TRACEFILE_HPP_
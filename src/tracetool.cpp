@@ -0,0 +1,398 @@
+/**
+ * @file  tracetool.cpp
+ * @brief Summarise a trace recorded with scanflash --trace.
+ *
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <getopt.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tracefile.hpp"
+#include "latency.hpp"
+#include "pattern.hpp"
+
+/// Default number of rows in the latency-by-offset map.
+#define TRACE_DEFAULT_ROWS 32
+
+/// Default latency, in seconds, for an operation to count as a stall.
+#define TRACE_DEFAULT_STALL 1.0
+
+/// Number of stalls listed individually.
+#define TRACE_STALL_LIST 20
+
+enum ReturnCodes {
+	RET_OK        = 0, ///< Trace read in full
+	RET_BAD_ARGS  = 1, ///< Invalid command line
+	RET_NO_OPEN   = 2, ///< Unable to open the trace
+	RET_DAMAGED   = 3, ///< Trace was cut short or damaged, partial results shown
+};
+
+/// Totals for one kind of operation.
+struct OpStats
+{
+	unsigned long count;   ///< Operations
+	unsigned long failed;  ///< Operations that returned an error
+	unsigned long aliased; ///< Reads that returned data for another sector
+	block_t bytes;         ///< Bytes transferred by successful operations
+	double busy;           ///< Total time spent in successful operations
+	LatencyHistogram hist; ///< Latency of successful operations
+
+	OpStats()
+		throw ()
+		: count(0),
+		  failed(0),
+		  aliased(0),
+		  bytes(0),
+		  busy(0)
+	{
+	}
+};
+
+/// Latency of the transfers to one part of the device.
+struct OffsetRow
+{
+	unsigned long reads;   ///< Reads starting in this part
+	double readTotal;      ///< Sum of their latencies
+	double readMax;        ///< Slowest of them
+	unsigned long writes;  ///< Writes starting in this part
+	double writeTotal;     ///< Sum of their latencies
+	double writeMax;       ///< Slowest of them
+};
+
+/// Collect statistics from each record of a trace in turn.
+class TraceStats
+{
+	public:
+		/// Constructor.
+		/**
+		 * @param deviceSize
+		 *   Size of the traced device, in bytes.
+		 *
+		 * @param rows
+		 *   Number of equal parts to split the device into for the map.
+		 *
+		 * @param stall
+		 *   Latency, in seconds, for an operation to count as a stall.
+		 */
+		TraceStats(block_t deviceSize, unsigned int rows, double stall)
+			throw ()
+			: deviceSize(deviceSize),
+			  stall(stall),
+			  stalls(0),
+			  duration(0)
+		{
+			this->rowSize = deviceSize / rows + 1;
+			OffsetRow empty;
+			memset(&empty, 0, sizeof(empty));
+			this->map.assign(rows, empty);
+		}
+
+		/// Add one record.
+		void add(const TraceRecord& rec)
+			throw ()
+		{
+			double latency = rec.latency / 1000000.0;
+			double end = (rec.start + rec.latency) / 1000000.0;
+			if (end > this->duration) this->duration = end;
+			if (latency >= this->stall) {
+				if (this->stalls < TRACE_STALL_LIST) this->stallList.push_back(rec);
+				this->stalls++;
+			}
+
+			OpStats& op = this->ops[rec.op];
+			op.count++;
+			if (rec.result != 0) {
+				op.failed++;
+				return;
+			}
+			if (rec.header && (rec.sector != rec.offset / SECTOR_SIZE)) op.aliased++;
+			op.bytes += rec.length;
+			op.busy += latency;
+			op.hist.add(latency);
+
+			if (rec.op == TRACE_SYNC) return;
+			block_t row = rec.offset / this->rowSize;
+			if (row >= this->map.size()) row = this->map.size() - 1;
+			OffsetRow& r = this->map[row];
+			if (rec.op == TRACE_READ) {
+				r.reads++;
+				r.readTotal += latency;
+				if (latency > r.readMax) r.readMax = latency;
+			} else {
+				r.writes++;
+				r.writeTotal += latency;
+				if (latency > r.writeMax) r.writeMax = latency;
+			}
+			return;
+		}
+
+		/// Write out the results.
+		void report(std::ostream& out) const
+			throw ()
+		{
+			out << "Trace covers " << std::fixed << std::setprecision(1)
+				<< this->duration << " seconds\n\n";
+			this->reportOp(out, "Reads:  ", this->ops[TRACE_READ]);
+			this->reportOp(out, "Writes: ", this->ops[TRACE_WRITE]);
+			this->reportOp(out, "Syncs:  ", this->ops[TRACE_SYNC]);
+			this->reportHistogram(out);
+			this->reportMap(out);
+			this->reportStalls(out);
+			return;
+		}
+
+	protected:
+		block_t deviceSize;     ///< Size of the traced device
+		block_t rowSize;        ///< Bytes covered by each map row
+		double stall;           ///< Latency that counts as a stall
+		OpStats ops[TRACE_SYNC + 1]; ///< Totals for each TraceOp
+		std::vector<OffsetRow> map; ///< Latency over each part of the device
+		std::vector<TraceRecord> stallList; ///< First few stalls
+		unsigned long stalls;   ///< Number of stalls
+		double duration;        ///< Time the last operation finished
+
+		/// Totals and percentiles for one kind of operation.
+		void reportOp(std::ostream& out, const char *title, const OpStats& op) const
+			throw ()
+		{
+			out << title << op.count;
+			if (op.count == 0) {
+				out << "\n";
+				return;
+			}
+			if (op.bytes) {
+				out << " (" << op.bytes / 1048576 << "MB";
+				if (op.busy > 0) {
+					out << ", " << (unsigned long)(op.bytes / 1024 / op.busy)
+						<< "kB/sec while busy";
+				}
+				out << ')';
+			}
+			if (op.failed) out << ", " << op.failed << " failed";
+			if (op.aliased) {
+				out << ", " << op.aliased << " returned another sector's data";
+			}
+			out << "\n";
+			if (op.hist.count()) {
+				out << "        latency median " << latencyText(op.hist.percentile(0.5))
+					<< ", 99th percentile " << latencyText(op.hist.percentile(0.99))
+					<< ", worst " << latencyText(op.hist.max()) << "\n";
+			}
+			return;
+		}
+
+		/// Number of reads and writes in each doubling of latency.
+		void reportHistogram(std::ostream& out) const
+			throw ()
+		{
+			const LatencyHistogram& rd = this->ops[TRACE_READ].hist;
+			const LatencyHistogram& wr = this->ops[TRACE_WRITE].hist;
+			if (!rd.count() && !wr.count()) return;
+
+			// Merge each doubling into one row, and skip the empty ones at
+			// either end
+			std::vector<unsigned long> reads, writes;
+			for (unsigned int b = 0; b < LATENCY_BUCKETS; b++) {
+				unsigned int row = (b + LATENCY_BUCKETS_PER_DOUBLING - 1)
+					/ LATENCY_BUCKETS_PER_DOUBLING;
+				if (row >= reads.size()) {
+					reads.resize(row + 1, 0);
+					writes.resize(row + 1, 0);
+				}
+				reads[row] += rd.bucket(b);
+				writes[row] += wr.bucket(b);
+			}
+			unsigned int first = 0, last = reads.size() - 1;
+			while (!reads[first] && !writes[first]) first++;
+			while (!reads[last] && !writes[last]) last--;
+
+			out << "\nLatency histogram:\n"
+				"     up to       reads      writes\n";
+			for (unsigned int row = first; row <= last; row++) {
+				out << std::setw(10) << latencyText(LatencyHistogram::bucketEdge(
+						row * LATENCY_BUCKETS_PER_DOUBLING))
+					<< std::setw(12) << reads[row]
+					<< std::setw(12) << writes[row] << "\n";
+			}
+			return;
+		}
+
+		/// Average and worst latency for each part of the device.
+		void reportMap(std::ostream& out) const
+			throw ()
+		{
+			out << "\nLatency by offset, " << this->rowSize / 1048576
+				<< "MB per row (average / worst):\n"
+				"     offset               reads              writes\n";
+			for (unsigned int i = 0; i < this->map.size(); i++) {
+				const OffsetRow& r = this->map[i];
+				out << std::setw(9) << (block_t)i * this->rowSize / 1048576 << "MB ";
+				if (r.reads) {
+					out << std::setw(9) << latencyText(r.readTotal / r.reads) << " / "
+						<< std::setw(7) << latencyText(r.readMax);
+				} else {
+					out << std::setw(19) << '-';
+				}
+				if (r.writes) {
+					out << std::setw(10) << latencyText(r.writeTotal / r.writes) << " / "
+						<< std::setw(7) << latencyText(r.writeMax);
+				} else {
+					out << std::setw(20) << '-';
+				}
+				out << "\n";
+			}
+			return;
+		}
+
+		/// Operations that took longer than the stall threshold.
+		void reportStalls(std::ostream& out) const
+			throw ()
+		{
+			out << "\n";
+			if (this->stalls == 0) {
+				out << "No operations took " << latencyText(this->stall)
+					<< " or longer.\n";
+				return;
+			}
+			out << this->stalls << " operations took " << latencyText(this->stall)
+				<< " or longer:\n";
+			static const char *names[] = {"read", "write", "sync"};
+			for (std::vector<TraceRecord>::const_iterator
+				i = this->stallList.begin(); i != this->stallList.end(); i++
+			) {
+				out << "  at " << std::fixed << std::setprecision(3)
+					<< i->start / 1000000.0 << "s: " << names[i->op];
+				if (i->op != TRACE_SYNC) {
+					out << " of " << i->length << " bytes at " << i->offset;
+				}
+				out << " took " << latencyText(i->latency / 1000000.0);
+				if (i->result) out << " and failed (" << strerror(i->result) << ')';
+				out << "\n";
+			}
+			if (this->stalls > this->stallList.size()) {
+				out << "  ...and " << this->stalls - this->stallList.size()
+					<< " more\n";
+			}
+			return;
+		}
+
+		/// Format a latency with a sensible unit.
+		static std::string latencyText(double seconds)
+			throw ()
+		{
+			std::ostringstream s;
+			s << std::fixed;
+			if (seconds < 0.001) {
+				s << std::setprecision(0) << seconds * 1000000 << "us";
+			} else if (seconds < 1) {
+				s << std::setprecision(1) << seconds * 1000 << "ms";
+			} else {
+				s << std::setprecision(2) << seconds << 's';
+			}
+			return s.str();
+		}
+};
+
+void usage()
+{
+	std::cerr << "Use: scanflash-trace [options] <tracefile>\n"
+		"\n"
+		"Summarise a trace recorded with scanflash --trace.\n"
+		"\n"
+		"Options:\n"
+		"  -r, --rows=N              Split the device into N parts for the\n"
+		"                            latency map (default 32)\n"
+		"  -s, --stall=SECONDS       List operations that took at least this\n"
+		"                            long (default 1)\n"
+		"  -h, --help                Show this help\n"
+		<< std::endl;
+	return;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int rows = TRACE_DEFAULT_ROWS;
+	double stall = TRACE_DEFAULT_STALL;
+
+	static const struct option longOpts[] = {
+		{"rows",  required_argument, NULL, 'r'},
+		{"stall", required_argument, NULL, 's'},
+		{"help",  no_argument,       NULL, 'h'},
+		{NULL,    0,                 NULL, 0},
+	};
+	int c;
+	while ((c = getopt_long(argc, argv, "r:s:h", longOpts, NULL)) != -1) {
+		switch (c) {
+			case 'r':
+				rows = strtoul(optarg, NULL, 10);
+				if (rows < 1) {
+					std::cerr << "There must be at least one row" << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case 's':
+				stall = strtod(optarg, NULL);
+				if (stall <= 0) {
+					std::cerr << "Invalid stall time: " << optarg << std::endl;
+					return RET_BAD_ARGS;
+				}
+				break;
+			case 'h':
+				usage();
+				return RET_OK;
+			default:
+				usage();
+				return RET_BAD_ARGS;
+		}
+	}
+	if (argc - optind != 1) {
+		usage();
+		return RET_BAD_ARGS;
+	}
+
+	TraceReader *trace;
+	try {
+		trace = new TraceReader(argv[optind]);
+	} catch (const error& e) {
+		std::cerr << e.what() << std::endl;
+		return RET_NO_OPEN;
+	}
+
+	time_t tmStart = trace->startTime();
+	std::cout << "Trace of a " << trace->deviceSize() / 1048576
+		<< "MB device, started " << ctime(&tmStart);
+
+	int ret = RET_OK;
+	TraceStats stats(trace->deviceSize(), rows, stall);
+	TraceRecord rec;
+	try {
+		while (trace->next(&rec)) stats.add(rec);
+	} catch (const error& e) {
+		std::cout << e.what() << ", results are for the part before that.\n";
+		ret = RET_DAMAGED;
+	}
+	delete trace;
+
+	stats.report(std::cout);
+	std::cout << std::flush;
+	return ret;
+}
@@ -0,0 +1,141 @@
+/**
+ * @file  writespeed.cpp
+ * @brief Analysis of write throughput, to detect write cache exhaustion.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "writespeed.hpp"
+
+WriteSpeed::WriteSpeed()
+	throw ()
+	: blockSize(0)
+{
+}
+
+void WriteSpeed::start(block_t startBlock, unsigned int blockSize)
+	throw ()
+{
+	this->blockSize = blockSize;
+	this->samples.clear();
+	Sample s;
+	s.block = startBlock;
+	s.time = 0;
+	this->samples.push_back(s);
+	return;
+}
+
+void WriteSpeed::sample(block_t b, double elapsed)
+	throw ()
+{
+	if (this->samples.empty()) return; // start() not called
+	const Sample& last = this->samples.back();
+	// Ignore repeated updates for the same position (e.g. the final 100% one)
+	if ((b <= last.block) || (elapsed <= last.time)) return;
+	Sample s;
+	s.block = b;
+	s.time = elapsed;
+	this->samples.push_back(s);
+	return;
+}
+
+unsigned long WriteSpeed::rate(const Sample& a, const Sample& b) const
+	throw ()
+{
+	double duration = b.time - a.time;
+	if (duration <= 0) return 0;
+	return (unsigned long)((b.block - a.block) * (this->blockSize / 1024)
+		/ duration);
+}
+
+WriteSpeedResult WriteSpeed::analyse() const
+	throw ()
+{
+	WriteSpeedResult res;
+	res.valid = false;
+	res.cliff = false;
+	res.cacheSize = 0;
+	res.burstRate = 0;
+	res.sustainedRate = 0;
+
+	if (this->samples.size() < 2) return res;
+	const Sample& first = this->samples.front();
+	const Sample& last = this->samples.back();
+	res.valid = true;
+	res.burstRate = res.sustainedRate = this->rate(first, last);
+
+	// Split the samples into windows covering an equal number of blocks each
+	std::vector<unsigned int> bounds;
+	bounds.push_back(0);
+	block_t total = last.block - first.block;
+	unsigned int j = 0;
+	for (unsigned int w = 1; w <= WRITESPEED_WINDOWS; w++) {
+		block_t target = first.block + total * w / WRITESPEED_WINDOWS;
+		while ((j < this->samples.size() - 1) && (this->samples[j].block < target)) j++;
+		if (j > bounds.back()) bounds.push_back(j);
+	}
+	unsigned int numWindows = bounds.size() - 1;
+	if (numWindows < 4) return res; // not enough data to find a step
+
+	std::vector<double> rates;
+	for (unsigned int i = 0; i < numWindows; i++) {
+		rates.push_back(this->rate(this->samples[bounds[i]],
+			this->samples[bounds[i + 1]]));
+	}
+
+	// Fit a single step to the window speeds (least squares), leaving at least
+	// two windows after the step so the sustained speed is not a single outlier.
+	unsigned int bestStep = 0;
+	double bestErr = 0;
+	for (unsigned int k = 1; k + 2 <= numWindows; k++) {
+		double m1 = 0, m2 = 0;
+		for (unsigned int i = 0; i < k; i++) m1 += rates[i];
+		for (unsigned int i = k; i < numWindows; i++) m2 += rates[i];
+		m1 /= k;
+		m2 /= numWindows - k;
+		double err = 0;
+		for (unsigned int i = 0; i < numWindows; i++) {
+			double d = rates[i] - ((i < k) ? m1 : m2);
+			err += d * d;
+		}
+		if ((bestStep == 0) || (err < bestErr)) {
+			bestStep = k;
+			bestErr = err;
+		}
+	}
+
+	unsigned long before = this->rate(first, this->samples[bounds[bestStep]]);
+	unsigned long after = this->rate(this->samples[bounds[bestStep]], last);
+	if (before < after * WRITESPEED_CLIFF_RATIO) return res; // no cliff
+
+	// Find the exact progress update where the speed fell, within the windows
+	// either side of the step.
+	unsigned long mid = (before + after) / 2;
+	unsigned int cliff = bounds[bestStep];
+	for (unsigned int i = bounds[bestStep - 1]; i < bounds[bestStep + 1]; i++) {
+		if (this->rate(this->samples[i], this->samples[i + 1]) < mid) {
+			cliff = i;
+			break;
+		}
+	}
+	if (cliff == 0) cliff = bounds[bestStep];
+
+	res.cliff = true;
+	res.cacheSize = (this->samples[cliff].block - first.block) * this->blockSize;
+	res.burstRate = this->rate(first, this->samples[cliff]);
+	res.sustainedRate = this->rate(this->samples[cliff], last);
+	return res;
+}
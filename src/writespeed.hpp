@@ -0,0 +1,96 @@
+/**
+ * @file  writespeed.hpp
+ * @brief Analysis of write throughput, to detect write cache exhaustion.
+ *
+ * Copyright (C) 2012-2013 Adam Nielsen <malvineous@shikadi.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WRITESPEED_HPP_
+#define WRITESPEED_HPP_
+
+#include <vector>
+#include "device.hpp"
+
+/// Number of equal-sized windows the write phase is split into for analysis.
+#define WRITESPEED_WINDOWS 32
+
+/// Speed must drop by at least this factor to count as a cache cliff.
+#define WRITESPEED_CLIFF_RATIO 2.0
+
+/// Result of analysing the write phase.
+struct WriteSpeedResult
+{
+	bool valid;              ///< false if too little data was collected
+	bool cliff;              ///< true if a write cache was exhausted
+	block_t cacheSize;       ///< Bytes written before the cliff
+	unsigned long burstRate; ///< kB/sec before the cliff
+	unsigned long sustainedRate; ///< kB/sec after the cliff (or overall)
+};
+
+/// Collect write timing and look for the point where the speed drops.
+/**
+ * Many flash devices write into a fast (SLC) cache, then slow down by an
+ * order of magnitude once the cache is full.  The overall average hides this,
+ * so the write phase is split into windows and a single step is fitted to the
+ * per-window speeds.  If the speed before the step is much higher than after
+ * it, the cache size and the sustained (post-cache) speed are reported.
+ */
+class WriteSpeed
+{
+	public:
+		WriteSpeed()
+			throw ();
+
+		/// Discard any previous samples and start a new write phase.
+		/**
+		 * @param startBlock
+		 *   Block number the write phase starts at.
+		 *
+		 * @param blockSize
+		 *   Number of bytes in each block.
+		 */
+		void start(block_t startBlock, unsigned int blockSize)
+			throw ();
+
+		/// Record that block b has been reached after the given time.
+		/**
+		 * @param b
+		 *   Current block number.
+		 *
+		 * @param elapsed
+		 *   Time in seconds since start() was called.
+		 */
+		void sample(block_t b, double elapsed)
+			throw ();
+
+		/// Analyse the samples collected so far.
+		WriteSpeedResult analyse() const
+			throw ();
+
+	protected:
+		struct Sample {
+			block_t block;
+			double time;
+		};
+		std::vector<Sample> samples; ///< Position at each progress update
+		unsigned int blockSize;      ///< Bytes per block
+
+		/// Speed in kB/sec between two samples.
+		unsigned long rate(const Sample& a, const Sample& b) const
+			throw ();
+};
+
+#endif // WRITESPEED_HPP_